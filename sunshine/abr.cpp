@@ -0,0 +1,109 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include "config.h"
+#include "abr.h"
+#include "main.h"
+
+namespace abr {
+using namespace std::literals;
+
+controller_t::controller_t(int bitrate, video::bitrate_event_t bitrate_events) :
+  _last_change { std::chrono::steady_clock::now() },
+  _last_congestion { _last_change },
+  _bitrate_events { std::move(bitrate_events) } {
+
+  // A bitrate <= 500 means the client left the rate control to the encoder
+  _enabled = config::stream.abr_min_bitrate > 0 && bitrate > 500;
+
+  _max_bitrate = config::stream.abr_max_bitrate > 0 ? std::min(config::stream.abr_max_bitrate, bitrate) : bitrate;
+  _min_bitrate = std::min(config::stream.abr_min_bitrate, _max_bitrate);
+  _bitrate = _max_bitrate;
+
+  if(_enabled) {
+    BOOST_LOG(info) << "Adaptive bitrate between "sv << _min_bitrate << " and "sv << _max_bitrate << " kbps"sv;
+
+    if(_bitrate != bitrate) {
+      _bitrate_events->raise(_bitrate);
+    }
+  }
+}
+
+void controller_t::loss_report(int loss_count) {
+  if(!_enabled) {
+    return;
+  }
+
+  std::lock_guard lg { _lock };
+
+  if(loss_count > 0) {
+    congestion("packet loss"sv);
+  }
+  else {
+    probe();
+  }
+}
+
+void controller_t::queue_delay(std::chrono::nanoseconds delay) {
+  if(!_enabled) {
+    return;
+  }
+
+  std::lock_guard lg { _lock };
+
+  if(delay > config::stream.abr_max_delay) {
+    congestion("queueing delay"sv);
+  }
+  else {
+    probe();
+  }
+}
+
+int controller_t::bitrate() {
+  std::lock_guard lg { _lock };
+
+  return _bitrate;
+}
+
+void controller_t::congestion(std::string_view reason) {
+  auto now = std::chrono::steady_clock::now();
+  _last_congestion = now;
+
+  // Give the previous decision time to take effect before backing off any further
+  if(now - _last_change < config::stream.abr_interval) {
+    BOOST_LOG(debug) << "Adaptive bitrate: holding "sv << _bitrate << " kbps on "sv << reason;
+    return;
+  }
+
+  auto bitrate = std::max(_min_bitrate, _bitrate - _bitrate * config::stream.abr_backoff / 100);
+  change(bitrate, reason);
+}
+
+void controller_t::probe() {
+  auto now = std::chrono::steady_clock::now();
+
+  if(_bitrate >= _max_bitrate ||
+    now - _last_congestion < config::stream.abr_interval ||
+    now - _last_change < config::stream.abr_interval) {
+    return;
+  }
+
+  auto bitrate = std::min(_max_bitrate, _bitrate + std::max(1, _bitrate * config::stream.abr_step / 100));
+  change(bitrate, "no congestion"sv);
+}
+
+void controller_t::change(int bitrate, std::string_view reason) {
+  _last_change = std::chrono::steady_clock::now();
+
+  if(bitrate == _bitrate) {
+    BOOST_LOG(info) << "Adaptive bitrate: "sv << reason << ", staying at "sv << bitrate << " kbps"sv;
+    return;
+  }
+
+  BOOST_LOG(info) << "Adaptive bitrate: "sv << reason << ", "sv << _bitrate << " kbps --> "sv << bitrate << " kbps"sv;
+
+  _bitrate = bitrate;
+  _bitrate_events->raise(bitrate);
+}
+}
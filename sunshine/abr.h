@@ -0,0 +1,66 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#ifndef SUNSHINE_ABR_H
+#define SUNSHINE_ABR_H
+
+#include <chrono>
+#include <mutex>
+#include <string_view>
+
+#include "video.h"
+
+namespace abr {
+/*
+ * Adapts the bitrate of the video stream to the network:
+ * The bitrate backs off multiplicatively when the client reports loss or when frames queue up on the sender,
+ * it grows again in small steps once there was no congestion for stream.abr_interval
+ */
+class controller_t {
+public:
+  /**
+   * bitrate -- The bitrate in kbps requested by the client
+   * bitrate_events -- Receives the new bitrate in kbps on every change
+   */
+  controller_t(int bitrate, video::bitrate_event_t bitrate_events);
+
+  /**
+   * Called on every IDX_LOSS_STATS from the client
+   * loss_count -- Number of packets lost since the previous report
+   */
+  void loss_report(int loss_count);
+
+  /**
+   * Called for every frame that has been sent
+   * delay -- Time the frame spent waiting to be sent
+   */
+  void queue_delay(std::chrono::nanoseconds delay);
+
+  /**
+   * The current bitrate in kbps
+   */
+  int bitrate();
+
+private:
+  void congestion(std::string_view reason);
+  void probe();
+
+  void change(int bitrate, std::string_view reason);
+
+  std::mutex _lock;
+
+  bool _enabled;
+
+  int _bitrate;
+  int _min_bitrate;
+  int _max_bitrate;
+
+  std::chrono::steady_clock::time_point _last_change;
+  std::chrono::steady_clock::time_point _last_congestion;
+
+  video::bitrate_event_t _bitrate_events;
+};
+}
+
+#endif //SUNSHINE_ABR_H
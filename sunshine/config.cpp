@@ -20,10 +20,19 @@ video_t video {
   35, // qp
 
   2, // min_threads
+  0, // convert_threads
+  0, // pacing_spin
+  0, // intra_refresh
+  0, // roi_qp
+  0, // encode_governor
+  0, // client_mode
 
   0, // hevc_mode
+  0, // hevc_threads
   "superfast"s, // preset
-  "zerolatency"s // tune
+  "zerolatency"s, // tune
+
+  {} // capture_target
 };
 
 audio_t audio {};
@@ -33,7 +42,24 @@ stream_t stream {
 
   APPS_JSON,
 
-  13 // fecPercentage
+  13, // fecPercentage
+
+  0, // abr_min_bitrate
+  0, // abr_max_bitrate
+  5, // abr_step
+  20, // abr_backoff
+  500ms, // abr_interval
+  40ms, // abr_max_delay
+
+  "block"s, // queue_policy
+  0, // video_queue_size
+  0, // audio_queue_size
+  0ms, // max_frame_latency
+
+  "sendto"s, // send_engine
+
+  0, // pacing
+  0 // pacing_txtime
 };
 
 nvhttp_t nvhttp {
@@ -161,11 +187,23 @@ void parse_file(const char *file) {
   int_f(vars, "crf", video.crf);
   int_f(vars, "qp", video.qp);
   int_f(vars, "min_threads", video.min_threads);
+  int_f(vars, "convert_threads", video.convert_threads);
+  int_f(vars, "pacing_spin", video.pacing_spin);
+  int_f(vars, "intra_refresh", video.intra_refresh);
+  int_f(vars, "roi_qp", video.roi_qp);
+  int_between_f(vars, "encode_governor", video.encode_governor, {
+    0, 1
+  });
+  int_between_f(vars, "client_mode", video.client_mode, {
+    0, 1
+  });
   int_between_f(vars, "hevc_mode", video.hevc_mode, {
     0, 2
   });
+  int_f(vars, "hevc_threads", video.hevc_threads);
   string_f(vars, "preset", video.preset);
   string_f(vars, "tune", video.tune);
+  string_f(vars, "capture_target", video.capture_target);
 
   string_f(vars, "pkey", nvhttp.pkey);
   string_f(vars, "cert", nvhttp.cert);
@@ -189,6 +227,49 @@ void parse_file(const char *file) {
     1, 100
   });
 
+  int_f(vars, "abr_min_bitrate", stream.abr_min_bitrate);
+  int_f(vars, "abr_max_bitrate", stream.abr_max_bitrate);
+  int_between_f(vars, "abr_step", stream.abr_step, {
+    1, 100
+  });
+  int_between_f(vars, "abr_backoff", stream.abr_backoff, {
+    1, 99
+  });
+
+  to = -1;
+  int_f(vars, "abr_interval", to);
+  if(to > 0) {
+    stream.abr_interval = std::chrono::milliseconds(to);
+  }
+
+  to = -1;
+  int_f(vars, "abr_max_delay", to);
+  if(to > 0) {
+    stream.abr_max_delay = std::chrono::milliseconds(to);
+  }
+
+  string_restricted_f(vars, "queue_policy", stream.queue_policy, {
+    "block"sv, "drop_oldest"sv, "drop_non_reference"sv
+  });
+  int_f(vars, "video_queue_size", stream.video_queue_size);
+  int_f(vars, "audio_queue_size", stream.audio_queue_size);
+
+  to = -1;
+  int_f(vars, "max_frame_latency", to);
+  if(to >= 0) {
+    stream.max_frame_latency = std::chrono::milliseconds(to);
+  }
+
+  string_restricted_f(vars, "send_engine", stream.send_engine, {
+    "gso"sv, "sendmmsg"sv, "sendto"sv
+  });
+  int_between_f(vars, "pacing", stream.pacing, {
+    0, 100
+  });
+  int_between_f(vars, "pacing_txtime", stream.pacing_txtime, {
+    0, 1
+  });
+
   to = std::numeric_limits<int>::min();
   int_f(vars, "back_button_timeout", to);
 
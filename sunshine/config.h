@@ -11,10 +11,19 @@ struct video_t {
   int qp; // higher == more compression and less quality, ignored if crf != 0
 
   int min_threads; // Minimum number of threads/slices for CPU encoding
+  int convert_threads; // Number of bands converted in parallel, 0 == automatic
+  int pacing_spin; // Microseconds before a frame deadline spent spinning instead of sleeping
+  int intra_refresh; // Number of frames per intra refresh wave, 0 == IDR frames
+  int roi_qp; // QP removed around the cursor and recently changed areas, half of it is added elsewhere, 0 == disabled
+  int encode_governor; // Trade quality for speed when encoding takes longer than the frame budget, 0 == disabled
+  int client_mode; // Switch the display to the resolution and framerate of the client during a session, 0 == disabled
 
   int hevc_mode;
+  int hevc_threads; // Number of threads x265 uses to encode a single frame, 0 == every core
   std::string preset;
   std::string tune;
+
+  std::string capture_target; // Empty == the whole screen, apps may override it
 };
 
 struct audio_t {
@@ -27,6 +36,28 @@ struct stream_t {
   std::string file_apps;
 
   int fec_percentage;
+
+  // Adaptive bitrate, the bitrates are in kbps
+  int abr_min_bitrate; // 0 == adaptive bitrate disabled
+  int abr_max_bitrate; // 0 == the bitrate requested by the client
+  int abr_step; // Percentage added to the bitrate after abr_interval without congestion
+  int abr_backoff; // Percentage removed from the bitrate on congestion
+  std::chrono::milliseconds abr_interval; // Minimum time between two changes of the bitrate
+  std::chrono::milliseconds abr_max_delay; // Queueing delay on the sender that counts as congestion
+
+  // Could be any of the following values:
+  // block|drop_oldest|drop_non_reference
+  std::string queue_policy;
+  int video_queue_size; // Maximum number of video packets waiting to be sent, 0 == unbounded
+  int audio_queue_size; // Maximum number of audio packets waiting to be sent, 0 == unbounded
+  std::chrono::milliseconds max_frame_latency; // Frames not sent within this time after capture are dropped, 0 == never
+
+  // Could be any of the following values:
+  // gso|sendmmsg|sendto
+  std::string send_engine;
+
+  int pacing; // Percentage of the frame interval the packets of a frame are spread over, 0 == no pacing
+  int pacing_txtime; // Let the kernel pace the packets with SO_TXTIME
 };
 
 struct nvhttp_t {
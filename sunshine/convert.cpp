@@ -0,0 +1,496 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SUNSHINE_CONVERT_X86
+#include <immintrin.h>
+#endif
+
+namespace convert {
+using namespace std::literals;
+
+template<class T>
+T clamp_px(std::int32_t val, const coeffs_t &c) {
+  return (T)std::clamp(val, 0, c.max);
+}
+
+template<class T>
+void row_pair_c(const std::uint8_t *src0, const std::uint8_t *src1, T *y0, T *y1, T *u, T *v, int begin, int width, const coeffs_t &c) {
+  auto luma = [&c](const std::uint8_t *px) {
+    auto val = c.y[0] * px[0] + c.y[1] * px[1] + c.y[2] * px[2];
+
+    return clamp_px<T>(((val + (1 << (SHIFT - 1))) >> SHIFT) + c.y_offset, c);
+  };
+
+  for(int x = begin; x < width; x += 2) {
+    // An odd width repeats the last column for the chroma sample
+    auto x_r = std::min(x + 1, width - 1);
+
+    auto p00 = src0 + x * 4;
+    auto p01 = src0 + x_r * 4;
+    auto p10 = src1 + x * 4;
+    auto p11 = src1 + x_r * 4;
+
+    y0[x] = luma(p00);
+    y1[x] = luma(p10);
+    y0[x_r] = luma(p01);
+    y1[x_r] = luma(p11);
+
+    std::int32_t sum[3];
+    for(int i = 0; i < 3; ++i) {
+      sum[i] = p00[i] + p01[i] + p10[i] + p11[i];
+    }
+
+    auto val_u = c.u[0] * sum[0] + c.u[1] * sum[1] + c.u[2] * sum[2];
+    auto val_v = c.v[0] * sum[0] + c.v[1] * sum[1] + c.v[2] * sum[2];
+
+    u[x / 2] = clamp_px<T>(((val_u + (1 << (SHIFT + 1))) >> (SHIFT + 2)) + c.uv_offset, c);
+    v[x / 2] = clamp_px<T>(((val_v + (1 << (SHIFT + 1))) >> (SHIFT + 2)) + c.uv_offset, c);
+  }
+}
+
+#ifdef SUNSHINE_CONVERT_X86
+// The 4 coefficients of a pixel as a single 64 bit value, ready to be broadcast
+static inline long long pixel_coeffs(const std::int16_t *c) {
+  long long val;
+  std::memcpy(&val, c, sizeof(val));
+
+  return val;
+}
+
+/*
+ * The SIMD kernels follow the same integer arithmetic as row_pair_c, so every kernel produces identical output.
+ * Each returns the number of columns processed, the remainder is left for row_pair_c
+ */
+template<class T>
+__attribute__((target("sse4.1")))
+int block_sse41(const std::uint8_t *src0, const std::uint8_t *src1, T *y0, T *y1, T *u, T *v, int width, const coeffs_t &c) {
+  const auto zero = _mm_setzero_si128();
+
+  const auto cy = _mm_set1_epi64x(pixel_coeffs(c.y));
+  const auto cu = _mm_set1_epi64x(pixel_coeffs(c.u));
+  const auto cv = _mm_set1_epi64x(pixel_coeffs(c.v));
+
+  const auto round_y  = _mm_set1_epi32(1 << (SHIFT - 1));
+  const auto round_uv = _mm_set1_epi32(1 << (SHIFT + 1));
+  const auto off_y    = _mm_set1_epi32(c.y_offset);
+  const auto off_uv   = _mm_set1_epi32(c.uv_offset);
+  const auto max      = _mm_set1_epi16((std::int16_t)c.max);
+
+  int x = 0;
+  for(; x + 8 <= width; x += 8) {
+    auto a0 = _mm_loadu_si128((const __m128i*)(src0 + x * 4));
+    auto b0 = _mm_loadu_si128((const __m128i*)(src0 + x * 4 + 16));
+    auto a1 = _mm_loadu_si128((const __m128i*)(src1 + x * 4));
+    auto b1 = _mm_loadu_si128((const __m128i*)(src1 + x * 4 + 16));
+
+    // Two pixels per register, 16 bits per color
+    auto a0l = _mm_unpacklo_epi8(a0, zero);
+    auto a0h = _mm_unpackhi_epi8(a0, zero);
+    auto b0l = _mm_unpacklo_epi8(b0, zero);
+    auto b0h = _mm_unpackhi_epi8(b0, zero);
+    auto a1l = _mm_unpacklo_epi8(a1, zero);
+    auto a1h = _mm_unpackhi_epi8(a1, zero);
+    auto b1l = _mm_unpacklo_epi8(b1, zero);
+    auto b1h = _mm_unpackhi_epi8(b1, zero);
+
+    // madd yields { B*cb + G*cg, R*cr } per pixel, hadd completes the sum
+    auto ya0 = _mm_hadd_epi32(_mm_madd_epi16(a0l, cy), _mm_madd_epi16(a0h, cy));
+    auto yb0 = _mm_hadd_epi32(_mm_madd_epi16(b0l, cy), _mm_madd_epi16(b0h, cy));
+    auto ya1 = _mm_hadd_epi32(_mm_madd_epi16(a1l, cy), _mm_madd_epi16(a1h, cy));
+    auto yb1 = _mm_hadd_epi32(_mm_madd_epi16(b1l, cy), _mm_madd_epi16(b1h, cy));
+
+    ya0 = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(ya0, round_y), SHIFT), off_y);
+    yb0 = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(yb0, round_y), SHIFT), off_y);
+    ya1 = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(ya1, round_y), SHIFT), off_y);
+    yb1 = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(yb1, round_y), SHIFT), off_y);
+
+    auto row0 = _mm_packs_epi32(ya0, yb0);
+    auto row1 = _mm_packs_epi32(ya1, yb1);
+
+    // Sum both rows, then every pair of columns
+    auto sal = _mm_add_epi16(a0l, a1l);
+    auto sah = _mm_add_epi16(a0h, a1h);
+    auto sbl = _mm_add_epi16(b0l, b1l);
+    auto sbh = _mm_add_epi16(b0h, b1h);
+
+    auto u_v = _mm_hadd_epi32(
+      _mm_hadd_epi32(_mm_madd_epi16(sal, cu), _mm_madd_epi16(sah, cu)),
+      _mm_hadd_epi32(_mm_madd_epi16(sbl, cu), _mm_madd_epi16(sbh, cu)));
+    auto v_v = _mm_hadd_epi32(
+      _mm_hadd_epi32(_mm_madd_epi16(sal, cv), _mm_madd_epi16(sah, cv)),
+      _mm_hadd_epi32(_mm_madd_epi16(sbl, cv), _mm_madd_epi16(sbh, cv)));
+
+    u_v = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(u_v, round_uv), SHIFT + 2), off_uv);
+    v_v = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(v_v, round_uv), SHIFT + 2), off_uv);
+
+    // { u0, u1, u2, u3, v0, v1, v2, v3 }
+    auto uv = _mm_packs_epi32(u_v, v_v);
+
+    if constexpr (sizeof(T) == 1) {
+      auto y = _mm_packus_epi16(row0, row1);
+      _mm_storel_epi64((__m128i*)(y0 + x), y);
+      _mm_storel_epi64((__m128i*)(y1 + x), _mm_unpackhi_epi64(y, y));
+
+      uv = _mm_packus_epi16(uv, uv);
+      auto u_32 = _mm_cvtsi128_si32(uv);
+      auto v_32 = _mm_extract_epi32(uv, 1);
+      std::memcpy(u + x / 2, &u_32, sizeof(u_32));
+      std::memcpy(v + x / 2, &v_32, sizeof(v_32));
+    }
+    else {
+      row0 = _mm_min_epi16(_mm_max_epi16(row0, zero), max);
+      row1 = _mm_min_epi16(_mm_max_epi16(row1, zero), max);
+      uv   = _mm_min_epi16(_mm_max_epi16(uv, zero), max);
+
+      _mm_storeu_si128((__m128i*)(y0 + x), row0);
+      _mm_storeu_si128((__m128i*)(y1 + x), row1);
+      _mm_storel_epi64((__m128i*)(u + x / 2), uv);
+      _mm_storel_epi64((__m128i*)(v + x / 2), _mm_unpackhi_epi64(uv, uv));
+    }
+  }
+
+  return x;
+}
+
+// Restore the order of 64 bit blocks shuffled by in-lane hadd/pack
+#define PERMUTE_LANES(x) _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 1, 2, 0))
+
+template<class T>
+__attribute__((target("avx2")))
+int block_avx2(const std::uint8_t *src0, const std::uint8_t *src1, T *y0, T *y1, T *u, T *v, int width, const coeffs_t &c) {
+  const auto zero = _mm256_setzero_si256();
+
+  const auto cy = _mm256_set1_epi64x(pixel_coeffs(c.y));
+  const auto cu = _mm256_set1_epi64x(pixel_coeffs(c.u));
+  const auto cv = _mm256_set1_epi64x(pixel_coeffs(c.v));
+
+  const auto round_y  = _mm256_set1_epi32(1 << (SHIFT - 1));
+  const auto round_uv = _mm256_set1_epi32(1 << (SHIFT + 1));
+  const auto off_y    = _mm256_set1_epi32(c.y_offset);
+  const auto off_uv   = _mm256_set1_epi32(c.uv_offset);
+  const auto max      = _mm256_set1_epi16((std::int16_t)c.max);
+
+  int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    auto a0 = _mm256_loadu_si256((const __m256i*)(src0 + x * 4));
+    auto b0 = _mm256_loadu_si256((const __m256i*)(src0 + x * 4 + 32));
+    auto a1 = _mm256_loadu_si256((const __m256i*)(src1 + x * 4));
+    auto b1 = _mm256_loadu_si256((const __m256i*)(src1 + x * 4 + 32));
+
+    // lo --> { p0, p1 | p4, p5 }, hi --> { p2, p3 | p6, p7 }
+    auto a0l = _mm256_unpacklo_epi8(a0, zero);
+    auto a0h = _mm256_unpackhi_epi8(a0, zero);
+    auto b0l = _mm256_unpacklo_epi8(b0, zero);
+    auto b0h = _mm256_unpackhi_epi8(b0, zero);
+    auto a1l = _mm256_unpacklo_epi8(a1, zero);
+    auto a1h = _mm256_unpackhi_epi8(a1, zero);
+    auto b1l = _mm256_unpacklo_epi8(b1, zero);
+    auto b1h = _mm256_unpackhi_epi8(b1, zero);
+
+    // { p0, p1, p2, p3 | p4, p5, p6, p7 }
+    auto ya0 = _mm256_hadd_epi32(_mm256_madd_epi16(a0l, cy), _mm256_madd_epi16(a0h, cy));
+    auto yb0 = _mm256_hadd_epi32(_mm256_madd_epi16(b0l, cy), _mm256_madd_epi16(b0h, cy));
+    auto ya1 = _mm256_hadd_epi32(_mm256_madd_epi16(a1l, cy), _mm256_madd_epi16(a1h, cy));
+    auto yb1 = _mm256_hadd_epi32(_mm256_madd_epi16(b1l, cy), _mm256_madd_epi16(b1h, cy));
+
+    ya0 = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(ya0, round_y), SHIFT), off_y);
+    yb0 = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(yb0, round_y), SHIFT), off_y);
+    ya1 = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(ya1, round_y), SHIFT), off_y);
+    yb1 = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(yb1, round_y), SHIFT), off_y);
+
+    auto row0 = PERMUTE_LANES(_mm256_packs_epi32(ya0, yb0));
+    auto row1 = PERMUTE_LANES(_mm256_packs_epi32(ya1, yb1));
+
+    auto sal = _mm256_add_epi16(a0l, a1l);
+    auto sah = _mm256_add_epi16(a0h, a1h);
+    auto sbl = _mm256_add_epi16(b0l, b1l);
+    auto sbh = _mm256_add_epi16(b0h, b1h);
+
+    auto u_v = PERMUTE_LANES(_mm256_hadd_epi32(
+      _mm256_hadd_epi32(_mm256_madd_epi16(sal, cu), _mm256_madd_epi16(sah, cu)),
+      _mm256_hadd_epi32(_mm256_madd_epi16(sbl, cu), _mm256_madd_epi16(sbh, cu))));
+    auto v_v = PERMUTE_LANES(_mm256_hadd_epi32(
+      _mm256_hadd_epi32(_mm256_madd_epi16(sal, cv), _mm256_madd_epi16(sah, cv)),
+      _mm256_hadd_epi32(_mm256_madd_epi16(sbl, cv), _mm256_madd_epi16(sbh, cv))));
+
+    u_v = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(u_v, round_uv), SHIFT + 2), off_uv);
+    v_v = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(v_v, round_uv), SHIFT + 2), off_uv);
+
+    // { u0 .. u7 | v0 .. v7 }
+    auto uv = PERMUTE_LANES(_mm256_packs_epi32(u_v, v_v));
+
+    if constexpr (sizeof(T) == 1) {
+      // { row0[0 .. 15] | row1[0 .. 15] }
+      auto y = PERMUTE_LANES(_mm256_packus_epi16(row0, row1));
+      _mm_storeu_si128((__m128i*)(y0 + x), _mm256_castsi256_si128(y));
+      _mm_storeu_si128((__m128i*)(y1 + x), _mm256_extracti128_si256(y, 1));
+
+      auto uv_8 = _mm_packus_epi16(_mm256_castsi256_si128(uv), _mm256_extracti128_si256(uv, 1));
+      _mm_storel_epi64((__m128i*)(u + x / 2), uv_8);
+      _mm_storel_epi64((__m128i*)(v + x / 2), _mm_unpackhi_epi64(uv_8, uv_8));
+    }
+    else {
+      row0 = _mm256_min_epi16(_mm256_max_epi16(row0, zero), max);
+      row1 = _mm256_min_epi16(_mm256_max_epi16(row1, zero), max);
+      uv   = _mm256_min_epi16(_mm256_max_epi16(uv, zero), max);
+
+      _mm256_storeu_si256((__m256i*)(y0 + x), row0);
+      _mm256_storeu_si256((__m256i*)(y1 + x), row1);
+      _mm_storeu_si128((__m128i*)(u + x / 2), _mm256_castsi256_si128(uv));
+      _mm_storeu_si128((__m128i*)(v + x / 2), _mm256_extracti128_si256(uv, 1));
+    }
+  }
+
+  return x;
+}
+
+#undef PERMUTE_LANES
+
+// Sum of adjacent 32 bit elements, the result is stored in the even elements
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i pair_sum_avx512(__m512i x) {
+  return _mm512_add_epi32(x, _mm512_srli_epi64(x, 32));
+}
+
+template<class T>
+__attribute__((target("avx512f,avx512bw")))
+int block_avx512(const std::uint8_t *src0, const std::uint8_t *src1, T *y0, T *y1, T *u, T *v, int width, const coeffs_t &c) {
+  const auto zero = _mm512_setzero_si512();
+
+  const auto cy = _mm512_set1_epi64(pixel_coeffs(c.y));
+  const auto cu = _mm512_set1_epi64(pixel_coeffs(c.u));
+  const auto cv = _mm512_set1_epi64(pixel_coeffs(c.v));
+
+  const auto round_y  = _mm512_set1_epi32(1 << (SHIFT - 1));
+  const auto round_uv = _mm512_set1_epi32(1 << (SHIFT + 1));
+  const auto off_y    = _mm512_set1_epi32(c.y_offset);
+  const auto off_uv   = _mm512_set1_epi32(c.uv_offset);
+  const auto max      = _mm512_set1_epi32(c.max);
+
+  const auto even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+  const auto quad = _mm512_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28, 0, 4, 8, 12, 16, 20, 24, 28);
+
+  int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    // Eight pixels per register, in order
+    auto a0 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(src0 + x * 4)));
+    auto b0 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(src0 + x * 4 + 32)));
+    auto a1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(src1 + x * 4)));
+    auto b1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(src1 + x * 4 + 32)));
+
+    auto row0 = _mm512_permutex2var_epi32(
+      pair_sum_avx512(_mm512_madd_epi16(a0, cy)), even,
+      pair_sum_avx512(_mm512_madd_epi16(b0, cy)));
+    auto row1 = _mm512_permutex2var_epi32(
+      pair_sum_avx512(_mm512_madd_epi16(a1, cy)), even,
+      pair_sum_avx512(_mm512_madd_epi16(b1, cy)));
+
+    row0 = _mm512_add_epi32(_mm512_srai_epi32(_mm512_add_epi32(row0, round_y), SHIFT), off_y);
+    row1 = _mm512_add_epi32(_mm512_srai_epi32(_mm512_add_epi32(row1, round_y), SHIFT), off_y);
+    row0 = _mm512_min_epi32(_mm512_max_epi32(row0, zero), max);
+    row1 = _mm512_min_epi32(_mm512_max_epi32(row1, zero), max);
+
+    // Sum both rows, then move the right column of each pair onto the left column
+    auto sa = _mm512_add_epi16(a0, a1);
+    auto sb = _mm512_add_epi16(b0, b1);
+
+    auto ua = pair_sum_avx512(_mm512_madd_epi16(sa, cu));
+    auto ub = pair_sum_avx512(_mm512_madd_epi16(sb, cu));
+    auto va = pair_sum_avx512(_mm512_madd_epi16(sa, cv));
+    auto vb = pair_sum_avx512(_mm512_madd_epi16(sb, cv));
+
+    ua = _mm512_add_epi32(ua, _mm512_bsrli_epi128(ua, 8));
+    ub = _mm512_add_epi32(ub, _mm512_bsrli_epi128(ub, 8));
+    va = _mm512_add_epi32(va, _mm512_bsrli_epi128(va, 8));
+    vb = _mm512_add_epi32(vb, _mm512_bsrli_epi128(vb, 8));
+
+    // { u0 .. u7, v0 .. v7 }
+    auto uv = _mm512_inserti64x4(
+      _mm512_castsi256_si512(_mm512_castsi512_si256(_mm512_permutex2var_epi32(ua, quad, ub))),
+      _mm512_castsi512_si256(_mm512_permutex2var_epi32(va, quad, vb)), 1);
+
+    uv = _mm512_add_epi32(_mm512_srai_epi32(_mm512_add_epi32(uv, round_uv), SHIFT + 2), off_uv);
+    uv = _mm512_min_epi32(_mm512_max_epi32(uv, zero), max);
+
+    if constexpr (sizeof(T) == 1) {
+      _mm_storeu_si128((__m128i*)(y0 + x), _mm512_cvtepi32_epi8(row0));
+      _mm_storeu_si128((__m128i*)(y1 + x), _mm512_cvtepi32_epi8(row1));
+
+      auto uv_8 = _mm512_cvtepi32_epi8(uv);
+      _mm_storel_epi64((__m128i*)(u + x / 2), uv_8);
+      _mm_storel_epi64((__m128i*)(v + x / 2), _mm_unpackhi_epi64(uv_8, uv_8));
+    }
+    else {
+      _mm256_storeu_si256((__m256i*)(y0 + x), _mm512_cvtepi32_epi16(row0));
+      _mm256_storeu_si256((__m256i*)(y1 + x), _mm512_cvtepi32_epi16(row1));
+
+      auto uv_16 = _mm512_cvtepi32_epi16(uv);
+      _mm_storeu_si128((__m128i*)(u + x / 2), _mm256_castsi256_si128(uv_16));
+      _mm_storeu_si128((__m128i*)(v + x / 2), _mm256_extracti128_si256(uv_16, 1));
+    }
+  }
+
+  return x;
+}
+#endif
+
+template<class T>
+using block_t = int (*)(const std::uint8_t *, const std::uint8_t *, T *, T *, T *, T *, int, const coeffs_t &);
+
+template<class T>
+int block_none(const std::uint8_t *, const std::uint8_t *, T *, T *, T *, T *, int, const coeffs_t &) {
+  return 0;
+}
+
+template<class T, block_t<T> block>
+void row_pair(const std::uint8_t *src0, const std::uint8_t *src1, T *y0, T *y1, T *u, T *v, int width, const coeffs_t &c) {
+  auto x = block(src0, src1, y0, y1, u, v, width, c);
+
+  row_pair_c(src0, src1, y0, y1, u, v, x, width, c);
+}
+
+yuv420_t::yuv420_t(int csc_mode, int bit_depth) : bit_depth { bit_depth } {
+  double kr, kb;
+  switch(csc_mode >> 1) {
+    case 0:
+    default:
+      // Rec. 601
+      kr = 0.299;
+      kb = 0.114;
+      break;
+    case 1:
+      // Rec. 709
+      kr = 0.2126;
+      kb = 0.0722;
+      break;
+    case 2:
+      // Rec. 2020
+      kr = 0.2627;
+      kb = 0.0593;
+      break;
+  }
+  auto kg = 1.0 - kr - kb;
+
+  auto shift_depth = bit_depth - 8;
+
+  double y_scale, uv_scale;
+  if(csc_mode & 0x1) {
+    y_scale  = (1 << bit_depth) - 1;
+    uv_scale = y_scale;
+
+    coeffs.y_offset = 0;
+  }
+  else {
+    y_scale  = 219 << shift_depth;
+    uv_scale = 224 << shift_depth;
+
+    coeffs.y_offset = 16 << shift_depth;
+  }
+  coeffs.uv_offset = 128 << shift_depth;
+  coeffs.max = (1 << bit_depth) - 1;
+
+  auto fixed = [](double k, double scale) {
+    return (std::int16_t)std::lround(k * scale / 255.0 * (1 << SHIFT));
+  };
+
+  // B, G, R, X
+  coeffs.y[0] = fixed(kb, y_scale);
+  coeffs.y[1] = fixed(kg, y_scale);
+  coeffs.y[2] = fixed(kr, y_scale);
+  coeffs.y[3] = 0;
+
+  coeffs.u[0] = fixed(0.5, uv_scale);
+  coeffs.u[1] = fixed(-kg / (2.0 * (1.0 - kb)), uv_scale);
+  coeffs.u[2] = fixed(-kr / (2.0 * (1.0 - kb)), uv_scale);
+  coeffs.u[3] = 0;
+
+  coeffs.v[0] = fixed(-kb / (2.0 * (1.0 - kr)), uv_scale);
+  coeffs.v[1] = fixed(-kg / (2.0 * (1.0 - kr)), uv_scale);
+  coeffs.v[2] = fixed(0.5, uv_scale);
+  coeffs.v[3] = 0;
+
+  for(auto kernel : { "avx512"sv, "avx2"sv, "sse4.1"sv, "c"sv }) {
+    if(!use_kernel(kernel)) {
+      break;
+    }
+  }
+}
+
+int yuv420_t::use_kernel(const std::string_view &kernel) {
+  if(kernel == "c"sv) {
+    _row_8  = &row_pair<std::uint8_t, block_none<std::uint8_t>>;
+    _row_16 = &row_pair<std::uint16_t, block_none<std::uint16_t>>;
+    _kernel = "c"sv;
+
+    return 0;
+  }
+
+#ifdef SUNSHINE_CONVERT_X86
+  __builtin_cpu_init();
+  if(kernel == "avx512"sv && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    _row_8  = &row_pair<std::uint8_t, block_avx512<std::uint8_t>>;
+    _row_16 = &row_pair<std::uint16_t, block_avx512<std::uint16_t>>;
+    _kernel = "avx512"sv;
+
+    return 0;
+  }
+
+  if(kernel == "avx2"sv && __builtin_cpu_supports("avx2")) {
+    _row_8  = &row_pair<std::uint8_t, block_avx2<std::uint8_t>>;
+    _row_16 = &row_pair<std::uint16_t, block_avx2<std::uint16_t>>;
+    _kernel = "avx2"sv;
+
+    return 0;
+  }
+
+  if(kernel == "sse4.1"sv && __builtin_cpu_supports("sse4.1")) {
+    _row_8  = &row_pair<std::uint8_t, block_sse41<std::uint8_t>>;
+    _row_16 = &row_pair<std::uint16_t, block_sse41<std::uint16_t>>;
+    _kernel = "sse4.1"sv;
+
+    return 0;
+  }
+#endif
+
+  return -1;
+}
+
+void yuv420_t::operator()(
+  const std::uint8_t *src, int src_linesize, int width, int height,
+  std::uint8_t *const *dst, const int *dst_linesize,
+  int row_begin, int row_end) const {
+
+  row_end = std::min(row_end, height);
+  for(int y = row_begin; y < row_end; y += 2) {
+    // An odd height repeats the last row for the chroma samples
+    auto y_b = std::min(y + 1, height - 1);
+
+    auto src0 = src + y * src_linesize;
+    auto src1 = src + y_b * src_linesize;
+
+    auto luma0 = dst[0] + y * dst_linesize[0];
+    auto luma1 = dst[0] + y_b * dst_linesize[0];
+    auto cb    = dst[1] + (y / 2) * dst_linesize[1];
+    auto cr    = dst[2] + (y / 2) * dst_linesize[2];
+
+    if(bit_depth == 8) {
+      _row_8(src0, src1, luma0, luma1, cb, cr, width, coeffs);
+    }
+    else {
+      _row_16(src0, src1, (std::uint16_t*)luma0, (std::uint16_t*)luma1, (std::uint16_t*)cb, (std::uint16_t*)cr, width, coeffs);
+    }
+  }
+}
+
+std::string_view yuv420_t::kernel() const {
+  return _kernel;
+}
+}
@@ -0,0 +1,68 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#ifndef SUNSHINE_CONVERT_H
+#define SUNSHINE_CONVERT_H
+
+#include <cstdint>
+#include <string_view>
+
+namespace convert {
+// Fractional bits of the fixed point coefficients
+constexpr int SHIFT = 13;
+
+struct coeffs_t {
+  // Per pixel in memory order: B, G, R, X
+  std::int16_t y[4];
+  std::int16_t u[4];
+  std::int16_t v[4];
+
+  std::int32_t y_offset;
+  std::int32_t uv_offset;
+  std::int32_t max;
+};
+
+/*
+ * BGR0 --> YUV420P or YUV420P10 without scaling
+ *
+ * csc_mode  -- encoderCscMode as sent by Moonlight:
+ *    bit 0   : full range
+ *    bit 1-2 : 0 -> Rec. 601, 1 -> Rec. 709, 2 -> Rec. 2020
+ * bit_depth -- 8 or 10
+ */
+class yuv420_t {
+public:
+  yuv420_t(int csc_mode, int bit_depth);
+
+  /**
+   * Convert the rows [row_begin, row_end) of src
+   * row_begin must be even, so different bands never share a chroma row
+   */
+  void operator()(
+    const std::uint8_t *src, int src_linesize, int width, int height,
+    std::uint8_t *const *dst, const int *dst_linesize,
+    int row_begin, int row_end) const;
+
+  /**
+   * Use kernel instead of the fastest kernel the CPU supports: c, sse4.1, avx2 or avx512
+   * returns -1 if the CPU doesn't support kernel
+   */
+  int use_kernel(const std::string_view &kernel);
+
+  std::string_view kernel() const;
+
+  coeffs_t coeffs;
+  int bit_depth;
+
+private:
+  using row_8_t  = void (*)(const std::uint8_t *, const std::uint8_t *, std::uint8_t *, std::uint8_t *, std::uint8_t *, std::uint8_t *, int, const coeffs_t &);
+  using row_16_t = void (*)(const std::uint8_t *, const std::uint8_t *, std::uint16_t *, std::uint16_t *, std::uint16_t *, std::uint16_t *, int, const coeffs_t &);
+
+  row_8_t _row_8;
+  row_16_t _row_16;
+  std::string_view _kernel;
+};
+}
+
+#endif //SUNSHINE_CONVERT_H
@@ -0,0 +1,81 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#ifndef SUNSHINE_ENCODER_H
+#define SUNSHINE_ENCODER_H
+
+#include <memory>
+
+#include "video.h"
+
+struct AVFrame;
+namespace video {
+/*
+ * Colour description signalled in the VUI
+ * The values are the code points of ISO/IEC 23001-8, ffmpeg's AVCOL_* enums use the same values
+ */
+struct colorspace_t {
+  int primaries;
+  int trc;
+  int matrix;
+
+  bool full_range;
+};
+
+colorspace_t colorspace(const config_t &config);
+
+// The qoffset of AVRegionOfInterest is a fraction of the QP range of the codec: libavcodec's libx264 wrapper
+// scales it by 51 + 6 * (bit depth - 8), its libx265 wrapper by 25
+constexpr auto ROI_QP_RANGE_H264 = 51;
+constexpr auto ROI_QP_RANGE_HEVC = 25;
+
+/**
+ * returns the QP range the encoder of config scales the qoffset of AVRegionOfInterest by
+ */
+int roi_qp_range(const config_t &config);
+
+class encoder_t {
+public:
+  /**
+   * Encode yuv_frame with frame as its pts, the resulting packets are raised on packets
+   * captured -- When yuv_frame was captured, passed on to the packets
+   * idr -- Force an IDR frame
+   * recovery -- The frame answers a request for an IDR frame, passed on to the packets
+   */
+  virtual void encode(std::int64_t frame, AVFrame *yuv_frame, std::chrono::steady_clock::time_point captured, bool idr, bool recovery, packet_queue_t &packets) = 0;
+
+  /**
+   * Make sure the next frame doesn't reference any frame with a pts >= first,
+   * or with intra refresh, restart the refresh of the picture
+   * returns -1 if this isn't possible, the caller has to force an IDR frame instead
+   */
+  virtual int invalidate_ref_frames(std::int64_t first, std::int64_t last) {
+    return -1;
+  }
+
+  /**
+   * Change the target bitrate in kbps without restarting the encoder
+   * returns -1 if the encoder can't change its bitrate
+   */
+  virtual int set_bitrate(int bitrate) = 0;
+
+  /**
+   * Trade quality for encoding speed: level 0 is the configured speed, every level is faster than the one before
+   * returns -1 if the encoder has no such level
+   */
+  virtual int set_speed(int level) {
+    return level ? -1 : 0;
+  }
+
+  virtual ~encoder_t() = default;
+};
+
+// Encodes through libavcodec, supports every codec the client may request
+std::unique_ptr<encoder_t> avcodec_encoder(const config_t &config);
+
+// Encodes H.264 through libx264 directly, which allows invalidating reference frames
+std::unique_ptr<encoder_t> x264_encoder(const config_t &config);
+}
+
+#endif //SUNSHINE_ENCODER_H
@@ -0,0 +1,175 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#ifndef SUNSHINE_ENCODER_INPUT_H
+#define SUNSHINE_ENCODER_INPUT_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace video {
+// Clients repeat a request for an IDR frame until it arrives, repeated requests for frames lost
+// before the latest recovery frame are ignored for this long
+constexpr std::chrono::milliseconds IDR_COALESCE { 50 };
+
+// The first and last frame a request for an IDR frame covers
+using idr_t = std::pair<std::int64_t, std::int64_t>;
+
+/*
+ * Input of the encoder: the latest converted frame and the pending request for an IDR frame
+ * The encoder wakes up on either of them, so a request is answered right away by encoding the previous frame again,
+ * instead of waiting for the next frame to be captured and converted
+ */
+template<class T>
+class encoder_input_t {
+public:
+  void raise(T &&frame, std::chrono::steady_clock::time_point captured) {
+    std::lock_guard lg { _lock };
+    if(!_continue) {
+      return;
+    }
+
+    _frame = std::move(frame);
+    _captured = captured;
+
+    _cv.notify_all();
+  }
+
+  /**
+   * Requests the encoder hasn't got to yet are merged into a single request covering all of their frames
+   */
+  void raise_idr(const idr_t &idr) {
+    std::lock_guard lg { _lock };
+    if(!_continue) {
+      return;
+    }
+
+    if(_idr) {
+      _idr->first  = std::min(_idr->first, idr.first);
+      _idr->second = std::max(_idr->second, idr.second);
+    }
+    else {
+      _idr = idr;
+    }
+
+    _cv.notify_all();
+  }
+
+  /**
+   * Wait for a new frame or a request for an IDR frame, either may be empty on return
+   * returns false once stopped
+   */
+  bool wait(T &frame, std::chrono::steady_clock::time_point &captured, std::optional<idr_t> &idr) {
+    std::unique_lock ul { _lock };
+
+    _cv.wait(ul, [this]() {
+      return !_continue || _frame || _idr;
+    });
+
+    if(!_continue) {
+      return false;
+    }
+
+    frame = std::move(_frame);
+    captured = _captured;
+    idr = std::exchange(_idr, std::nullopt);
+
+    return true;
+  }
+
+  void stop() {
+    std::lock_guard lg { _lock };
+
+    _continue = false;
+
+    _cv.notify_all();
+  }
+
+private:
+  bool _continue { true };
+
+  T _frame;
+  std::chrono::steady_clock::time_point _captured;
+  std::optional<idr_t> _idr;
+
+  std::condition_variable _cv;
+  std::mutex _lock;
+};
+
+/*
+ * Decides what the encoder does each time it wakes up: encode the new frame,
+ * encode the latest frame again to answer a request for an IDR frame, or nothing at all
+ */
+template<class T>
+class encode_schedule_t {
+public:
+  /**
+   * Wait until there's something to encode, the members below describe it
+   * now -- Returns the current time
+   * returns false once stopped
+   */
+  template<class Now>
+  bool wait(encoder_input_t<T> &input, Now &&now) {
+    T new_frame;
+    std::chrono::steady_clock::time_point new_captured;
+
+    while(input.wait(new_frame, new_captured, request)) {
+      repeat = !new_frame;
+      if(!repeat) {
+        frame = std::move(new_frame);
+        captured = new_captured;
+      }
+
+      if(!frame) {
+        // The first frame is an IDR frame regardless
+        continue;
+      }
+
+      time = now();
+      if(request && request->first < _recovery_frame && time - _recovery_time < IDR_COALESCE) {
+        request.reset();
+      }
+
+      if(!repeat || request) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * The frame with pts pts answered the request
+   */
+  void recovered(std::int64_t pts) {
+    _recovery_frame = pts;
+    _recovery_time = time;
+  }
+
+  // The latest frame, encoded again when an IDR frame is requested before the next frame arrives
+  T frame;
+  std::chrono::steady_clock::time_point captured;
+
+  // True if frame was encoded before
+  bool repeat {};
+
+  // The request for an IDR frame to answer, if any
+  std::optional<idr_t> request;
+
+  // When wait() returned
+  std::chrono::steady_clock::time_point time;
+
+private:
+  // The frame that answered the latest request for an IDR frame
+  std::int64_t _recovery_frame {};
+  std::chrono::steady_clock::time_point _recovery_time;
+};
+}
+
+#endif //SUNSHINE_ENCODER_INPUT_H
@@ -0,0 +1,536 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <x264.h>
+}
+
+#include "config.h"
+#include "encoder.h"
+#include "main.h"
+#include "trace.h"
+
+namespace video {
+using namespace std::literals;
+
+// Number of frames kept as reference when the client doesn't limit it,
+// a lost frame can only be recovered from without an IDR frame while the frame before it is still kept
+constexpr auto MAX_DPB_SIZE = 16;
+
+using x264_enc_t = util::safe_ptr<x264_t, x264_encoder_close>;
+
+void log_x264(void *, int level, const char *fmt, va_list args) {
+  char msg[1024];
+  auto size = std::vsnprintf(msg, sizeof(msg), fmt, args);
+
+  // Strip the trailing newline
+  std::string_view msg_view { msg, (std::size_t)std::clamp<int>(size, 0, sizeof(msg) - 1) };
+  if(!msg_view.empty() && msg_view.back() == '\n') {
+    msg_view.remove_suffix(1);
+  }
+
+  switch(level) {
+    case X264_LOG_ERROR:
+      BOOST_LOG(error) << "x264: "sv << msg_view;
+      break;
+    case X264_LOG_WARNING:
+      BOOST_LOG(warning) << "x264: "sv << msg_view;
+      break;
+    default:
+      BOOST_LOG(debug) << "x264: "sv << msg_view;
+      break;
+  }
+}
+
+/**
+ * Some client decoders have limits on the number of reference frames.
+ * Any frame kept in the DPB can serve as reference after the frames following it are lost
+ */
+int dpb_frames(const config_t &config) {
+  return config.numRefFrames > 0 ? config.numRefFrames : MAX_DPB_SIZE;
+}
+
+/**
+ * returns the index of preset in x264_preset_names, or -1 if x264 doesn't know it
+ */
+int preset_index(const std::string &preset) {
+  for(int x = 0; x264_preset_names[x]; ++x) {
+    if(preset == x264_preset_names[x] || preset == std::to_string(x)) {
+      return x;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Fill in the parameters for config, encoded with preset by threads slice threads
+ */
+int make_param(x264_param_t &param, const config_t &config, int preset, int threads) {
+  if(x264_param_default_preset(&param, x264_preset_names[preset], config::video.tune.c_str())) {
+    BOOST_LOG(error) << "Invalid x264 tune ["sv << config::video.tune << ']';
+
+    return -1;
+  }
+
+  param.pf_log = log_x264;
+  param.i_log_level = X264_LOG_WARNING;
+
+  param.i_width = config.width;
+  param.i_height = config.height;
+  param.i_csp = X264_CSP_I420;
+
+  param.i_fps_num = config.framerate;
+  param.i_fps_den = 1;
+  param.i_timebase_num = 1;
+  param.i_timebase_den = config.framerate;
+  param.b_vfr_input = 0;
+
+  auto color = colorspace(config);
+  param.vui.b_fullrange = color.full_range;
+  param.vui.i_colorprim = color.primaries;
+  param.vui.i_transfer = color.trc;
+  param.vui.i_colmatrix = color.matrix;
+
+  // B-frames delay decoder output, so never use them
+  param.i_bframe = 0;
+
+  // The slices of a frame are labelled with the frame that was passed in, so whatever the tune,
+  // x264 must not hold frames back for the lookahead
+  param.rc.i_lookahead = 0;
+  param.i_sync_lookahead = 0;
+  param.rc.b_mb_tree = 0;
+
+  // Use an infinite GOP length since I-frames are generated on demand
+  param.i_keyint_max = X264_KEYINT_MAX_INFINITE;
+  param.b_open_gop = 0;
+
+  // With intra refresh, the GOP length is the length of a refresh wave
+  if(config::video.intra_refresh > 0) {
+    param.b_intra_refresh = 1;
+    param.i_keyint_max = config::video.intra_refresh;
+  }
+
+  auto dpb_size = dpb_frames(config);
+  param.i_frame_reference = std::min(param.i_frame_reference, dpb_size);
+  param.i_dpb_size = dpb_size;
+
+  param.i_slice_count = threads;
+  param.i_threads = threads;
+  param.b_sliced_threads = 1;
+
+  if(config.bitrate > 500) {
+    param.rc.i_rc_method = X264_RC_ABR;
+    param.rc.i_bitrate = config.bitrate;
+    param.rc.i_vbv_max_bitrate = config.bitrate;
+    param.rc.i_vbv_buffer_size = config.bitrate / 100;
+  }
+  else if(config::video.crf != 0) {
+    param.rc.i_rc_method = X264_RC_CRF;
+    param.rc.f_rf_constant = config::video.crf;
+  }
+  else {
+    param.rc.i_rc_method = X264_RC_CQP;
+    param.rc.i_qp_constant = config::video.qp;
+  }
+
+  // x264 applies the regions of interest through adaptive quantization
+  if(config::video.roi_qp && param.rc.i_aq_mode == X264_AQ_NONE) {
+    param.rc.i_aq_mode = X264_AQ_VARIANCE;
+    param.rc.f_aq_strength = 0.0f;
+  }
+
+  // Every IDR frame carries the SPS and PPS, the decoder may start from any of them
+  param.b_repeat_headers = 1;
+  param.b_annexb = 1;
+
+  if(x264_param_apply_profile(&param, "high")) {
+    return -1;
+  }
+
+  return 0;
+}
+
+class x264_encoder_t : public encoder_t {
+public:
+  x264_encoder_t(const config_t &config, int base_preset, int base_threads) :
+    config { config }, dpb_size { dpb_frames(config) }, intra_refresh { config::video.intra_refresh > 0 },
+    base_preset { base_preset }, base_threads { base_threads } {}
+
+  /**
+   * Open a new encoder with preset and threads slice threads, the current encoder is kept on failure
+   */
+  int open(int preset, int threads) {
+    x264_param_t param;
+    if(make_param(param, config, preset, threads)) {
+      return -1;
+    }
+
+    // Hand every slice to the packetizer as soon as it's encoded
+    param.nalu_process = nalu_process;
+
+    // The bitrate may have changed since the previous encoder was opened
+    if(enc) {
+      x264_param_t current;
+      x264_encoder_parameters(enc.get(), &current);
+
+      param.rc = current.rc;
+    }
+
+    x264_enc_t new_enc { x264_encoder_open(&param) };
+    if(!new_enc) {
+      BOOST_LOG(error) << "Could not open x264 encoder"sv;
+
+      return -1;
+    }
+
+    // x264 may use fewer slices than requested
+    x264_encoder_parameters(new_enc.get(), &param);
+
+    // A new encoder starts with an IDR frame
+    reopened = (bool)enc;
+
+    enc = std::move(new_enc);
+    slice_count = std::max(1, param.i_slice_count);
+    block_count = std::min(slice_count, MAX_FEC_BLOCKS);
+
+    this->preset = preset;
+    this->threads = threads;
+
+    return 0;
+  }
+
+  void encode(std::int64_t frame, AVFrame *yuv_frame, std::chrono::steady_clock::time_point captured, bool idr, bool recovery, packet_queue_t &packets) override {
+    if(reopened) {
+      idr = true;
+      reopened = false;
+    }
+
+    x264_picture_t pic_in;
+    x264_picture_init(&pic_in);
+
+    pic_in.img.i_csp = X264_CSP_I420;
+    pic_in.img.i_plane = 3;
+    for(int x = 0; x < 3; ++x) {
+      pic_in.img.plane[x] = yuv_frame->data[x];
+      pic_in.img.i_stride[x] = yuv_frame->linesize[x];
+    }
+
+    pic_in.i_pts = frame;
+    pic_in.i_type = idr ? X264_TYPE_IDR : X264_TYPE_AUTO;
+    pic_in.opaque = this;
+
+    pic_in.prop.quant_offsets = quant_offsets(yuv_frame);
+    pic_in.prop.quant_offsets_free = std::free;
+
+    {
+      std::lock_guard lg { slice_lock };
+
+      this->packets = &packets;
+      this->captured = captured;
+      this->recovery = recovery;
+      pts = frame;
+      next_mb = 0;
+      slices_done = 0;
+      block_index = 0;
+      key_frame = false;
+      reference = true;
+      block.clear();
+      slices.clear();
+    }
+
+    x264_picture_t pic_out;
+    x264_nal_t *nals;
+    int nal_count;
+
+    // The NAL units are passed to nalu_process while the frame is encoded
+    auto size = x264_encoder_encode(enc.get(), &nals, &nal_count, &pic_in, &pic_out);
+    if(size < 0) {
+      BOOST_LOG(fatal) << "Could not encode video packet"sv;
+      log_flush();
+      std::abort();
+    }
+
+    if(idr) {
+      idr_pts = frame;
+    }
+    last_pts = frame;
+
+    std::lock_guard lg { slice_lock };
+    if(size > 0 && slices_done != slice_count) {
+      BOOST_LOG(error) << "Frame ["sv << frame << "] ended after "sv << slices_done << " out of "sv << slice_count << " slices"sv;
+    }
+  }
+
+  /**
+   * Translate the regions of interest attached to the frame to a QP offset per macroblock
+   * returns nullptr if the frame has no regions of interest
+   */
+  static float *quant_offsets(const AVFrame *frame) {
+    auto side_data = av_frame_get_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if(!side_data || !side_data->size) {
+      return nullptr;
+    }
+
+    auto mb_width = (frame->width + 15) / 16;
+    auto mb_height = (frame->height + 15) / 16;
+
+    auto offsets = (float*)std::calloc(mb_width * mb_height, sizeof(float));
+    if(!offsets) {
+      return nullptr;
+    }
+
+    auto self_size = ((const AVRegionOfInterest*)side_data->data)->self_size;
+    auto count = side_data->size / self_size;
+
+    // Where regions overlap, the first one takes precedence
+    for(auto x = count; x-- > 0;) {
+      auto region = (const AVRegionOfInterest*)(side_data->data + x * self_size);
+      // Only 8 bit H.264 is encoded by libx264 directly
+      auto offset = (float)(av_q2d(region->qoffset) * ROI_QP_RANGE_H264);
+
+      auto mb_bottom = std::min(mb_height, (region->bottom + 15) / 16);
+      auto mb_right = std::min(mb_width, (region->right + 15) / 16);
+      for(auto mb_y = region->top / 16; mb_y < mb_bottom; ++mb_y) {
+        std::fill(offsets + mb_y * mb_width + region->left / 16, offsets + mb_y * mb_width + mb_right, offset);
+      }
+    }
+
+    return offsets;
+  }
+
+  /**
+   * Called from the slice threads as soon as a NAL unit is encoded, in no particular order
+   */
+  static void nalu_process(x264_t *h, x264_nal_t *nal, void *opaque) {
+    auto self = (x264_encoder_t*)opaque;
+
+    // Encapsulate outside the lock, every call gets its own buffer
+    std::vector<std::uint8_t> data(nal->i_payload * 3 / 2 + 5 + 64);
+    x264_nal_encode(h, data.data(), nal);
+    data.resize(nal->i_payload);
+
+    self->add_nal(nal->i_type, nal->i_ref_idc, nal->i_first_mb, nal->i_last_mb, std::move(data));
+  }
+
+  void add_nal(int type, int ref_idc, int first_mb, int last_mb, std::vector<std::uint8_t> &&data) {
+    std::lock_guard lg { slice_lock };
+
+    // Parameter sets and SEI are written before any slice is started
+    if(type != NAL_SLICE && type != NAL_SLICE_IDR) {
+      block.insert(std::end(block), std::begin(data), std::end(data));
+      return;
+    }
+
+    if(type == NAL_SLICE_IDR) {
+      key_frame = true;
+    }
+    reference = ref_idc != NAL_PRIORITY_DISPOSABLE;
+
+    slices.emplace(first_mb, slice_t { last_mb, std::move(data) });
+
+    // Append the slices that continue the frame without a gap
+    for(auto it = std::begin(slices); it != std::end(slices) && it->first == next_mb; it = slices.erase(it)) {
+      auto &slice = it->second;
+
+      block.insert(std::end(block), std::begin(slice.data), std::end(slice.data));
+      next_mb = slice.last_mb + 1;
+
+      auto slice_block = slices_done * block_count / slice_count;
+      ++slices_done;
+
+      if(slices_done == slice_count || slices_done * block_count / slice_count != slice_block) {
+        send_block();
+      }
+    }
+  }
+
+  void send_block() {
+    auto packet = std::make_unique<packet_raw_t>(av_packet_alloc());
+    auto av_packet = packet->av_packet.get();
+
+    if(av_new_packet(av_packet, block.size())) {
+      BOOST_LOG(fatal) << "Could not allocate video packet"sv;
+      log_flush();
+      std::abort();
+    }
+
+    std::memcpy(av_packet->data, block.data(), block.size());
+    block.clear();
+
+    av_packet->pts = pts;
+    if(key_frame) {
+      av_packet->flags |= AV_PKT_FLAG_KEY;
+    }
+
+    packet->block_index = block_index++;
+    packet->block_count = block_count;
+    packet->captured = captured;
+    packet->reference = reference;
+    packet->recovery = recovery;
+
+    if(packet->block_index == block_count - 1) {
+      TRACE_END(pts, encode);
+    }
+
+    (*packets)->raise(std::move(packet));
+  }
+
+  int invalidate_ref_frames(std::int64_t first, std::int64_t last) override {
+    if(intra_refresh) {
+      // The client recovers once a full refresh wave has passed over the picture
+      x264_encoder_intra_refresh(enc.get());
+
+      BOOST_LOG(debug) << "Restarted intra refresh after losing frames ["sv << first << ", "sv << last << ']';
+      return 0;
+    }
+
+    // The frame before the first lost frame has to be a valid reference:
+    // encoded after the latest IDR frame and not yet dropped from the DPB
+    if(first <= idr_pts || first > last_pts || last_pts - first + 1 >= dpb_size) {
+      return -1;
+    }
+
+    if(x264_encoder_invalidate_reference(enc.get(), first)) {
+      return -1;
+    }
+
+    BOOST_LOG(debug) << "Invalidated reference frames ["sv << first << ", "sv << last_pts << ']';
+    return 0;
+  }
+
+  int set_bitrate(int bitrate) override {
+    x264_param_t param;
+    x264_encoder_parameters(enc.get(), &param);
+
+    if(param.rc.i_rc_method != X264_RC_ABR) {
+      return -1;
+    }
+
+    param.rc.i_bitrate = bitrate;
+    param.rc.i_vbv_max_bitrate = bitrate;
+    param.rc.i_vbv_buffer_size = bitrate / 100;
+
+    return x264_encoder_reconfig(enc.get(), &param) ? -1 : 0;
+  }
+
+  int set_speed(int level) override {
+    // Faster presets come first, since they are applied without interrupting the stream.
+    // Beyond the fastest preset, the number of slice threads is doubled for every level
+    auto new_preset = std::max(0, base_preset - level);
+    auto steps = std::max(0, level - base_preset);
+
+    auto max_threads = std::max(base_threads, (int)std::thread::hardware_concurrency());
+    if(steps > 0 && (base_threads << (steps - 1)) >= max_threads) {
+      return -1;
+    }
+
+    auto new_threads = std::min(base_threads << steps, max_threads);
+    if(new_threads != threads) {
+      BOOST_LOG(debug) << "Reopening x264 with "sv << new_threads << " threads and preset "sv << x264_preset_names[new_preset];
+
+      return open(new_preset, new_threads);
+    }
+
+    if(new_preset == preset) {
+      return 0;
+    }
+
+    x264_param_t param;
+    if(make_param(param, config, new_preset, threads)) {
+      return -1;
+    }
+
+    x264_param_t current;
+    x264_encoder_parameters(enc.get(), &current);
+
+    param.rc = current.rc;
+    param.nalu_process = nalu_process;
+
+    if(x264_encoder_reconfig(enc.get(), &param)) {
+      return -1;
+    }
+
+    BOOST_LOG(debug) << "Reconfigured x264 with preset "sv << x264_preset_names[new_preset];
+
+    preset = new_preset;
+    return 0;
+  }
+
+  config_t config;
+
+  x264_enc_t enc;
+
+  int dpb_size;
+  bool intra_refresh;
+
+  // The preset and number of slice threads of speed level 0
+  int base_preset;
+  int base_threads;
+
+  int preset {};
+  int threads {};
+
+  // Set when the encoder was replaced, the next frame must be an IDR frame
+  bool reopened {};
+
+  int slice_count {};
+  int block_count {};
+
+  struct slice_t {
+    int last_mb;
+    std::vector<std::uint8_t> data;
+  };
+
+  // State of the frame being encoded, shared with the slice threads
+  std::mutex slice_lock;
+  packet_queue_t *packets {};
+  std::int64_t pts {};
+  std::chrono::steady_clock::time_point captured;
+  int next_mb {};
+  int slices_done {};
+  int block_index {};
+  bool key_frame {};
+  bool reference {};
+  bool recovery {};
+
+  // Slices that finished before the slices above them, by their first macroblock
+  std::map<int, slice_t> slices;
+  std::vector<std::uint8_t> block;
+
+  std::int64_t idr_pts { std::numeric_limits<std::int64_t>::max() };
+  std::int64_t last_pts {};
+};
+
+std::unique_ptr<encoder_t> x264_encoder(const config_t &config) {
+  auto preset = preset_index(config::video.preset);
+  if(preset < 0) {
+    BOOST_LOG(error) << "Invalid x264 preset ["sv << config::video.preset << ']';
+
+    return nullptr;
+  }
+
+  // Clients will request for the fewest slices per frame to get the
+  // most efficient encode, but we may want to provide more slices than
+  // requested to ensure we have enough parallelism for good performance.
+  auto threads = std::max(config.slicesPerFrame, config::video.min_threads);
+
+  auto encoder = std::make_unique<x264_encoder_t>(config, preset, threads);
+  if(encoder->open(preset, threads)) {
+    return nullptr;
+  }
+
+  return encoder;
+}
+}
@@ -0,0 +1,373 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <algorithm>
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <rs.h>
+}
+
+#include "fec.h"
+#include "main.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SUNSHINE_FEC_X86
+#include <immintrin.h>
+#endif
+
+namespace fec {
+using namespace std::literals;
+using rs_t = util::safe_ptr<reed_solomon, reed_solomon_release>;
+
+// The field of rs.c: GF(2^8) generated by x^8 + x^4 + x^3 + x^2 + 1
+constexpr int GF_POLYNOMIAL = 0x11D;
+
+class gf_t {
+public:
+  gf_t() {
+    int x = 1;
+    for(int i = 0; i < 255; ++i) {
+      _exp[i] = _exp[i + 255] = x;
+      _log[x] = i;
+
+      x <<= 1;
+      if(x & 0x100) {
+        x ^= GF_POLYNOMIAL;
+      }
+    }
+  }
+
+  std::uint8_t mul(std::uint8_t a, std::uint8_t b) const {
+    if(!a || !b) {
+      return 0;
+    }
+
+    return _exp[_log[a] + _log[b]];
+  }
+
+private:
+  std::array<std::uint8_t, 256> _log {};
+  std::array<std::uint8_t, 510> _exp {};
+};
+
+const gf_t gf;
+
+/*
+ * The products of a coefficient with every nibble:
+ * c * b == lo[b & 0xF] ^ hi[b >> 4]
+ */
+struct nibbles_t {
+  std::uint8_t lo[16];
+  std::uint8_t hi[16];
+};
+
+/*
+ * The parity rows of the matrix reed_solomon_new() builds for a shape, as nibble tables
+ */
+struct codec_t {
+  int data_shards;
+  int parity_shards;
+
+  // parity_shards rows of data_shards tables
+  std::vector<nibbles_t> tables;
+};
+
+/**
+ * out = The sum of the products of row[x] and data[x] for every data shard
+ * Each kernel returns the number of bytes processed, the remainder is left for row_c
+ */
+using kernel_t = std::size_t (*)(const nibbles_t *row, int data_shards, const std::uint8_t *const *data, std::uint8_t *out, std::size_t blocksize);
+
+void row_c(const nibbles_t *row, int data_shards, const std::uint8_t *const *data, std::uint8_t *out, std::size_t begin, std::size_t end) {
+  std::fill(out + begin, out + end, 0);
+
+  for(int x = 0; x < data_shards; ++x) {
+    auto &table = row[x];
+    auto in = data[x];
+
+    for(auto pos = begin; pos < end; ++pos) {
+      out[pos] ^= table.lo[in[pos] & 0xF] ^ table.hi[in[pos] >> 4];
+    }
+  }
+}
+
+std::size_t kernel_none(const nibbles_t *, int, const std::uint8_t *const *, std::uint8_t *, std::size_t) {
+  return 0;
+}
+
+#ifdef SUNSHINE_FEC_X86
+// The product of the coefficient of the tables lo and hi with 16 bytes of in
+__attribute__((target("ssse3")))
+static inline __m128i mul_ssse3(__m128i lo, __m128i hi, __m128i mask, const std::uint8_t *in) {
+  auto b = _mm_loadu_si128((const __m128i*)in);
+
+  return _mm_xor_si128(
+    _mm_shuffle_epi8(lo, _mm_and_si128(b, mask)),
+    _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(b, 4), mask)));
+}
+
+// The tables are the same in both lanes, vpshufb looks up within each lane
+__attribute__((target("avx2")))
+static inline __m256i mul_avx2(__m256i lo, __m256i hi, __m256i mask, const std::uint8_t *in) {
+  auto b = _mm256_loadu_si256((const __m256i*)in);
+
+  return _mm256_xor_si256(
+    _mm256_shuffle_epi8(lo, _mm256_and_si256(b, mask)),
+    _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(b, 4), mask)));
+}
+
+/*
+ * The kernels sum a strip of columns over all data shards in registers, so every byte of the output is stored once
+ * Each data shard is read in a few consecutive cache lines per strip
+ */
+__attribute__((target("ssse3")))
+std::size_t kernel_ssse3(const nibbles_t *row, int data_shards, const std::uint8_t *const *data, std::uint8_t *out, std::size_t blocksize) {
+  constexpr std::size_t STRIP = 4;
+
+  const auto mask = _mm_set1_epi8(0x0F);
+
+  std::size_t pos = 0;
+  for(; pos + STRIP * 16 <= blocksize; pos += STRIP * 16) {
+    __m128i acc[STRIP] {};
+
+    for(int x = 0; x < data_shards; ++x) {
+      auto lo = _mm_loadu_si128((const __m128i*)row[x].lo);
+      auto hi = _mm_loadu_si128((const __m128i*)row[x].hi);
+
+      for(std::size_t i = 0; i < STRIP; ++i) {
+        acc[i] = _mm_xor_si128(acc[i], mul_ssse3(lo, hi, mask, data[x] + pos + i * 16));
+      }
+    }
+
+    for(std::size_t i = 0; i < STRIP; ++i) {
+      _mm_storeu_si128((__m128i*)(out + pos + i * 16), acc[i]);
+    }
+  }
+
+  for(; pos + 16 <= blocksize; pos += 16) {
+    auto acc = _mm_setzero_si128();
+
+    for(int x = 0; x < data_shards; ++x) {
+      auto lo = _mm_loadu_si128((const __m128i*)row[x].lo);
+      auto hi = _mm_loadu_si128((const __m128i*)row[x].hi);
+
+      acc = _mm_xor_si128(acc, mul_ssse3(lo, hi, mask, data[x] + pos));
+    }
+
+    _mm_storeu_si128((__m128i*)(out + pos), acc);
+  }
+
+  return pos;
+}
+
+__attribute__((target("avx2")))
+std::size_t kernel_avx2(const nibbles_t *row, int data_shards, const std::uint8_t *const *data, std::uint8_t *out, std::size_t blocksize) {
+  constexpr std::size_t STRIP = 4;
+
+  const auto mask = _mm256_set1_epi8(0x0F);
+
+  std::size_t pos = 0;
+  for(; pos + STRIP * 32 <= blocksize; pos += STRIP * 32) {
+    __m256i acc[STRIP] {};
+
+    for(int x = 0; x < data_shards; ++x) {
+      auto lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)row[x].lo));
+      auto hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)row[x].hi));
+
+      for(std::size_t i = 0; i < STRIP; ++i) {
+        acc[i] = _mm256_xor_si256(acc[i], mul_avx2(lo, hi, mask, data[x] + pos + i * 32));
+      }
+    }
+
+    for(std::size_t i = 0; i < STRIP; ++i) {
+      _mm256_storeu_si256((__m256i*)(out + pos + i * 32), acc[i]);
+    }
+  }
+
+  for(; pos + 32 <= blocksize; pos += 32) {
+    auto acc = _mm256_setzero_si256();
+
+    for(int x = 0; x < data_shards; ++x) {
+      auto lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)row[x].lo));
+      auto hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)row[x].hi));
+
+      acc = _mm256_xor_si256(acc, mul_avx2(lo, hi, mask, data[x] + pos));
+    }
+
+    _mm256_storeu_si256((__m256i*)(out + pos), acc);
+  }
+
+  return pos;
+}
+#endif
+
+struct dispatch_t {
+  kernel_t kernel;
+  std::string_view name;
+};
+
+/**
+ * The kernel named name
+ * returns a null kernel if the CPU doesn't support it
+ */
+dispatch_t find_kernel(const std::string_view &name) {
+  if(name == "c"sv) {
+    return { kernel_none, "c"sv };
+  }
+
+#ifdef SUNSHINE_FEC_X86
+  __builtin_cpu_init();
+  if(name == "avx2"sv && __builtin_cpu_supports("avx2")) {
+    return { kernel_avx2, "avx2"sv };
+  }
+
+  if(name == "ssse3"sv && __builtin_cpu_supports("ssse3")) {
+    return { kernel_ssse3, "ssse3"sv };
+  }
+#endif
+
+  return { nullptr, name };
+}
+
+dispatch_t pick_kernel() {
+  for(auto name : { "avx2"sv, "ssse3"sv }) {
+    auto dispatch = find_kernel(name);
+    if(dispatch.kernel) {
+      return dispatch;
+    }
+  }
+
+  return find_kernel("c"sv);
+}
+
+dispatch_t dispatch = pick_kernel();
+
+std::shared_ptr<codec_t> make_codec(int data_shards, int parity_shards) {
+  // Taking the matrix from rs.c keeps the parity identical to reed_solomon_encode()
+  rs_t rs { reed_solomon_new(data_shards, parity_shards) };
+  if(!rs) {
+    return nullptr;
+  }
+
+  auto codec = std::make_shared<codec_t>();
+  codec->data_shards = data_shards;
+  codec->parity_shards = parity_shards;
+  codec->tables.resize(data_shards * parity_shards);
+
+  for(int x = 0; x < data_shards * parity_shards; ++x) {
+    auto c = rs->parity[x];
+    auto &table = codec->tables[x];
+
+    for(int nibble = 0; nibble < 16; ++nibble) {
+      table.lo[nibble] = gf.mul(c, nibble);
+      table.hi[nibble] = gf.mul(c, nibble << 4);
+    }
+  }
+
+  return codec;
+}
+
+std::mutex codecs_lock;
+std::map<std::pair<int, int>, std::shared_ptr<codec_t>> codecs;
+
+std::shared_ptr<codec_t> codec(int data_shards, int parity_shards) {
+  std::lock_guard lg { codecs_lock };
+
+  auto &codec = codecs[std::make_pair(data_shards, parity_shards)];
+  if(!codec) {
+    codec = make_codec(data_shards, parity_shards);
+  }
+
+  return codec;
+}
+
+size_t parity_shards(size_t data_shards, size_t percentage) {
+  return (data_shards * percentage + 99) / 100;
+}
+
+size_t max_data_shards(size_t percentage) {
+  size_t data_shards = DATA_SHARDS_MAX;
+  while(data_shards + parity_shards(data_shards, percentage) > DATA_SHARDS_MAX) {
+    --data_shards;
+  }
+
+  return data_shards;
+}
+
+int resize(fec_t &fec, size_t data_shards, size_t percentage) {
+  if(data_shards > DATA_SHARDS_MAX) {
+    BOOST_LOG(error)
+      << "Number of fragments for reed solomon exceeds DATA_SHARDS_MAX"sv << std::endl
+      << data_shards << " > "sv << DATA_SHARDS_MAX;
+
+    return -1;
+  }
+
+  // The client derives the number of parity shards from the percentage
+  if(data_shards + parity_shards(data_shards, percentage) > DATA_SHARDS_MAX) {
+    auto fitting = (DATA_SHARDS_MAX - data_shards) * 100 / data_shards;
+
+    BOOST_LOG(debug) << "Lowering FEC from "sv << percentage << "% to "sv << fitting << "% for "sv << data_shards << " data shards"sv;
+    percentage = fitting;
+  }
+
+  auto nr_shards = data_shards + parity_shards(data_shards, percentage);
+
+  fec.data_shards = data_shards;
+  fec.nr_shards = nr_shards;
+  fec.percentage = percentage;
+  fec.shards.fake_resize(nr_shards * fec.blocksize);
+
+  return 0;
+}
+
+void encode(fec_t &fec) {
+  auto data_shards = (int)fec.data_shards;
+  auto parity_shards = (int)(fec.nr_shards - fec.data_shards);
+
+  if(!parity_shards) {
+    return;
+  }
+
+  auto codec = fec::codec(data_shards, parity_shards);
+  if(!codec) {
+    BOOST_LOG(error) << "Couldn't create reed solomon codec for "sv << data_shards << " data shards and "sv << parity_shards << " parity shards"sv;
+
+    return;
+  }
+
+  std::array<const std::uint8_t*, DATA_SHARDS_MAX> data;
+  for(int x = 0; x < data_shards; ++x) {
+    data[x] = (const std::uint8_t*)&fec.shards[x * fec.blocksize];
+  }
+
+  for(int x = 0; x < parity_shards; ++x) {
+    auto row = &codec->tables[x * data_shards];
+    auto out = (std::uint8_t*)&fec.shards[(data_shards + x) * fec.blocksize];
+
+    auto pos = dispatch.kernel(row, data_shards, data.data(), out, fec.blocksize);
+    row_c(row, data_shards, data.data(), out, pos, fec.blocksize);
+  }
+}
+
+int use_kernel(const std::string_view &kernel) {
+  auto picked = find_kernel(kernel);
+  if(!picked.kernel) {
+    return -1;
+  }
+
+  dispatch = picked;
+
+  return 0;
+}
+
+std::string_view kernel() {
+  return dispatch.name;
+}
+}
@@ -0,0 +1,65 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#ifndef SUNSHINE_FEC_H
+#define SUNSHINE_FEC_H
+
+#include <string_view>
+
+#include "utility.h"
+
+namespace fec {
+/*
+ * The shards of a block: data_shards shards of payload followed by the parity shards
+ */
+struct fec_t {
+  size_t data_shards;
+  size_t nr_shards;
+  size_t percentage;
+
+  size_t blocksize;
+  util::buffer_t<char> shards;
+
+  std::string_view operator[](size_t el) const {
+    return { &shards[el*blocksize], blocksize };
+  }
+
+  size_t size() const {
+    return nr_shards;
+  }
+};
+
+/**
+ * The most data shards a block can hold with percentage parity
+ */
+size_t max_data_shards(size_t percentage);
+
+/**
+ * Size the shards for data_shards shards of payload, with percentage parity
+ * If the parity shards don't fit in the block, fec.percentage is lowered until they do
+ * The shards buffer is reused, it has to hold DATA_SHARDS_MAX shards
+ * returns -1 if there are more data shards than a block can hold
+ */
+int resize(fec_t &fec, size_t data_shards, size_t percentage);
+
+/**
+ * Compute the parity shards from the data shards
+ * The output is identical to reed_solomon_encode(), the matrices of reed_solomon_new() are cached per shape
+ */
+void encode(fec_t &fec);
+
+/**
+ * Use kernel instead of the fastest kernel the CPU supports: c, ssse3 or avx2
+ * Not thread safe, it's meant to be called before any block is encoded
+ * returns -1 if the CPU doesn't support kernel
+ */
+int use_kernel(const std::string_view &kernel);
+
+/**
+ * The kernel picked for the CPU: c, ssse3 or avx2
+ */
+std::string_view kernel();
+}
+
+#endif //SUNSHINE_FEC_H
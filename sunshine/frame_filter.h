@@ -0,0 +1,117 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#ifndef SUNSHINE_FRAME_FILTER_H
+#define SUNSHINE_FRAME_FILTER_H
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+namespace stream {
+/*
+ * Decides which blocks of video are sent: frames past their deadline are dropped,
+ * and once a frame other frames refer to is dropped, the frames after it can't be decoded.
+ * Those are dropped as well until the recovery frame of the encoder arrives
+ */
+class frame_filter_t {
+public:
+  // The first and last frame the encoder has to recover from
+  using recover_t = std::pair<std::int64_t, std::int64_t>;
+
+  struct block_t {
+    std::int64_t pts;
+    int block_index;
+
+    bool key;
+    bool recovery;
+    bool reference;
+
+    std::chrono::steady_clock::time_point captured;
+  };
+
+  /**
+   * deadline -- Frames not sent within this time after capture are dropped, 0 == never
+   */
+  explicit frame_filter_t(std::chrono::milliseconds deadline) : _deadline { deadline } {}
+
+  /**
+   * lost -- The queue dropped packets since the previous block
+   * recover -- Set if the encoder has to recover
+   * returns true if the block has to be dropped
+   */
+  bool drop(const block_t &block, bool lost, std::chrono::steady_clock::time_point now, std::optional<recover_t> &recover) {
+    // Key frames and recovery frames are always sent, the stream can't recover without them
+    auto recovery = block.key || block.recovery;
+
+    if(block.block_index == 0) {
+      _pts = block.pts;
+
+      if(recovery) {
+        _recovering = false;
+      }
+
+      auto late = _deadline.count() > 0 && !recovery && now - block.captured > _deadline;
+
+      _drop = _recovering || late;
+      late_frames += late;
+      dropped_frames += _drop;
+    }
+    else if(!_drop && (lost || block.pts != _pts)) {
+      // The previous blocks of this frame, or the first ones, were dropped
+      _pts = block.pts;
+      _drop = true;
+      ++dropped_frames;
+    }
+
+    // Packets dropped by the queue may have been the recovery frame, so ask again
+    if(lost || (_drop && block.reference && !_recovering)) {
+      _recovering = true;
+      recover = recover_t { _last_sent + 1, block.pts };
+    }
+
+    return _drop;
+  }
+
+  /**
+   * The block of frame pts couldn't be sent, the rest of the frame is dropped
+   * returns the frames the encoder has to recover from
+   */
+  recover_t failed(std::int64_t pts) {
+    _drop = true;
+    _recovering = true;
+    ++dropped_frames;
+
+    return { _last_sent + 1, pts };
+  }
+
+  /**
+   * The last block of frame pts was sent
+   */
+  void sent(std::int64_t pts) {
+    _last_sent = pts;
+  }
+
+  std::int64_t last_sent() const {
+    return _last_sent;
+  }
+
+  std::int64_t late_frames {};
+  std::int64_t dropped_frames {};
+
+private:
+  std::chrono::milliseconds _deadline;
+
+  // Frames after the latest complete frame can't be decoded once a frame is dropped
+  std::int64_t _last_sent {};
+  std::int64_t _pts {};
+  bool _drop {};
+
+  // A reference frame was dropped, the frames up to the recovery frame of the encoder refer to it
+  bool _recovering {};
+};
+}
+
+#endif //SUNSHINE_FRAME_FILTER_H
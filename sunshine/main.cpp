@@ -18,6 +18,7 @@
 #include "stream.h"
 #include "config.h"
 #include "thread_pool.h"
+#include "trace.h"
 
 #include "platform/common.h"
 extern "C" {
@@ -116,6 +117,12 @@ int main(int argc, char *argv[]) {
     shutdown_event->raise(true);
   });
 
+#if defined(SUNSHINE_TRACE) && defined(SIGUSR1)
+  on_signal(SIGUSR1, []() {
+    trace::request_dump();
+  });
+#endif
+
   auto proc_opt = proc::parse(config::stream.file_apps);
   if(!proc_opt) {
     return 7;
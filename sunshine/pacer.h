@@ -0,0 +1,66 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#ifndef SUNSHINE_PACER_H
+#define SUNSHINE_PACER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace stream {
+// Shards sent back to back before the pacer has to wait for tokens
+constexpr std::size_t PACING_BURST = 8;
+
+/**
+ * The rate in bytes per second needed to send a frame within the pacing window
+ * bitrate -- The current bitrate in kbps, 0 if unknown
+ * pacing -- The percentage of the frame interval the window spans
+ * frame_bytes -- Estimated size of the frame, it's sent within the window even if it's larger than the bitrate allows
+ */
+inline double pacing_rate(int bitrate, int pacing, std::size_t frame_bytes, std::chrono::nanoseconds window) {
+  return std::max((double)bitrate * 1000 / 8 / pacing * 100, frame_bytes / std::chrono::duration<double>(window).count());
+}
+
+/*
+ * A token bucket of bytes, kept as the theoretical arrival time (_tat) of the generic cell rate algorithm:
+ * the time the bucket is full again once the bytes taken so far are paid for
+ */
+class token_bucket_t {
+public:
+  /**
+   * now -- The current time, the bucket has no clock of its own
+   * bytes -- The size of the burst
+   * rate -- The rate the bucket fills at in bytes per second
+   * depth -- The bytes the bucket holds when full
+   * returns the time the burst may leave, now if it may leave right away
+   */
+  std::chrono::steady_clock::time_point take(std::chrono::steady_clock::time_point now, std::size_t bytes, double rate, std::size_t depth) {
+    // The burst may leave once the bucket holds enough tokens for it
+    auto send_time = std::max(now, _tat - duration((double)(depth - std::min(depth, bytes)) / rate));
+    _tat = std::max(send_time, _tat) + duration(bytes / rate);
+
+    if(send_time > now) {
+      ++delayed;
+      delay += send_time - now;
+    }
+
+    return send_time;
+  }
+
+  // The bursts held back and the time they were held back, it's spent pacing, not waiting for the network
+  std::int64_t delayed {};
+  std::chrono::nanoseconds delay {};
+
+private:
+  static std::chrono::nanoseconds duration(double seconds) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(seconds));
+  }
+
+  std::chrono::steady_clock::time_point _tat;
+};
+}
+
+#endif //SUNSHINE_PACER_H
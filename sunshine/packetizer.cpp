@@ -0,0 +1,180 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <algorithm>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <rs.h>
+}
+
+#include "packetizer.h"
+#include "utility.h"
+
+namespace stream {
+using namespace std::literals;
+
+packetizer_t::packetizer_t(int packetsize, int fec_percentage, int video_format) :
+  _payload_blocksize { packetsize + MAX_RTP_HEADER_SIZE - sizeof(video_packet_raw_t) },
+  _percentage { (size_t)fec_percentage },
+  _i_frame_old { video_format == 0 ? "\000\000\001e"sv : "\000\000\001("sv },
+  _header {} {
+
+  auto blocksize = packetsize + MAX_RTP_HEADER_SIZE;
+
+  for(auto &fec : _fec) {
+    fec.blocksize = blocksize;
+    fec.shards = util::buffer_t<char> { DATA_SHARDS_MAX * (size_t)blocksize };
+  }
+
+  _header.packet.flags = FLAG_CONTAINS_PIC_DATA;
+}
+
+int packetizer_t::packetize(const video::packet_raw_t &packet, int lowseq) {
+  auto av_packet = packet.av_packet.get();
+
+  std::string_view data { (char*)av_packet->data, (size_t)av_packet->size };
+
+  // The bitstream is written in up to four segments
+  std::array<std::string_view, 4> segments;
+  auto segment = std::begin(segments);
+
+  auto first_block = packet.block_index == 0;
+  auto last_block = packet.block_index == packet.block_count - 1;
+
+  if(first_block) {
+    *segment++ = "\0017charss"sv;
+  }
+
+  // make sure moonlight recognizes the nalu code for IDR frames
+  // TODO: Not all encoders encode their IDR frames with the 4 byte NALU prefix
+  auto next = first_block && av_packet->flags & AV_PKT_FLAG_KEY ? data.find(_i_frame_old) : std::string_view::npos;
+  if(next != std::string_view::npos) {
+    *segment++ = data.substr(0, next);
+    *segment++ = "\0"sv;
+    *segment++ = data.substr(next);
+  }
+  else {
+    *segment++ = data;
+  }
+
+  size_t payload_size = 0;
+  std::for_each(std::begin(segments), segment, [&](auto &segment) {
+    payload_size += segment.size();
+  });
+
+  auto data_shards = payload_size / _payload_blocksize + (payload_size % _payload_blocksize != 0);
+
+  // A block the encoder split off already has its place among the FEC blocks of the frame
+  _blocks = 1;
+  _block_index = packet.block_index;
+  _block_count = packet.block_count;
+  if(packet.block_count == 1) {
+    auto max_data_shards = fec::max_data_shards(_percentage);
+
+    _blocks = (int)std::min<size_t>((data_shards + max_data_shards - 1) / max_data_shards, video::MAX_FEC_BLOCKS);
+    _block_count = _blocks;
+  }
+
+  _frame_index = av_packet->pts;
+  for(int block = 0; block < _blocks; ++block) {
+    auto &fec = _fec[block];
+
+    // Spread the data shards evenly over the blocks
+    auto begin = data_shards * block / _blocks;
+    auto end = data_shards * (block + 1) / _blocks;
+    if(fec::resize(fec, end - begin, _percentage)) {
+      return 0;
+    }
+
+    _lowseq[block] = lowseq;
+    lowseq += fec.size();
+
+    for(auto x = 0; x < fec.data_shards; ++x) {
+      auto video_packet = shard(block, x);
+
+      *video_packet = _header;
+
+      video_packet->packet.frameIndex = _frame_index;
+      video_packet->packet.streamPacketIndex = ((uint32_t)_lowseq[block] + x) << 8;
+      video_packet->packet.fecInfo = (
+        x << 12 |
+        fec.data_shards << 22 |
+        fec.percentage << 4
+      );
+      multi_fec(video_packet, block);
+
+      if(first_block && block == 0 && x == 0) {
+        video_packet->packet.flags |= FLAG_SOF;
+      }
+
+      if(last_block && block == _blocks - 1 && x == fec.data_shards - 1) {
+        video_packet->packet.flags |= FLAG_EOF;
+      }
+
+      video_packet->rtp.sequenceNumber = util::endian::big<uint16_t>(_lowseq[block] + x);
+    }
+  }
+
+  // Copy the segments across the payloads of the data shards
+  int block = 0;
+  size_t x = 0;
+  size_t pos = 0;
+  std::for_each(std::begin(segments), segment, [&](std::string_view segment) {
+    while(!segment.empty()) {
+      if(pos == _payload_blocksize) {
+        ++x;
+        pos = 0;
+      }
+
+      if(x == _fec[block].data_shards) {
+        ++block;
+        x = 0;
+      }
+
+      auto bytes = std::min(segment.size(), _payload_blocksize - pos);
+      std::copy_n(std::begin(segment), bytes, shard(block, x)->payload() + pos);
+
+      segment.remove_prefix(bytes);
+      pos += bytes;
+    }
+  });
+
+  // padding with zero
+  std::fill(shard(block, x)->payload() + pos, shard(block, x)->payload() + _payload_blocksize, 0);
+
+  return _blocks;
+}
+
+void packetizer_t::parity(int block) {
+  auto &fec = _fec[block];
+
+  fec::encode(fec);
+
+  for(auto x = fec.data_shards; x < fec.size(); ++x) {
+    auto inspect = shard(block, x);
+
+    inspect->packet.frameIndex = _frame_index;
+    inspect->packet.fecInfo = (
+      x << 12 |
+      fec.data_shards << 22 |
+      fec.percentage << 4
+    );
+    multi_fec(inspect, block);
+
+    inspect->rtp.sequenceNumber = util::endian::big<uint16_t>(_lowseq[block] + x);
+  }
+}
+
+video_packet_raw_t *packetizer_t::shard(int block, size_t x) {
+  return (video_packet_raw_t *)&_fec[block].shards[x * _fec[block].blocksize];
+}
+
+void packetizer_t::multi_fec(video_packet_raw_t *video_packet, int block) {
+  if(_block_count > 1) {
+    video_packet->packet.multiFecFlags = 0x10;
+    video_packet->packet.multiFecBlocks = ((_block_index + block) << 4) | ((_block_count - 1) << 6);
+  }
+}
+}
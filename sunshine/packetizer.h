@@ -0,0 +1,86 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#ifndef SUNSHINE_PACKETIZER_H
+#define SUNSHINE_PACKETIZER_H
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+extern "C" {
+#include <moonlight-common-c/src/Video.h>
+}
+
+#include "fec.h"
+#include "video.h"
+
+namespace stream {
+#pragma pack(push, 1)
+
+struct video_packet_raw_t {
+  uint8_t *payload() {
+    return (uint8_t *)(this + 1);
+  }
+
+  RTP_PACKET rtp;
+  NV_VIDEO_PACKET packet;
+};
+
+#pragma pack(pop)
+
+/*
+ * Writes a block of a frame straight into its FEC shards in a single pass:
+ * the NV header, the IDR start code fix-up and the header of every shard go in along with the bitstream
+ *
+ * A whole frame too large for a single FEC block is split in up to MAX_FEC_BLOCKS blocks of about the same size,
+ * the parity of every block can be computed independently
+ */
+class packetizer_t {
+public:
+  packetizer_t(int packetsize, int fec_percentage, int video_format);
+
+  /**
+   * Fill the data shards of the FEC blocks of packet, the first shard gets sequence number lowseq
+   * The blocks are valid until the next call
+   * returns the number of FEC blocks, 0 if the packet needs too many shards
+   */
+  int packetize(const video::packet_raw_t &packet, int lowseq);
+
+  /**
+   * Compute the parity shards of a block and write their headers
+   * The blocks of a packet are independent, they may be done on different threads
+   */
+  void parity(int block);
+
+  const fec::fec_t &operator[](int block) const {
+    return _fec[block];
+  }
+
+private:
+  video_packet_raw_t *shard(int block, size_t x);
+
+  void multi_fec(video_packet_raw_t *video_packet, int block);
+
+  size_t _payload_blocksize;
+  size_t _percentage;
+  std::string_view _i_frame_old;
+
+  // The fields of the header that are the same for every data shard
+  video_packet_raw_t _header;
+
+  // The FEC blocks of the current packet
+  int _blocks {};
+
+  // The position of the first block of the current packet among the FEC blocks of its frame
+  int _block_index {};
+  int _block_count {};
+
+  std::int64_t _frame_index {};
+  std::array<int, video::MAX_FEC_BLOCKS> _lowseq {};
+  std::array<fec::fec_t, video::MAX_FEC_BLOCKS> _fec;
+};
+}
+
+#endif //SUNSHINE_PACKETIZER_H
@@ -5,6 +5,7 @@
 #ifndef SUNSHINE_COMMON_H
 #define SUNSHINE_COMMON_H
 
+#include <chrono>
 #include <string>
 #include "sunshine/utility.h"
 
@@ -35,12 +36,24 @@ struct gamepad_state_t {
   std::int16_t rsY;
 };
 
+struct rect_t {
+  std::int32_t x;
+  std::int32_t y;
+  std::int32_t width;
+  std::int32_t height;
+};
+
 struct img_t {
 public:
   std::uint8_t *data  {};
   std::int32_t width  {};
   std::int32_t height {};
 
+  // Hints for the encoder, only filled in by displays that can track them:
+  // The areas that changed during the latest snapshots, and the area covered by the blended cursor
+  std::vector<rect_t> damage;
+  rect_t cursor {};
+
   img_t() = default;
   img_t(const img_t&) = delete;
   img_t(img_t&&) = delete;
@@ -63,6 +76,44 @@ public:
   virtual ~display_t() = default;
 };
 
+/*
+ * Mode of the display set for a session, the previous mode is restored on destruction
+ */
+class display_mode_t {
+public:
+  virtual ~display_mode_t() = default;
+};
+
+enum class send_e : int {
+  ok,
+  error
+};
+
+/*
+ * Sends datagrams to the peer of a connected UDP socket
+ */
+class send_engine_t {
+public:
+  /**
+   * Send every buffer as a datagram of its own, in order
+   * txtime -- When the datagrams should leave, ignored unless enable_txtime() succeeded
+   * Each kind of error is logged only once, a datagram that can't be sent is dropped
+   * returns send_e::error if not all datagrams could be sent
+   */
+  virtual send_e send(const std::string_view *buffers, std::size_t count, std::chrono::steady_clock::time_point txtime) = 0;
+
+  /**
+   * Hand the send time of the datagrams to the kernel, which holds them back until then
+   * This only works with the fq qdisc on the interface, other qdiscs send them right away
+   * returns -1 if the OS can't schedule datagrams
+   */
+  virtual int enable_txtime() {
+    return -1;
+  }
+
+  virtual ~send_engine_t() = default;
+};
+
 class mic_t {
 public:
   virtual capture_e sample(std::vector<std::int16_t> &frame_buffer) = 0;
@@ -78,7 +129,28 @@ using input_t = util::safe_ptr<void, freeInput>;
 std::string get_mac_address(const std::string_view &address);
 
 std::unique_ptr<mic_t> microphone(std::uint32_t sample_rate);
-std::shared_ptr<display_t> display();
+/**
+ * target -- Part of the screen to capture, empty for the whole screen
+ *   window:<window id or part of its title>
+ *   output:<RandR output name>
+ *   rect:<x>,<y>,<width>,<height>
+ */
+std::shared_ptr<display_t> display(const std::string &target);
+
+/**
+ * Switch the display captured for target to width x height, at the refresh rate closest to framerate
+ * returns nullptr if the mode couldn't be set
+ */
+std::unique_ptr<display_mode_t> display_mode(const std::string &target, int width, int height, int framerate);
+
+/**
+ * socket -- The native handle of a connected UDP socket
+ * backend -- How the datagrams are sent, falls back to the next one the OS doesn't support
+ *   gso      -- Batches of equally sized datagrams in a single send through UDP segmentation offload
+ *   sendmmsg -- Batches of datagrams in a single system call
+ *   sendto   -- A system call per datagram
+ */
+std::unique_ptr<send_engine_t> send_engine(std::uintptr_t socket, const std::string_view &backend);
 
 input_t input();
 void move_mouse(input_t &input, int deltaX, int deltaY);
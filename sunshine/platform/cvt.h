@@ -0,0 +1,87 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#ifndef SUNSHINE_CVT_H
+#define SUNSHINE_CVT_H
+
+#include <algorithm>
+#include <cstdint>
+
+namespace platf {
+// Timings of VESA CVT with reduced blanking, used for modes the output doesn't have yet
+constexpr auto CVT_RB_H_BLANK = 160;
+constexpr auto CVT_RB_H_SYNC = 32;
+constexpr auto CVT_RB_V_FRONT_PORCH = 3;
+constexpr auto CVT_RB_MIN_V_BACK_PORCH = 6;
+constexpr auto CVT_RB_MIN_V_BLANK = 460.0; // microseconds
+constexpr auto CVT_CLOCK_STEP = 250000; // Hz
+
+/*
+ * The timings of a mode as in a modeline: the sync pulses and the totals in pixels and lines, the dot clock in Hz
+ */
+struct mode_timings_t {
+  int width;
+  int hsync_start;
+  int hsync_end;
+  int htotal;
+
+  int height;
+  int vsync_start;
+  int vsync_end;
+  int vtotal;
+
+  std::uint32_t dot_clock;
+};
+
+inline double refresh_rate(std::uint32_t dot_clock, int htotal, int vtotal) {
+  if(!htotal || !vtotal) {
+    return 0;
+  }
+
+  return dot_clock / ((double)htotal * vtotal);
+}
+
+/**
+ * The width of the vertical sync of CVT encodes the aspect ratio
+ */
+inline int cvt_v_sync(int width, int height) {
+  if(width * 3 == height * 4) {
+    return 4;
+  }
+  if(width * 9 == height * 16) {
+    return 5;
+  }
+  if(width * 10 == height * 16) {
+    return 6;
+  }
+  if(width * 4 == height * 5 || width * 9 == height * 15) {
+    return 7;
+  }
+
+  return 10;
+}
+
+inline mode_timings_t cvt_mode(int width, int height, int refresh) {
+  auto v_sync = cvt_v_sync(width, height);
+
+  // Duration of a line, the vertical blanking lasts at least CVT_RB_MIN_V_BLANK
+  auto h_period = (1000000.0 / refresh - CVT_RB_MIN_V_BLANK) / height;
+  auto v_blank = std::max((int)(CVT_RB_MIN_V_BLANK / h_period) + 1, CVT_RB_V_FRONT_PORCH + v_sync + CVT_RB_MIN_V_BACK_PORCH);
+
+  mode_timings_t mode {};
+  mode.width       = width;
+  mode.height      = height;
+  mode.hsync_start = width + CVT_RB_H_BLANK / 2 - CVT_RB_H_SYNC;
+  mode.hsync_end   = mode.hsync_start + CVT_RB_H_SYNC;
+  mode.htotal      = width + CVT_RB_H_BLANK;
+  mode.vsync_start = height + CVT_RB_V_FRONT_PORCH;
+  mode.vsync_end   = mode.vsync_start + v_sync;
+  mode.vtotal      = height + v_blank;
+  mode.dot_clock   = (std::uint32_t)((std::uint64_t)refresh * mode.htotal * mode.vtotal / CVT_CLOCK_STEP * CVT_CLOCK_STEP);
+
+  return mode;
+}
+}
+
+#endif //SUNSHINE_CVT_H
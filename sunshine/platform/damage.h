@@ -0,0 +1,165 @@
+//
+// Created by loki on 6/21/19.
+//
+
+#ifndef SUNSHINE_DAMAGE_H
+#define SUNSHINE_DAMAGE_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+
+namespace platf {
+// The damaged area is tracked in bands of rows spanning the full width of the display
+constexpr auto DAMAGE_BAND_HEIGHT = 16;
+
+// Number of snapshots for which the damaged bands are remembered,
+// an image captured longer ago than that is copied in its entirety
+constexpr auto DAMAGE_HISTORY = 8;
+
+// Number of snapshots for which the damaged area is passed to the encoder as recently changed
+constexpr auto RECENT_DAMAGE = 4;
+
+/*
+ * The bookkeeping of the damage to the captured area, apart from how it's fetched from the server:
+ * the bands damaged by each snapshot, and the rows an image has to copy again to catch up with the latest snapshot
+ */
+class damage_t {
+public:
+  // The rows [first, second) of the captured area
+  using rows_t = std::pair<int, int>;
+
+  static int band_count(int height) {
+    return (height + DAMAGE_BAND_HEIGHT - 1) / DAMAGE_BAND_HEIGHT;
+  }
+
+  /**
+   * Add a damaged rectangle to damaged and rects
+   * area -- The captured area
+   * rect -- The damaged rectangle, relative to the same window as area
+   * returns false if rect lies outside of the captured area
+   */
+  static bool add(const rect_t &area, const rect_t &rect, std::vector<std::uint8_t> &damaged, std::vector<rect_t> &rects) {
+    rect_t damaged_rect { rect.x - area.x, rect.y - area.y, rect.width, rect.height };
+    if(
+      damaged_rect.x >= area.width || damaged_rect.y >= area.height ||
+      damaged_rect.x + damaged_rect.width <= 0 || damaged_rect.y + damaged_rect.height <= 0) {
+      return false;
+    }
+
+    rects.emplace_back(damaged_rect);
+
+    auto top = std::clamp(damaged_rect.y, 0, area.height);
+    auto bottom = std::clamp(damaged_rect.y + damaged_rect.height, 0, area.height);
+
+    for(int band = top / DAMAGE_BAND_HEIGHT; band * DAMAGE_BAND_HEIGHT < bottom; ++band) {
+      damaged[band] = 1;
+    }
+
+    return true;
+  }
+
+  /**
+   * Images of the current generation or older are copied in their entirety
+   */
+  void area_changed() {
+    _area_generation = _generation;
+  }
+
+  /**
+   * Start a new generation with the damage since the previous one
+   * cursor_changed -- The cursor moved, changed or was hidden, the frame changes even without damage
+   * returns false if nothing changed since the previous generation
+   */
+  bool push(std::vector<std::uint8_t> &&damaged, std::vector<rect_t> &&rects, bool cursor_changed) {
+    if(_generation != _area_generation && !cursor_changed && std::none_of(std::begin(damaged), std::end(damaged), [](auto band) { return band; })) {
+      return false;
+    }
+
+    ++_generation;
+    _history[_generation % DAMAGE_HISTORY] = std::move(damaged);
+    _rects[_generation % DAMAGE_HISTORY] = std::move(rects);
+
+    return true;
+  }
+
+  /**
+   * The rows to copy into an image so it holds the frame of the current generation, adjacent bands are merged
+   * generation -- The generation of the frame the image holds, 0 if it holds none
+   * cursor_top, cursor_bottom -- The rows covered by the cursor blended into the image
+   * height -- The height of the captured area
+   */
+  std::vector<rows_t> dirty_rows(std::uint64_t generation, int cursor_top, int cursor_bottom, int height) const {
+    auto bands = band_count(height);
+
+    // Collect every band that changed since the image was captured
+    std::vector<std::uint8_t> dirty;
+    if(generation <= _area_generation || _generation - generation > DAMAGE_HISTORY) {
+      dirty.resize(bands, 1);
+    }
+    else {
+      dirty.resize(bands);
+      for(auto x = generation + 1; x <= _generation; ++x) {
+        auto &history = _history[x % DAMAGE_HISTORY];
+        for(int band = 0; band < bands; ++band) {
+          dirty[band] |= history[band];
+        }
+      }
+
+      // Remove the previously blended cursor
+      for(int band = cursor_top / DAMAGE_BAND_HEIGHT; band * DAMAGE_BAND_HEIGHT < cursor_bottom; ++band) {
+        dirty[band] = 1;
+      }
+    }
+
+    std::vector<rows_t> rows;
+    for(int band = 0; band < bands;) {
+      if(!dirty[band]) {
+        ++band;
+        continue;
+      }
+
+      auto begin = band;
+      while(band < bands && dirty[band]) {
+        ++band;
+      }
+
+      rows.emplace_back(begin * DAMAGE_BAND_HEIGHT, std::min(band * DAMAGE_BAND_HEIGHT, height));
+    }
+
+    return rows;
+  }
+
+  /**
+   * The damaged rectangles of the latest RECENT_DAMAGE generations
+   */
+  std::vector<rect_t> recent() const {
+    std::vector<rect_t> recent;
+    for(auto x = _generation; x > 0 && x + RECENT_DAMAGE > _generation; --x) {
+      auto &rects = _rects[x % DAMAGE_HISTORY];
+      recent.insert(std::end(recent), std::begin(rects), std::end(rects));
+    }
+
+    return recent;
+  }
+
+  std::uint64_t generation() const {
+    return _generation;
+  }
+
+private:
+  // Bands damaged by the snapshot of a generation, indexed by generation % DAMAGE_HISTORY
+  std::array<std::vector<std::uint8_t>, DAMAGE_HISTORY> _history;
+  std::array<std::vector<rect_t>, DAMAGE_HISTORY> _rects;
+  std::uint64_t _generation {};
+
+  // The latest generation before the captured area changed
+  std::uint64_t _area_generation {};
+};
+}
+
+#endif //SUNSHINE_DAMAGE_H
@@ -3,6 +3,7 @@
 //
 
 #include "common.h"
+#include "damage.h"
 #include "../main.h"
 
 #include <fstream>
@@ -17,6 +18,9 @@
 #include <X11/extensions/Xfixes.h>
 #include <xcb/shm.h>
 #include <xcb/xfixes.h>
+#include <xcb/damage.h>
+#include <xcb/composite.h>
+#include <xcb/randr.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 
@@ -24,7 +28,14 @@
 #include <pulse/error.h>
 
 #include <bitset>
-#include <sunshine/task_pool.h>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <sunshine/config.h>
 
 namespace platf {
@@ -37,6 +48,8 @@ using ifaddr_t = util::safe_ptr<ifaddrs, freeifaddrs>;
 using xcb_connect_t = util::safe_ptr<xcb_connection_t, xcb_disconnect>;
 using xcb_img_t = util::c_ptr<xcb_shm_get_image_reply_t>;
 using xcb_cursor_img = util::c_ptr<xcb_xfixes_get_cursor_image_reply_t>;
+using xcb_event_t = util::c_ptr<xcb_generic_event_t>;
+using xcb_region_t = util::c_ptr<xcb_xfixes_fetch_region_reply_t>;
 
 using xdisplay_t = util::safe_ptr_v2<Display, int, XCloseDisplay>;
 using ximg_t = util::safe_ptr<XImage, freeImage>;
@@ -50,6 +63,12 @@ public:
     other.id = -1;
   }
 
+  shm_id_t &operator=(shm_id_t &&other) noexcept {
+    std::swap(id, other.id);
+
+    return *this;
+  }
+
   ~shm_id_t() {
     if(id != -1) {
       shmctl(id, IPC_RMID, nullptr);
@@ -68,6 +87,12 @@ public:
     other.data = (void*)-1;
   }
 
+  shm_data_t &operator=(shm_data_t &&other) noexcept {
+    std::swap(data, other.data);
+
+    return *this;
+  }
+
   ~shm_data_t() {
     if((std::uintptr_t)data != -1) {
       shmdt(data);
@@ -83,58 +108,132 @@ struct x11_img_t : public img_t {
 };
 
 struct shm_img_t : public img_t {
-  ~shm_img_t() override {
-    delete[] data;
-    data = nullptr;
-  }
+  // Each image owns its own segment, xcb writes the frame directly into it
+  shm_id_t shm_id;
+  shm_data_t shm_data;
+  std::uint32_t seg;
+
+  // Damage generation of the frame held by the image, 0 if the image holds no frame yet
+  std::uint64_t generation {};
+
+  // Rows [cursor_top, cursor_bottom) are covered by the cursor blended into the image
+  int cursor_top {};
+  int cursor_bottom {};
 };
 
-void blend_cursor(Display *display, std::uint8_t *img_data, int width, int height) {
-  xcursor_t overlay { XFixesGetCursorImage(display) };
+/*
+ * A cursor sprite, the pixels are ARGB with premultiplied alpha
+ */
+struct cursor_t {
+  std::vector<std::uint32_t> pixels;
 
-  if(!overlay) {
-    BOOST_LOG(error) << "Couldn't get cursor from XFixesGetCursorImage"sv;
-    return;
+  int width {};
+  int height {};
+  int xhot {};
+  int yhot {};
+
+  std::uint32_t serial {};
+};
+
+/**
+ * dst = src + dst * (255 - alpha) / 255, for count pixels
+ */
+void blend_row_c(const std::uint32_t *src, std::uint32_t *dst, int count) {
+  for(int x = 0; x < count; ++x) {
+    auto colors_in = (const std::uint8_t*)&src[x];
+    auto colors_out = (std::uint8_t*)&dst[x];
+
+    auto alpha_inv = 255 - colors_in[3];
+    for(int c = 0; c < 4; ++c) {
+      // Rounded division by 255
+      auto val = colors_out[c] * alpha_inv + 128;
+      val = (val + (val >> 8)) >> 8;
+
+      colors_out[c] = std::min(255, colors_in[c] + val);
+    }
   }
+}
 
-  overlay->x -= overlay->xhot;
-  overlay->y -= overlay->yhot;
+#ifdef __SSE2__
+/**
+ * Same arithmetic as blend_row_c, 4 pixels at a time
+ * returns the number of pixels blended, the remainder is left for blend_row_c
+ */
+int blend_row_sse2(const std::uint32_t *src, std::uint32_t *dst, int count) {
+  const auto zero = _mm_setzero_si128();
+  const auto ones = _mm_set1_epi32(-1);
+  const auto round = _mm_set1_epi16(128);
+
+  int x = 0;
+  for(; x + 4 <= count; x += 4) {
+    auto s = _mm_loadu_si128((const __m128i*)(src + x));
+    auto d = _mm_loadu_si128((const __m128i*)(dst + x));
+
+    // Broadcast 255 - alpha to every channel of its pixel
+    auto alpha_inv = _mm_srli_epi32(s, 24);
+    alpha_inv = _mm_or_si128(alpha_inv, _mm_slli_epi32(alpha_inv, 8));
+    alpha_inv = _mm_or_si128(alpha_inv, _mm_slli_epi32(alpha_inv, 16));
+    alpha_inv = _mm_xor_si128(alpha_inv, ones);
+
+    auto lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(alpha_inv, zero)), round);
+    auto hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(alpha_inv, zero)), round);
+
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+    _mm_storeu_si128((__m128i*)(dst + x), _mm_adds_epu8(s, _mm_packus_epi16(lo, hi)));
+  }
 
-  overlay->x = std::max((short)0, overlay->x);
-  overlay->y = std::max((short)0, overlay->y);
+  return x;
+}
+#endif
 
-  auto pixels = (int*)img_data;
+/**
+ * Blend the cursor with its top left corner at (x, y) into the image, the parts outside the image are clipped
+ */
+void blend_cursor(const cursor_t &cursor, int x, int y, std::uint8_t *img_data, int width, int height) {
+  auto pixels = (std::uint32_t*)img_data;
 
-  auto screen_height = height;
-  auto screen_width  = width;
+  auto col_begin = std::max(0, -x);
+  auto col_end = std::min(cursor.width, width - x);
+  auto row_begin = std::max(0, -y);
+  auto row_end = std::min(cursor.height, height - y);
 
-  auto delta_height = std::min<uint16_t>(overlay->height, std::max(0, screen_height - overlay->y));
-  auto delta_width = std::min<uint16_t>(overlay->width, std::max(0, screen_width - overlay->x));
-  for(auto y = 0; y < delta_height; ++y) {
+  auto count = col_end - col_begin;
+  if(count <= 0) {
+    return;
+  }
 
-    auto overlay_begin = &overlay->pixels[y * overlay->width];
-    auto overlay_end   = &overlay->pixels[y * overlay->width + delta_width];
+  for(auto row = row_begin; row < row_end; ++row) {
+    auto src = &cursor.pixels[row * cursor.width + col_begin];
+    auto dst = &pixels[(row + y) * width + x + col_begin];
 
-    auto pixels_begin = &pixels[(y + overlay->y) * screen_width + overlay->x];
-    std::for_each(overlay_begin, overlay_end, [&](long pixel) {
-      int *pixel_p = (int*)&pixel;
+    int done = 0;
+#ifdef __SSE2__
+    done = blend_row_sse2(src, dst, count);
+#endif
+    blend_row_c(src + done, dst + done, count - done);
+  }
+}
 
-      auto colors_in = (uint8_t*)pixels_begin;
+void blend_cursor(Display *display, std::uint8_t *img_data, int width, int height) {
+  xcursor_t overlay { XFixesGetCursorImage(display) };
 
-      auto alpha = (*(uint*)pixel_p) >> 24u;
-      if(alpha == 255) {
-        *pixels_begin = *pixel_p;
-      }
-      else {
-        auto colors_out = (uint8_t*)pixel_p;
-        colors_in[0] = colors_out[0] + (colors_in[0] * (255 - alpha) + 255/2) / 255;
-        colors_in[1] = colors_out[1] + (colors_in[1] * (255 - alpha) + 255/2) / 255;
-        colors_in[2] = colors_out[2] + (colors_in[2] * (255 - alpha) + 255/2) / 255;
-      }
-      ++pixels_begin;
-    });
+  if(!overlay) {
+    BOOST_LOG(error) << "Couldn't get cursor from XFixesGetCursorImage"sv;
+    return;
   }
+
+  cursor_t cursor;
+  cursor.width = overlay->width;
+  cursor.height = overlay->height;
+
+  // Xlib stores each 32 bit pixel in an unsigned long
+  cursor.pixels.assign(overlay->pixels, overlay->pixels + overlay->width * overlay->height);
+
+  blend_cursor(cursor, overlay->x - overlay->xhot, overlay->y - overlay->yhot, img_data, width, height);
 }
+
 struct x11_attr_t : public display_t {
   x11_attr_t() : xdisplay {XOpenDisplay(nullptr) }, xwindow { }, xattr {} {
     if(!xdisplay) {
@@ -185,75 +284,374 @@ struct x11_attr_t : public display_t {
 };
 
 struct shm_attr_t : public x11_attr_t {
-  xdisplay_t shm_xdisplay; // Prevent race condition with x11_attr_t::xdisplay
   xcb_connect_t xcb;
   xcb_screen_t *display;
-  std::uint32_t seg;
 
-  shm_id_t shm_id;
+  // The damage and the pointer are tracked relative to window, either the root window or the captured window
+  xcb_window_t window {};
 
-  shm_data_t data;
+  // The pixels are read from drawable, the captured window is read from its XComposite pixmap,
+  // which includes the border of the window
+  xcb_drawable_t drawable {};
+  int border {};
 
-  util::TaskPool::task_id_t refresh_task_id;
-  void delayed_refresh() {
-    refresh();
+  // The captured area of window
+  rect_t area {};
+
+  // The size of the screen, which changes when the resolution is changed through RANDR
+  int screen_width {};
+  int screen_height {};
+
+  // The captured area is derived again from the output or the rectangle after the screen changed
+  std::string output;
+  rect_t target_rect {};
+
+  // Set when the screen or the captured window is resized, the images are resized on their next snapshot
+  bool resized {};
+
+  // Set when the captured window is destroyed
+  bool target_changed {};
+
+  // False if the server doesn't support the RANDR extension, the resolution can't be changed without it
+  bool randr {};
+  std::uint8_t randr_event_base {};
+
+  // False if the server doesn't support the XFIXES extension, the cursor can't be captured without it
+  bool xfixes {};
+  std::uint8_t xfixes_event_base {};
+
+  // The sprite is only fetched again after the server notified the cursor changed
+  cursor_t cursor_sprite;
+  bool cursor_dirty { true };
+
+  // XCB_NONE if the server doesn't support the DAMAGE extension
+  xcb_damage_damage_t damage {};
+  xcb_xfixes_region_t region {};
+
+  damage_t damage_bands;
+
+  // The cursor as blended into the frame of the latest generation
+  std::uint32_t cursor_serial {};
+  int cursor_x {};
+  int cursor_y {};
+  bool cursor_visible {};
+
+  capture_e snapshot(img_t *img_base, bool cursor) override {
+    poll_events();
+    if(target_changed) {
+      return capture_e::reinit;
+    }
+
+    if(resized && update_area()) {
+      return capture_e::reinit;
+    }
+
+    auto img = (shm_img_t*)img_base;
+    if((img->width != area.width || img->height != area.height) && resize_img(img)) {
+      return capture_e::reinit;
+    }
+
+    // Top left corner of the cursor
+    int x {}, y {};
+    auto overlay = cursor && xfixes && !refresh_cursor() && !cursor_position(x, y);
+
+    if(!damage) {
+      if(get_rows(img, 0, img->height)) {
+        return capture_e::reinit;
+      }
+
+      img->cursor = {};
+      if(overlay) {
+        img->cursor = { x, y, cursor_sprite.width, cursor_sprite.height };
+
+        blend_cursor(cursor_sprite, x, y, img->data, img->width, img->height);
+      }
+
+      return capture_e::ok;
+    }
+
+    std::vector<std::uint8_t> damaged(damage_t::band_count(area.height));
+    std::vector<rect_t> rects;
+    if(fetch_damage(damaged, rects)) {
+      return capture_e::reinit;
+    }
+
+    auto cursor_changed = overlay != cursor_visible || (overlay && (
+      cursor_sprite.serial != cursor_serial || x != cursor_x || y != cursor_y));
+
+    if(!damage_bands.push(std::move(damaged), std::move(rects), cursor_changed)) {
+      // Nothing changed since the previous snapshot
+      return capture_e::timeout;
+    }
+
+    for(auto &rows : damage_bands.dirty_rows(img->generation, img->cursor_top, img->cursor_bottom, img->height)) {
+      if(get_rows(img, rows.first, rows.second)) {
+        img->generation = 0;
+        return capture_e::reinit;
+      }
+    }
+
+    img->generation = damage_bands.generation();
+    img->cursor_top = img->cursor_bottom = 0;
+    img->cursor = {};
+    img->damage = damage_bands.recent();
+
+    cursor_visible = overlay;
+    if(overlay) {
+      cursor_serial = cursor_sprite.serial;
+      cursor_x = x;
+      cursor_y = y;
+
+      img->cursor_top = std::clamp(y, 0, img->height);
+      img->cursor_bottom = std::clamp(y + cursor_sprite.height, 0, img->height);
+      img->cursor = { x, y, cursor_sprite.width, cursor_sprite.height };
+
+      blend_cursor(cursor_sprite, x, y, img->data, img->width, img->height);
+    }
 
-    refresh_task_id = task_pool.pushDelayed(&shm_attr_t::delayed_refresh, 2s, this).task_id;
+    return capture_e::ok;
   }
 
-  shm_attr_t() : x11_attr_t(), shm_xdisplay {XOpenDisplay(nullptr) } {
-    refresh_task_id = task_pool.pushDelayed(&shm_attr_t::delayed_refresh, 2s, this).task_id;
+  /**
+   * Handle the events received since the previous snapshot
+   */
+  void poll_events() {
+    while(xcb_event_t event { xcb_poll_for_event(xcb.get()) }) {
+      // The DAMAGE events only notify that damage occurred, the damaged area is fetched by fetch_damage
+      auto type = event->response_type & 0x7F;
+
+      if(xfixes && type == xfixes_event_base + XCB_XFIXES_CURSOR_NOTIFY) {
+        cursor_dirty = true;
+      }
+      else if(randr && (type == randr_event_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY || type == randr_event_base + XCB_RANDR_NOTIFY)) {
+        // The screen was resized, or an output changed its mode or position
+        resized = true;
+      }
+      else if(type == XCB_CONFIGURE_NOTIFY) {
+        // Moving the captured window doesn't matter, its pixmap is captured regardless of its position
+        auto configure = (xcb_configure_notify_event_t*)event.get();
+        if(configure->window == window && (configure->width != area.width || configure->height != area.height)) {
+          resized = true;
+        }
+      }
+      else if(type == XCB_UNMAP_NOTIFY || type == XCB_DESTROY_NOTIFY) {
+        BOOST_LOG(info) << "Captured window disappeared"sv;
+        target_changed = true;
+      }
+    }
   }
 
-  ~shm_attr_t() override {
-    while(!task_pool.cancel(refresh_task_id));
+  /**
+   * Derive the captured area again after the screen or the captured window was resized
+   */
+  int update_area() {
+    resized = false;
+
+    util::c_ptr<xcb_get_geometry_reply_t> geometry {
+      xcb_get_geometry_reply(xcb.get(), xcb_get_geometry(xcb.get(), window), nullptr)
+    };
+
+    if(!geometry) {
+      BOOST_LOG(error) << "Could not get the size of the captured window"sv;
+
+      return -1;
+    }
+
+    auto prev = area;
+    if(window != display->root) {
+      // A resized window gets a new pixmap, the old one keeps the old size
+      auto pixmap = xcb_generate_id(xcb.get());
+      util::c_ptr<xcb_generic_error_t> err {
+        xcb_request_check(xcb.get(), xcb_composite_name_window_pixmap_checked(xcb.get(), window, pixmap))
+      };
+
+      if(err) {
+        BOOST_LOG(error) << "Could not get the pixmap of the resized window"sv;
+
+        return -1;
+      }
+
+      xcb_free_pixmap(xcb.get(), drawable);
+
+      drawable = pixmap;
+      border = geometry->border_width;
+      area = { 0, 0, geometry->width, geometry->height };
+    }
+    else {
+      screen_width = geometry->width;
+      screen_height = geometry->height;
+
+      if(!output.empty()) {
+        if(init_output(output)) {
+          return -1;
+        }
+      }
+      else if(target_rect.width) {
+        if(set_area(target_rect)) {
+          return -1;
+        }
+      }
+      else {
+        area = { 0, 0, screen_width, screen_height };
+      }
+    }
+
+    if(area.x != prev.x || area.y != prev.y || area.width != prev.width || area.height != prev.height) {
+      BOOST_LOG(info) << "Captured area changed to "sv << area.width << 'x' << area.height << " at "sv << area.x << ',' << area.y;
+
+      damage_bands.area_changed();
+    }
+
+    return 0;
   }
 
-  capture_e snapshot(img_t *img, bool cursor) override {
-    if(display->width_in_pixels != xattr.width || display->height_in_pixels != xattr.height) {
-      return capture_e::reinit;
+  /**
+   * Give an image allocated for a different size a segment that fits the captured area,
+   * the image is copied in its entirety on this snapshot
+   */
+  int resize_img(shm_img_t *img) {
+    auto new_img = alloc_img();
+    if(!new_img) {
+      return -1;
+    }
+
+    auto resized_img = (shm_img_t*)new_img.get();
+
+    // The old segment is released when new_img is destroyed
+    xcb_shm_detach(xcb.get(), img->seg);
+    img->shm_id = std::move(resized_img->shm_id);
+    img->shm_data = std::move(resized_img->shm_data);
+    img->seg = resized_img->seg;
+
+    img->data = (std::uint8_t*)img->shm_data.data;
+    img->width = area.width;
+    img->height = area.height;
+
+    img->generation = 0;
+    img->cursor_top = img->cursor_bottom = 0;
+
+    return 0;
+  }
+
+  /**
+   * Fetch the cursor sprite if it changed since it was last fetched
+   */
+  int refresh_cursor() {
+    if(!cursor_dirty) {
+      return 0;
+    }
+
+    xcb_cursor_img cursor_reply { xcb_xfixes_get_cursor_image_reply(xcb.get(), xcb_xfixes_get_cursor_image(xcb.get()), nullptr) };
+    if(!cursor_reply) {
+      BOOST_LOG(error) << "Could not get cursor image"sv;
+      return -1;
     }
 
+    auto pixels = xcb_xfixes_get_cursor_image_cursor_image(cursor_reply.get());
+
+    cursor_sprite.width = cursor_reply->width;
+    cursor_sprite.height = cursor_reply->height;
+    cursor_sprite.xhot = cursor_reply->xhot;
+    cursor_sprite.yhot = cursor_reply->yhot;
+    cursor_sprite.serial = cursor_reply->cursor_serial;
+    cursor_sprite.pixels.assign(pixels, pixels + cursor_sprite.width * cursor_sprite.height);
+
+    cursor_dirty = false;
+    return 0;
+  }
+
+  /**
+   * Get the position of the top left corner of the cursor sprite in the captured area
+   * returns -1 if the pointer isn't on this screen
+   */
+  int cursor_position(int &x, int &y) {
+    util::c_ptr<xcb_query_pointer_reply_t> pointer {
+      xcb_query_pointer_reply(xcb.get(), xcb_query_pointer(xcb.get(), window), nullptr)
+    };
+
+    if(!pointer || !pointer->same_screen) {
+      return -1;
+    }
+
+    x = pointer->win_x - area.x - cursor_sprite.xhot;
+    y = pointer->win_y - area.y - cursor_sprite.yhot;
+
+    return 0;
+  }
+
+  /**
+   * Copy the rows [row_begin, row_end) of the captured area into the image
+   */
+  int get_rows(shm_img_t *img, int row_begin, int row_end) {
     auto img_cookie = xcb_shm_get_image_unchecked(
       xcb.get(),
-      display->root,
-      0, 0,
-      display->width_in_pixels, display->height_in_pixels,
+      drawable,
+      border + area.x, border + area.y + row_begin,
+      area.width, row_end - row_begin,
       ~0,
       XCB_IMAGE_FORMAT_Z_PIXMAP,
-      seg,
-      0
+      img->seg,
+      row_begin * area.width * 4
     );
 
     xcb_img_t img_reply { xcb_shm_get_image_reply(xcb.get(), img_cookie, nullptr) };
     if(!img_reply) {
       BOOST_LOG(error) << "Could not get image reply"sv;
-      return capture_e::reinit;
+      return -1;
     }
 
-    if(img->width != display->width_in_pixels || img->height != display->height_in_pixels) {
-      delete[] img->data;
+    return 0;
+  }
 
-      img->data = new std::uint8_t[frame_size()];
-      img->width = display->width_in_pixels;
-      img->height = display->height_in_pixels;
+  /**
+   * Move the damage accumulated since the previous call into damaged and rects
+   */
+  int fetch_damage(std::vector<std::uint8_t> &damaged, std::vector<rect_t> &rects) {
+    xcb_damage_subtract(xcb.get(), damage, XCB_NONE, region);
+
+    xcb_region_t region_reply { xcb_xfixes_fetch_region_reply(xcb.get(), xcb_xfixes_fetch_region(xcb.get(), region), nullptr) };
+    if(!region_reply) {
+      BOOST_LOG(error) << "Could not fetch damaged region"sv;
+      return -1;
     }
 
-    std::copy_n((std::uint8_t*)data.data, frame_size(), img->data);
+    auto xcb_rects = xcb_xfixes_fetch_region_rectangles(region_reply.get());
+    auto rects_len = xcb_xfixes_fetch_region_rectangles_length(region_reply.get());
 
-    if(cursor) {
-      blend_cursor(shm_xdisplay.get(), img->data, img->width, img->height);
-    }
+    std::for_each(xcb_rects, xcb_rects + rects_len, [&](const xcb_rectangle_t &rect) {
+      // Damage outside of the captured area is ignored
+      damage_t::add(area, { rect.x, rect.y, rect.width, rect.height }, damaged, rects);
+    });
 
-    return capture_e::ok;
+    return 0;
   }
 
   std::unique_ptr<img_t> alloc_img() override {
-    return std::make_unique<shm_img_t>();
+    auto img = std::make_unique<shm_img_t>();
+
+    img->shm_id.id = shmget(IPC_PRIVATE, frame_size(), IPC_CREAT | 0777);
+    if(img->shm_id.id == -1) {
+      BOOST_LOG(error) << "shmget failed"sv;
+      return nullptr;
+    }
+
+    img->shm_data.data = shmat(img->shm_id.id, nullptr, 0);
+    if((uintptr_t)img->shm_data.data == -1) {
+      BOOST_LOG(error) << "shmat failed"sv;
+      return nullptr;
+    }
+
+    img->seg = xcb_generate_id(xcb.get());
+    xcb_shm_attach(xcb.get(), img->seg, img->shm_id.id, false);
+
+    img->data   = (std::uint8_t*)img->shm_data.data;
+    img->width  = area.width;
+    img->height = area.height;
+
+    return img;
   }
 
-  int init() {
-    shm_xdisplay.reset(XOpenDisplay(nullptr));
+  int init(const std::string &target) {
     xcb.reset(xcb_connect(nullptr, nullptr));
     if(xcb_connection_has_error(xcb.get())) {
       return -1;
@@ -267,28 +665,364 @@ struct shm_attr_t : public x11_attr_t {
 
     auto iter = xcb_setup_roots_iterator(xcb_get_setup(xcb.get()));
     display = iter.data;
-    seg = xcb_generate_id(xcb.get());
 
-    shm_id.id = shmget(IPC_PRIVATE, frame_size(), IPC_CREAT | 0777);
-    if(shm_id.id == -1) {
-      BOOST_LOG(error) << "shmget failed"sv;
+    window = drawable = display->root;
+    screen_width = display->width_in_pixels;
+    screen_height = display->height_in_pixels;
+    area = { 0, 0, screen_width, screen_height };
+
+    if(!target.empty() && init_target(target)) {
+      BOOST_LOG(warning) << "Could not capture ["sv << target << "], capturing the whole screen instead"sv;
+
+      window = drawable = display->root;
+      border = 0;
+      area = { 0, 0, screen_width, screen_height };
+      output.clear();
+      target_rect = {};
+    }
+
+    init_randr();
+    init_xfixes();
+    init_damage();
+
+    return 0;
+  }
+
+  int init_target(const std::string &target) {
+    auto separator = target.find(':');
+    if(separator == std::string::npos) {
+      BOOST_LOG(error) << "Invalid capture target ["sv << target << ']';
+
       return -1;
     }
 
-    xcb_shm_attach(xcb.get(), seg, shm_id.id, false);
-    data.data = shmat(shm_id.id, nullptr, 0);
+    auto type = std::string_view { target }.substr(0, separator);
+    auto value = target.substr(separator + 1);
 
-    if ((uintptr_t)data.data == -1) {
-      BOOST_LOG(error) << "shmat failed"sv;
+    if(type == "window"sv) {
+      return init_window(value);
+    }
+    if(type == "output"sv) {
+      return init_output(value);
+    }
+    if(type == "rect"sv) {
+      return init_rect(value);
+    }
+
+    BOOST_LOG(error) << "Unknown type of capture target ["sv << type << ']';
+    return -1;
+  }
+
+  int init_rect(const std::string &value) {
+    rect_t rect;
+    if(std::sscanf(value.c_str(), "%d,%d,%d,%d", &rect.x, &rect.y, &rect.width, &rect.height) != 4) {
+      BOOST_LOG(error) << "Invalid rectangle ["sv << value << "], expected <x>,<y>,<width>,<height>"sv;
 
       return -1;
     }
 
+    target_rect = rect;
+    return set_area(rect);
+  }
+
+  /**
+   * Clip rect to the screen and capture it
+   */
+  int set_area(const rect_t &rect) {
+    auto left = std::clamp(rect.x, 0, screen_width);
+    auto top = std::clamp(rect.y, 0, screen_height);
+    auto right = std::clamp(rect.x + rect.width, 0, screen_width);
+    auto bottom = std::clamp(rect.y + rect.height, 0, screen_height);
+
+    if(left >= right || top >= bottom) {
+      BOOST_LOG(error) << "Capture area is outside of the screen"sv;
+
+      return -1;
+    }
+
+    area = { left, top, right - left, bottom - top };
+
+    BOOST_LOG(info) << "Capturing "sv << area.width << 'x' << area.height << " at "sv << area.x << ',' << area.y;
     return 0;
   }
 
+  int init_output(const std::string &name) {
+    if(!xcb_get_extension_data(xcb.get(), &xcb_randr_id)->present) {
+      BOOST_LOG(error) << "Missing RANDR extension"sv;
+
+      return -1;
+    }
+
+    util::c_ptr<xcb_randr_query_version_reply_t> randr_version {
+      xcb_randr_query_version_reply(xcb.get(), xcb_randr_query_version(xcb.get(), 1, 3), nullptr)
+    };
+    util::c_ptr<xcb_randr_get_screen_resources_current_reply_t> resources {
+      xcb_randr_get_screen_resources_current_reply(xcb.get(), xcb_randr_get_screen_resources_current(xcb.get(), display->root), nullptr)
+    };
+
+    if(!randr_version || !resources) {
+      BOOST_LOG(error) << "Could not get the RANDR outputs"sv;
+
+      return -1;
+    }
+
+    auto outputs = xcb_randr_get_screen_resources_current_outputs(resources.get());
+    auto outputs_len = xcb_randr_get_screen_resources_current_outputs_length(resources.get());
+
+    for(int x = 0; x < outputs_len; ++x) {
+      util::c_ptr<xcb_randr_get_output_info_reply_t> output {
+        xcb_randr_get_output_info_reply(xcb.get(), xcb_randr_get_output_info(xcb.get(), outputs[x], resources->config_timestamp), nullptr)
+      };
+
+      if(!output) {
+        continue;
+      }
+
+      std::string_view output_name {
+        (const char*)xcb_randr_get_output_info_name(output.get()),
+        (std::size_t)xcb_randr_get_output_info_name_length(output.get())
+      };
+
+      if(output_name != name) {
+        continue;
+      }
+
+      if(output->crtc == XCB_NONE) {
+        BOOST_LOG(error) << "Output ["sv << name << "] is disabled"sv;
+
+        return -1;
+      }
+
+      util::c_ptr<xcb_randr_get_crtc_info_reply_t> crtc {
+        xcb_randr_get_crtc_info_reply(xcb.get(), xcb_randr_get_crtc_info(xcb.get(), output->crtc, resources->config_timestamp), nullptr)
+      };
+
+      if(!crtc) {
+        return -1;
+      }
+
+      this->output = name;
+      return set_area({ crtc->x, crtc->y, crtc->width, crtc->height });
+    }
+
+    BOOST_LOG(error) << "Could not find output ["sv << name << ']';
+    return -1;
+  }
+
+  int init_window(const std::string &value) {
+    if(!xcb_get_extension_data(xcb.get(), &xcb_composite_id)->present) {
+      BOOST_LOG(error) << "Missing Composite extension"sv;
+
+      return -1;
+    }
+
+    // Naming the pixmap of a window requires version 0.2
+    util::c_ptr<xcb_composite_query_version_reply_t> composite_version {
+      xcb_composite_query_version_reply(xcb.get(), xcb_composite_query_version(xcb.get(), 0, 2), nullptr)
+    };
+
+    if(!composite_version) {
+      BOOST_LOG(error) << "Could not initialize Composite extension"sv;
+
+      return -1;
+    }
+
+    auto target = find_window(value);
+    if(target == XCB_NONE) {
+      BOOST_LOG(error) << "Could not find window ["sv << value << ']';
+
+      return -1;
+    }
+
+    util::c_ptr<xcb_get_window_attributes_reply_t> attributes {
+      xcb_get_window_attributes_reply(xcb.get(), xcb_get_window_attributes(xcb.get(), target), nullptr)
+    };
+    util::c_ptr<xcb_get_geometry_reply_t> geometry {
+      xcb_get_geometry_reply(xcb.get(), xcb_get_geometry(xcb.get(), target), nullptr)
+    };
+
+    if(!attributes || !geometry || attributes->map_state != XCB_MAP_STATE_VIEWABLE) {
+      BOOST_LOG(error) << "Window ["sv << value << "] isn't visible"sv;
+
+      return -1;
+    }
+
+    // Keep the contents of the window in its own pixmap, even when it's covered by other windows
+    xcb_composite_redirect_window(xcb.get(), target, XCB_COMPOSITE_REDIRECT_AUTOMATIC);
+
+    auto pixmap = xcb_generate_id(xcb.get());
+    util::c_ptr<xcb_generic_error_t> err {
+      xcb_request_check(xcb.get(), xcb_composite_name_window_pixmap_checked(xcb.get(), target, pixmap))
+    };
+
+    if(err) {
+      BOOST_LOG(error) << "Could not get the pixmap of window ["sv << value << ']';
+
+      return -1;
+    }
+
+    // Follow resizes of the window
+    std::uint32_t event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    xcb_change_window_attributes(xcb.get(), target, XCB_CW_EVENT_MASK, &event_mask);
+
+    window = target;
+    drawable = pixmap;
+    border = geometry->border_width;
+    area = { 0, 0, geometry->width, geometry->height };
+
+    BOOST_LOG(info) << "Capturing window 0x"sv << util::hex(target).to_string_view() << " of "sv << area.width << 'x' << area.height;
+    return 0;
+  }
+
+  /**
+   * Find a window by its id, or the first top level window with value in its title
+   * returns XCB_NONE if there is no such window
+   */
+  xcb_window_t find_window(const std::string &value) {
+    if(value.rfind("0x", 0) == 0) {
+      return (xcb_window_t)std::strtoul(value.c_str(), nullptr, 16);
+    }
+
+    auto client_list = get_property(display->root, atom("_NET_CLIENT_LIST"), XCB_ATOM_WINDOW);
+    if(!client_list) {
+      BOOST_LOG(error) << "The window manager doesn't provide a list of windows"sv;
+
+      return XCB_NONE;
+    }
+
+    auto windows = (const xcb_window_t*)xcb_get_property_value(client_list.get());
+    auto windows_len = xcb_get_property_value_length(client_list.get()) / sizeof(xcb_window_t);
+
+    auto net_wm_name = atom("_NET_WM_NAME");
+    auto utf8_string = atom("UTF8_STRING");
+    for(std::size_t x = 0; x < windows_len; ++x) {
+      auto name = get_property(windows[x], net_wm_name, utf8_string);
+      if(!name) {
+        name = get_property(windows[x], XCB_ATOM_WM_NAME, XCB_ATOM_STRING);
+      }
+
+      if(!name) {
+        continue;
+      }
+
+      std::string_view title {
+        (const char*)xcb_get_property_value(name.get()),
+        (std::size_t)xcb_get_property_value_length(name.get())
+      };
+
+      if(title.find(value) != std::string_view::npos) {
+        return windows[x];
+      }
+    }
+
+    return XCB_NONE;
+  }
+
+  xcb_atom_t atom(const char *name) {
+    util::c_ptr<xcb_intern_atom_reply_t> reply {
+      xcb_intern_atom_reply(xcb.get(), xcb_intern_atom(xcb.get(), true, std::strlen(name), name), nullptr)
+    };
+
+    return reply ? reply->atom : XCB_ATOM_NONE;
+  }
+
+  /**
+   * returns nullptr if the window doesn't have the property
+   */
+  util::c_ptr<xcb_get_property_reply_t> get_property(xcb_window_t target, xcb_atom_t property, xcb_atom_t type) {
+    if(property == XCB_ATOM_NONE) {
+      return nullptr;
+    }
+
+    util::c_ptr<xcb_get_property_reply_t> reply {
+      xcb_get_property_reply(xcb.get(), xcb_get_property(xcb.get(), false, target, property, type, 0, std::numeric_limits<std::uint32_t>::max() / 4), nullptr)
+    };
+
+    if(!reply || reply->type == XCB_NONE || !xcb_get_property_value_length(reply.get())) {
+      return nullptr;
+    }
+
+    return reply;
+  }
+
+  /**
+   * Follow changes of the resolution, without RANDR the screen can't be resized
+   */
+  void init_randr() {
+    auto extension = xcb_get_extension_data(xcb.get(), &xcb_randr_id);
+    if(!extension->present) {
+      return;
+    }
+
+    // CRTC change notifications require version 1.2
+    util::c_ptr<xcb_randr_query_version_reply_t> randr_version {
+      xcb_randr_query_version_reply(xcb.get(), xcb_randr_query_version(xcb.get(), 1, 2), nullptr)
+    };
+
+    if(!randr_version) {
+      BOOST_LOG(warning) << "Could not initialize RANDR extension, changes of the resolution won't be followed"sv;
+
+      return;
+    }
+
+    randr = true;
+    randr_event_base = extension->first_event;
+
+    xcb_randr_select_input(xcb.get(), display->root, XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE | XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE);
+  }
+
+  void init_xfixes() {
+    auto extension = xcb_get_extension_data(xcb.get(), &xcb_xfixes_id);
+    if(!extension->present) {
+      BOOST_LOG(warning) << "Missing XFIXES extension, the cursor won't be captured"sv;
+
+      return;
+    }
+
+    // The extensions must be told which version the client supports before they can be used
+    util::c_ptr<xcb_xfixes_query_version_reply_t> xfixes_version {
+      xcb_xfixes_query_version_reply(xcb.get(), xcb_xfixes_query_version(xcb.get(), 2, 0), nullptr)
+    };
+
+    if(!xfixes_version) {
+      BOOST_LOG(warning) << "Could not initialize XFIXES extension, the cursor won't be captured"sv;
+
+      return;
+    }
+
+    xfixes = true;
+    xfixes_event_base = extension->first_event;
+
+    xcb_xfixes_select_cursor_input(xcb.get(), display->root, XCB_XFIXES_CURSOR_NOTIFY_MASK_DISPLAY_CURSOR);
+  }
+
+  void init_damage() {
+    // The damaged area is fetched as an XFIXES region
+    if(!xfixes || !xcb_get_extension_data(xcb.get(), &xcb_damage_id)->present) {
+      BOOST_LOG(warning) << "Missing DAMAGE extension, every frame will be captured in its entirety"sv;
+
+      return;
+    }
+
+    util::c_ptr<xcb_damage_query_version_reply_t> damage_version {
+      xcb_damage_query_version_reply(xcb.get(), xcb_damage_query_version(xcb.get(), 1, 1), nullptr)
+    };
+
+    if(!damage_version) {
+      BOOST_LOG(warning) << "Could not initialize DAMAGE extension, every frame will be captured in its entirety"sv;
+
+      return;
+    }
+
+    region = xcb_generate_id(xcb.get());
+    xcb_xfixes_create_region(xcb.get(), region, 0, nullptr);
+
+    damage = xcb_generate_id(xcb.get());
+    xcb_damage_create(xcb.get(), damage, window, XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+  }
+
   std::uint32_t frame_size() {
-    return display->height_in_pixels * display->width_in_pixels * 4;
+    return area.height * area.width * 4;
   }
 };
 
@@ -312,20 +1046,24 @@ struct mic_attr_t : public mic_t {
   }
 };
 
-std::unique_ptr<display_t> shm_display() {
+std::unique_ptr<display_t> shm_display(const std::string &target) {
   auto shm = std::make_unique<shm_attr_t>();
 
-  if(shm->init()) {
+  if(shm->init(target)) {
     return nullptr;
   }
 
   return shm;
 }
 
-std::shared_ptr<display_t> display() {
-  auto shm_disp = shm_display();
+std::shared_ptr<display_t> display(const std::string &target) {
+  auto shm_disp = shm_display(target);
 
   if(!shm_disp) {
+    if(!target.empty()) {
+      BOOST_LOG(warning) << "Capture targets require the SHM extension, capturing the whole screen"sv;
+    }
+
     return std::unique_ptr<display_t> { new x11_attr_t {} };
   }
 
@@ -0,0 +1,389 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <xcb/xcb.h>
+#include <xcb/randr.h>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "cvt.h"
+#include "sunshine/main.h"
+
+namespace platf {
+using namespace std::literals;
+
+using xcb_connect_t = util::safe_ptr<xcb_connection_t, xcb_disconnect>;
+using resources_t = util::c_ptr<xcb_randr_get_screen_resources_current_reply_t>;
+using output_info_t = util::c_ptr<xcb_randr_get_output_info_reply_t>;
+using crtc_info_t = util::c_ptr<xcb_randr_get_crtc_info_reply_t>;
+
+// A mode of the output is used when its refresh rate is this close to the requested framerate
+constexpr auto MAX_REFRESH_DIFF = 0.5;
+
+double refresh_rate(const xcb_randr_mode_info_t &mode) {
+  return refresh_rate(mode.dot_clock, mode.htotal, mode.vtotal);
+}
+
+xcb_randr_mode_info_t cvt_mode_info(int width, int height, int refresh) {
+  auto timings = cvt_mode(width, height, refresh);
+
+  xcb_randr_mode_info_t mode {};
+  mode.width       = timings.width;
+  mode.height      = timings.height;
+  mode.hsync_start = timings.hsync_start;
+  mode.hsync_end   = timings.hsync_end;
+  mode.htotal      = timings.htotal;
+  mode.vsync_start = timings.vsync_start;
+  mode.vsync_end   = timings.vsync_end;
+  mode.vtotal      = timings.vtotal;
+  mode.dot_clock   = timings.dot_clock;
+  mode.mode_flags  = XCB_RANDR_MODE_FLAG_HSYNC_POSITIVE | XCB_RANDR_MODE_FLAG_VSYNC_NEGATIVE;
+
+  return mode;
+}
+
+/*
+ * Switches a RANDR output to the mode of the client, the previous mode is restored on destruction
+ */
+class randr_mode_t : public display_mode_t {
+public:
+  ~randr_mode_t() override {
+    if(changed) {
+      if(set_crtc(prev_mode, prev_width, prev_height) || set_screen_size(prev_screen_width, prev_screen_height)) {
+        BOOST_LOG(error) << "Could not restore the mode of output ["sv << output_name << ']';
+      }
+      else {
+        BOOST_LOG(info) << "Restored the mode of output ["sv << output_name << ']';
+      }
+    }
+
+    if(created_mode) {
+      xcb_randr_delete_output_mode(xcb.get(), output, created_mode);
+      xcb_randr_destroy_mode(xcb.get(), created_mode);
+    }
+
+    if(xcb) {
+      xcb_flush(xcb.get());
+    }
+  }
+
+  int init(const std::string &target, int width, int height, int framerate) {
+    xcb.reset(xcb_connect(nullptr, nullptr));
+    if(xcb_connection_has_error(xcb.get())) {
+      return -1;
+    }
+
+    if(!xcb_get_extension_data(xcb.get(), &xcb_randr_id)->present) {
+      BOOST_LOG(error) << "Missing RANDR extension, the mode of the display can't be changed"sv;
+
+      return -1;
+    }
+
+    util::c_ptr<xcb_randr_query_version_reply_t> randr_version {
+      xcb_randr_query_version_reply(xcb.get(), xcb_randr_query_version(xcb.get(), 1, 3), nullptr)
+    };
+
+    if(!randr_version) {
+      BOOST_LOG(error) << "Could not initialize RANDR extension"sv;
+
+      return -1;
+    }
+
+    auto screen = xcb_setup_roots_iterator(xcb_get_setup(xcb.get())).data;
+    root = screen->root;
+    screen_mm_width = screen->width_in_millimeters;
+    screen_mm_height = screen->height_in_millimeters;
+    prev_screen_width = screen->width_in_pixels;
+    prev_screen_height = screen->height_in_pixels;
+
+    resources_t resources { xcb_randr_get_screen_resources_current_reply(xcb.get(), xcb_randr_get_screen_resources_current(xcb.get(), root), nullptr) };
+    if(!resources) {
+      BOOST_LOG(error) << "Could not get the RANDR outputs"sv;
+
+      return -1;
+    }
+
+    auto output_info = find_output(target, resources.get());
+    if(!output_info) {
+      return -1;
+    }
+
+    crtc = output_info->crtc;
+    crtc_info_t crtc_info { xcb_randr_get_crtc_info_reply(xcb.get(), xcb_randr_get_crtc_info(xcb.get(), crtc, resources->config_timestamp), nullptr) };
+    if(!crtc_info) {
+      return -1;
+    }
+
+    auto outputs = xcb_randr_get_crtc_info_outputs(crtc_info.get());
+    crtc_outputs.assign(outputs, outputs + xcb_randr_get_crtc_info_outputs_length(crtc_info.get()));
+
+    crtc_x = crtc_info->x;
+    crtc_y = crtc_info->y;
+    rotation = crtc_info->rotation;
+    prev_mode = crtc_info->mode;
+    prev_width = crtc_info->width;
+    prev_height = crtc_info->height;
+
+    auto mode = find_mode(output_info.get(), resources.get(), width, height, framerate);
+    if(mode == prev_mode) {
+      BOOST_LOG(info) << "Output ["sv << output_name << "] already runs at "sv << width << 'x' << height;
+
+      return 0;
+    }
+
+    if(mode == XCB_NONE) {
+      mode = create_mode(width, height, framerate);
+
+      if(mode == XCB_NONE) {
+        return -1;
+      }
+    }
+
+    // The CRTC spans the mode rotated
+    auto rotated = rotation & (XCB_RANDR_ROTATION_ROTATE_90 | XCB_RANDR_ROTATION_ROTATE_270);
+    if(set_crtc(mode, rotated ? height : width, rotated ? width : height)) {
+      return -1;
+    }
+
+    changed = true;
+
+    BOOST_LOG(info) << "Switched output ["sv << output_name << "] to "sv << width << 'x' << height << '@' << framerate;
+    return 0;
+  }
+
+private:
+  /**
+   * The output named by an "output:" target, otherwise the primary output, or the first enabled output
+   */
+  output_info_t find_output(const std::string &target, const xcb_randr_get_screen_resources_current_reply_t *resources) {
+    std::string_view name;
+    if(target.rfind("output:", 0) == 0) {
+      name = std::string_view { target }.substr("output:"sv.size());
+    }
+
+    util::c_ptr<xcb_randr_get_output_primary_reply_t> primary {
+      xcb_randr_get_output_primary_reply(xcb.get(), xcb_randr_get_output_primary(xcb.get(), root), nullptr)
+    };
+
+    auto outputs = xcb_randr_get_screen_resources_current_outputs(resources);
+    auto outputs_len = xcb_randr_get_screen_resources_current_outputs_length(resources);
+
+    output_info_t found;
+    for(int x = 0; x < outputs_len; ++x) {
+      output_info_t info {
+        xcb_randr_get_output_info_reply(xcb.get(), xcb_randr_get_output_info(xcb.get(), outputs[x], resources->config_timestamp), nullptr)
+      };
+
+      if(!info || info->crtc == XCB_NONE || info->connection != XCB_RANDR_CONNECTION_CONNECTED) {
+        continue;
+      }
+
+      std::string_view info_name {
+        (const char*)xcb_randr_get_output_info_name(info.get()),
+        (std::size_t)xcb_randr_get_output_info_name_length(info.get())
+      };
+
+      auto match = name.empty() ? (primary && primary->output == outputs[x]) : info_name == name;
+      if(match || (!found && name.empty())) {
+        output = outputs[x];
+        output_name = info_name;
+        found = std::move(info);
+      }
+
+      if(match) {
+        break;
+      }
+    }
+
+    if(!found) {
+      BOOST_LOG(error) << "Could not find an enabled output to switch to the mode of the client"sv;
+    }
+
+    return found;
+  }
+
+  /**
+   * returns the mode of the output closest to framerate, or XCB_NONE if the output has no such mode
+   */
+  xcb_randr_mode_t find_mode(
+    const xcb_randr_get_output_info_reply_t *output_info, const xcb_randr_get_screen_resources_current_reply_t *resources,
+    int width, int height, int framerate) {
+
+    auto output_modes = xcb_randr_get_output_info_modes(output_info);
+    auto output_modes_end = output_modes + xcb_randr_get_output_info_modes_length(output_info);
+
+    auto modes = xcb_randr_get_screen_resources_current_modes(resources);
+    auto modes_len = xcb_randr_get_screen_resources_current_modes_length(resources);
+
+    xcb_randr_mode_t best = XCB_NONE;
+    auto best_diff = MAX_REFRESH_DIFF;
+    for(int x = 0; x < modes_len; ++x) {
+      auto &mode = modes[x];
+      if(mode.width != width || mode.height != height || (mode.mode_flags & (XCB_RANDR_MODE_FLAG_INTERLACE | XCB_RANDR_MODE_FLAG_DOUBLE_SCAN))) {
+        continue;
+      }
+
+      if(std::find(output_modes, output_modes_end, mode.id) == output_modes_end) {
+        continue;
+      }
+
+      auto diff = std::abs(refresh_rate(mode) - framerate);
+      if(diff <= best_diff) {
+        best = mode.id;
+        best_diff = diff;
+      }
+    }
+
+    return best;
+  }
+
+  /**
+   * Add a mode with CVT timings to the output, it's removed again on destruction
+   */
+  xcb_randr_mode_t create_mode(int width, int height, int framerate) {
+    auto info = cvt_mode_info(width, height, framerate);
+    auto name = std::to_string(width) + 'x' + std::to_string(height) + '_' + std::to_string(framerate);
+    info.name_len = name.size();
+
+    util::c_ptr<xcb_randr_create_mode_reply_t> mode {
+      xcb_randr_create_mode_reply(xcb.get(), xcb_randr_create_mode(xcb.get(), root, info, name.size(), name.c_str()), nullptr)
+    };
+
+    if(!mode) {
+      BOOST_LOG(error) << "Could not create mode ["sv << name << ']';
+
+      return XCB_NONE;
+    }
+
+    util::c_ptr<xcb_generic_error_t> err {
+      xcb_request_check(xcb.get(), xcb_randr_add_output_mode_checked(xcb.get(), output, mode->mode))
+    };
+
+    if(err) {
+      BOOST_LOG(error) << "Output ["sv << output_name << "] doesn't accept mode ["sv << name << ']';
+
+      xcb_randr_destroy_mode(xcb.get(), mode->mode);
+      return XCB_NONE;
+    }
+
+    created_mode = mode->mode;
+    return created_mode;
+  }
+
+  /**
+   * Set the mode of the CRTC, which spans width x height,
+   * the screen is resized such that it contains every CRTC before and after the change
+   */
+  int set_crtc(xcb_randr_mode_t mode, int width, int height) {
+    resources_t resources { xcb_randr_get_screen_resources_current_reply(xcb.get(), xcb_randr_get_screen_resources_current(xcb.get(), root), nullptr) };
+    util::c_ptr<xcb_get_geometry_reply_t> geometry { xcb_get_geometry_reply(xcb.get(), xcb_get_geometry(xcb.get(), root), nullptr) };
+
+    if(!resources || !geometry) {
+      return -1;
+    }
+
+    auto screen_width = crtc_x + width;
+    auto screen_height = crtc_y + height;
+
+    auto crtcs = xcb_randr_get_screen_resources_current_crtcs(resources.get());
+    auto crtcs_len = xcb_randr_get_screen_resources_current_crtcs_length(resources.get());
+    for(int x = 0; x < crtcs_len; ++x) {
+      if(crtcs[x] == crtc) {
+        continue;
+      }
+
+      crtc_info_t info { xcb_randr_get_crtc_info_reply(xcb.get(), xcb_randr_get_crtc_info(xcb.get(), crtcs[x], resources->config_timestamp), nullptr) };
+      if(info && info->mode != XCB_NONE) {
+        screen_width = std::max(screen_width, info->x + info->width);
+        screen_height = std::max(screen_height, info->y + info->height);
+      }
+    }
+
+    if((screen_width > geometry->width || screen_height > geometry->height) &&
+      set_screen_size(std::max<int>(screen_width, geometry->width), std::max<int>(screen_height, geometry->height))) {
+      return -1;
+    }
+
+    util::c_ptr<xcb_randr_set_crtc_config_reply_t> reply {
+      xcb_randr_set_crtc_config_reply(xcb.get(), xcb_randr_set_crtc_config(
+        xcb.get(), crtc, XCB_CURRENT_TIME, resources->config_timestamp,
+        crtc_x, crtc_y, mode, rotation, crtc_outputs.size(), crtc_outputs.data()), nullptr)
+    };
+
+    if(!reply || reply->status != XCB_RANDR_SET_CONFIG_SUCCESS) {
+      BOOST_LOG(error) << "Could not set the mode of output ["sv << output_name << ']';
+
+      return -1;
+    }
+
+    // The screen shrinks only once the CRTC fits
+    if(screen_width < geometry->width || screen_height < geometry->height) {
+      return set_screen_size(screen_width, screen_height);
+    }
+
+    return 0;
+  }
+
+  /**
+   * Resize the screen, keeping its DPI
+   */
+  int set_screen_size(int width, int height) {
+    auto mm_width = (std::uint32_t)((std::uint64_t)width * screen_mm_width / prev_screen_width);
+    auto mm_height = (std::uint32_t)((std::uint64_t)height * screen_mm_height / prev_screen_height);
+
+    util::c_ptr<xcb_generic_error_t> err {
+      xcb_request_check(xcb.get(), xcb_randr_set_screen_size_checked(xcb.get(), root, width, height, mm_width, mm_height))
+    };
+
+    if(err) {
+      BOOST_LOG(error) << "Could not resize the screen to "sv << width << 'x' << height;
+
+      return -1;
+    }
+
+    return 0;
+  }
+
+  xcb_connect_t xcb;
+  xcb_window_t root {};
+
+  xcb_randr_output_t output {};
+  std::string output_name;
+
+  xcb_randr_crtc_t crtc {};
+  std::vector<xcb_randr_output_t> crtc_outputs;
+  int crtc_x {};
+  int crtc_y {};
+  std::uint16_t rotation {};
+
+  // The configuration restored on destruction
+  xcb_randr_mode_t prev_mode {};
+  int prev_width {};
+  int prev_height {};
+  int prev_screen_width {};
+  int prev_screen_height {};
+  int screen_mm_width {};
+  int screen_mm_height {};
+
+  // Set once the mode of the client is set
+  bool changed {};
+
+  // XCB_NONE unless the output didn't have the mode of the client yet
+  xcb_randr_mode_t created_mode {};
+};
+
+std::unique_ptr<display_mode_t> display_mode(const std::string &target, int width, int height, int framerate) {
+  auto mode = std::make_unique<randr_mode_t>();
+
+  if(mode->init(target, width, height, framerate)) {
+    return nullptr;
+  }
+
+  return mode;
+}
+}
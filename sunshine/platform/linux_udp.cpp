@@ -0,0 +1,327 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/net_tstamp.h>
+#include <time.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <set>
+
+#include "common.h"
+#include "sunshine/main.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+
+namespace platf {
+using namespace std::literals;
+
+// Datagrams per sendmmsg() call
+constexpr auto MAX_BATCH = 64;
+
+// The kernel doesn't accept more segments per send
+constexpr auto MAX_GSO_SEGMENTS = 64;
+
+// Largest payload of a single UDP send
+constexpr auto MAX_GSO_SIZE = 65507;
+
+// Room for the control messages of a send: the send time and the segment size
+constexpr auto CONTROL_SIZE = CMSG_SPACE(sizeof(std::uint64_t)) + CMSG_SPACE(sizeof(std::uint16_t));
+
+using control_t = std::array<char, CONTROL_SIZE>;
+
+class udp_t : public send_engine_t {
+public:
+  explicit udp_t(int fd) : fd { fd } {}
+
+  int enable_txtime() override {
+    // std::chrono::steady_clock is CLOCK_MONOTONIC, which is also the clock of the fq qdisc
+    sock_txtime config {};
+    config.clockid = CLOCK_MONOTONIC;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_TXTIME, &config, sizeof(config))) {
+      BOOST_LOG(warning) << "Couldn't enable SO_TXTIME: "sv << std::strerror(errno);
+
+      return -1;
+    }
+
+    txtime_enabled = true;
+
+    return 0;
+  }
+
+  /**
+   * Attach the send time to msg, control has to outlive the send
+   */
+  void set_txtime(msghdr &msg, control_t &control, std::chrono::steady_clock::time_point txtime) {
+    if(!txtime_enabled || txtime == std::chrono::steady_clock::time_point {}) {
+      return;
+    }
+
+    msg.msg_control = control.data();
+    msg.msg_controllen = CMSG_SPACE(sizeof(std::uint64_t));
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TXTIME;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(std::uint64_t));
+
+    std::uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(txtime.time_since_epoch()).count();
+    std::memcpy(CMSG_DATA(cmsg), &ns, sizeof(ns));
+  }
+
+  /**
+   * Whether a failed send should be tried again, refused -- Set once a refusal was retried
+   * The socket is connected, so an ICMP port unreachable from the peer fails the next send, which the kernel drops.
+   * That's no reason to give up: the client may open its port late or a NAT may rebind,
+   * a client that's gone is left to the ping timeout
+   */
+  bool retry(bool &refused) {
+    if(errno == EINTR) {
+      return true;
+    }
+
+    if(errno == ECONNREFUSED && !refused) {
+      if(logged.insert(ECONNREFUSED).second) {
+        BOOST_LOG(debug) << "The client refused a datagram, sending it again"sv;
+      }
+
+      refused = true;
+      return true;
+    }
+
+    return false;
+  }
+
+  /**
+   * The first failure of each kind is logged
+   */
+  send_e error(const std::string_view &what) {
+    auto err = errno;
+
+    if(logged.insert(err).second) {
+      BOOST_LOG(warning) << "Couldn't send "sv << what << ": "sv << std::strerror(err);
+    }
+
+    return send_e::error;
+  }
+
+  int fd;
+  bool txtime_enabled {};
+
+  std::set<int> logged;
+};
+
+class sendto_t : public udp_t {
+public:
+  using udp_t::udp_t;
+
+  send_e send(const std::string_view *buffers, std::size_t count, std::chrono::steady_clock::time_point txtime) override {
+    control_t control {};
+
+    for(auto buffer = buffers; buffer != buffers + count; ++buffer) {
+      iovec iov { (void*)buffer->data(), buffer->size() };
+
+      msghdr msg {};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      set_txtime(msg, control, txtime);
+
+      bool refused = false;
+      while(sendmsg(fd, &msg, 0) < 0) {
+        if(!retry(refused)) {
+          return error("datagram"sv);
+        }
+      }
+    }
+
+    return send_e::ok;
+  }
+};
+
+class sendmmsg_t : public udp_t {
+public:
+  using udp_t::udp_t;
+
+  send_e send(const std::string_view *buffers, std::size_t count, std::chrono::steady_clock::time_point txtime) override {
+    std::array<mmsghdr, MAX_BATCH> msgs {};
+    std::array<iovec, MAX_BATCH> iovs;
+
+    // Every datagram of the batch leaves at the same time
+    control_t control {};
+
+    while(count) {
+      auto batch = std::min<std::size_t>(count, MAX_BATCH);
+
+      for(auto x = 0; x < batch; ++x) {
+        iovs[x].iov_base = (void*)buffers[x].data();
+        iovs[x].iov_len = buffers[x].size();
+
+        msgs[x].msg_hdr.msg_iov = &iovs[x];
+        msgs[x].msg_hdr.msg_iovlen = 1;
+        set_txtime(msgs[x].msg_hdr, control, txtime);
+      }
+
+      // sendmmsg() stops at the first datagram it couldn't send
+      bool refused = false;
+      for(auto sent = 0; sent < batch;) {
+        auto status = sendmmsg(fd, &msgs[sent], batch - sent, 0);
+        if(status < 0) {
+          if(retry(refused)) {
+            continue;
+          }
+
+          return error("datagrams"sv);
+        }
+
+        sent += status;
+      }
+
+      buffers += batch;
+      count -= batch;
+    }
+
+    return send_e::ok;
+  }
+};
+
+/*
+ * The kernel splits a single send into datagrams of segment size bytes, only the last one may be smaller
+ * Consecutive buffers of the same size are sent together, the shards of a video block all have the same size
+ */
+class gso_t : public udp_t {
+public:
+  explicit gso_t(int fd) : udp_t { fd }, fallback { fd } {}
+
+  int enable_txtime() override {
+    if(udp_t::enable_txtime()) {
+      return -1;
+    }
+
+    fallback.txtime_enabled = true;
+
+    return 0;
+  }
+
+  send_e send(const std::string_view *buffers, std::size_t count, std::chrono::steady_clock::time_point txtime) override {
+    if(!enabled) {
+      return fallback.send(buffers, count, txtime);
+    }
+
+    std::array<iovec, MAX_GSO_SEGMENTS> iovs;
+
+    while(count) {
+      auto segment_size = buffers->size();
+      auto max_segments = std::min<std::size_t>(MAX_GSO_SEGMENTS, MAX_GSO_SIZE / std::max<std::size_t>(segment_size, 1));
+
+      std::size_t segments = 0;
+      while(segments < std::min(count, max_segments)) {
+        auto &buffer = buffers[segments];
+        if(buffer.size() > segment_size) {
+          break;
+        }
+
+        iovs[segments].iov_base = (void*)buffer.data();
+        iovs[segments].iov_len = buffer.size();
+        ++segments;
+
+        if(buffer.size() < segment_size) {
+          break;
+        }
+      }
+
+      if(send_segments(iovs.data(), segments, segment_size, txtime)) {
+        if(errno != EIO) {
+          return error("datagrams"sv);
+        }
+
+        // The device can't offload the checksums
+        BOOST_LOG(info) << "UDP segmentation offload isn't supported by the network device, falling back to sendmmsg()"sv;
+        enabled = false;
+
+        return fallback.send(buffers, count, txtime);
+      }
+
+      buffers += segments;
+      count -= segments;
+    }
+
+    return send_e::ok;
+  }
+
+  int send_segments(iovec *iovs, std::size_t segments, std::size_t segment_size, std::chrono::steady_clock::time_point txtime) {
+    msghdr msg {};
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = segments;
+
+    control_t control {};
+    set_txtime(msg, control, txtime);
+
+    if(segments > 1) {
+      auto offset = msg.msg_controllen;
+
+      msg.msg_control = control.data();
+      msg.msg_controllen = offset + CMSG_SPACE(sizeof(std::uint16_t));
+
+      auto cmsg = (cmsghdr*)(control.data() + offset);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+
+      std::uint16_t gso_size = segment_size;
+      std::memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+
+    bool refused = false;
+    while(sendmsg(fd, &msg, 0) < 0) {
+      if(!retry(refused)) {
+        return -1;
+      }
+    }
+
+    return 0;
+  }
+
+  bool enabled { true };
+
+  sendmmsg_t fallback;
+};
+
+std::unique_ptr<send_engine_t> send_engine(std::uintptr_t socket, const std::string_view &backend) {
+  auto fd = (int)socket;
+
+  if(backend == "gso"sv) {
+    int gso_size;
+    socklen_t size = sizeof(gso_size);
+
+    if(!getsockopt(fd, SOL_UDP, UDP_SEGMENT, &gso_size, &size)) {
+      return std::make_unique<gso_t>(fd);
+    }
+
+    BOOST_LOG(info) << "UDP segmentation offload isn't supported, falling back to sendmmsg()"sv;
+  }
+
+  if(backend != "sendto"sv) {
+    if(sendmmsg(fd, nullptr, 0, 0) >= 0) {
+      return std::make_unique<sendmmsg_t>(fd);
+    }
+
+    BOOST_LOG(info) << "sendmmsg() isn't supported, falling back to sendto()"sv;
+  }
+
+  return std::make_unique<sendto_t>(fd);
+}
+}
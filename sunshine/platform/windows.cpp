@@ -1,5 +1,7 @@
+#include <set>
 #include <thread>
 
+#include <winsock2.h>
 #include <windows.h>
 #include <winuser.h>
 
@@ -61,6 +63,44 @@ std::string get_mac_address(const std::string_view &address) {
   return "00:00:00:00:00:00"s;
 }
 
+class send_engine_wsa_t : public send_engine_t {
+public:
+  explicit send_engine_wsa_t(SOCKET sock) : sock { sock } {}
+
+  send_e send(const std::string_view *buffers, std::size_t count, std::chrono::steady_clock::time_point txtime) override {
+    for(auto buffer = buffers; buffer != buffers + count; ++buffer) {
+      auto status = ::send(sock, buffer->data(), (int)buffer->size(), 0);
+
+      // The socket is connected, Windows reports an ICMP port unreachable from the peer as a reset of the next send.
+      // The client may open its port late or a NAT may rebind, a client that's gone is left to the ping timeout
+      if(status == SOCKET_ERROR && (WSAGetLastError() == WSAECONNREFUSED || WSAGetLastError() == WSAECONNRESET)) {
+        status = ::send(sock, buffer->data(), (int)buffer->size(), 0);
+      }
+
+      if(status == SOCKET_ERROR) {
+        auto err = WSAGetLastError();
+
+        if(logged.insert(err).second) {
+          BOOST_LOG(warning) << "Couldn't send datagram ["sv << err << ']';
+        }
+
+        return send_e::error;
+      }
+    }
+
+    return send_e::ok;
+  }
+
+  SOCKET sock;
+
+  std::set<int> logged;
+};
+
+// Windows has no batched send for UDP, every backend sends a datagram per call
+std::unique_ptr<send_engine_t> send_engine(std::uintptr_t socket, const std::string_view &backend) {
+  return std::make_unique<send_engine_wsa_t>((SOCKET)socket);
+}
+
 input_t input() {
   input_t result { new vigem_t {} };
 
@@ -692,7 +692,11 @@ const char *format_str[] = {
 }
 
 namespace platf {
-std::shared_ptr<display_t> display() {
+std::shared_ptr<display_t> display(const std::string &target) {
+  if(!target.empty()) {
+    BOOST_LOG(warning) << "Capture targets aren't supported on Windows, capturing the whole screen"sv;
+  }
+
   auto disp = std::make_unique<dxgi::display_t>();
 
   if (disp->init()) {
@@ -701,4 +705,35 @@ std::shared_ptr<display_t> display() {
 
   return disp;
 }
+
+class dxgi_mode_t : public display_mode_t {
+public:
+  ~dxgi_mode_t() override {
+    // Return to the mode stored in the registry
+    ChangeDisplaySettingsExW(nullptr, nullptr, nullptr, 0, nullptr);
+  }
+};
+
+std::unique_ptr<display_mode_t> display_mode(const std::string &target, int width, int height, int framerate) {
+  DEVMODEW mode {};
+  mode.dmSize = sizeof(mode);
+  if(!EnumDisplaySettingsW(nullptr, ENUM_CURRENT_SETTINGS, &mode)) {
+    return nullptr;
+  }
+
+  mode.dmPelsWidth = width;
+  mode.dmPelsHeight = height;
+  mode.dmDisplayFrequency = framerate;
+  mode.dmFields = DM_PELSWIDTH | DM_PELSHEIGHT | DM_DISPLAYFREQUENCY;
+
+  // CDS_FULLSCREEN keeps the change out of the registry
+  auto status = ChangeDisplaySettingsExW(nullptr, &mode, nullptr, CDS_FULLSCREEN, nullptr);
+  if(status != DISP_CHANGE_SUCCESSFUL) {
+    BOOST_LOG(error) << "Could not switch the display to "sv << width << 'x' << height << '@' << framerate << ": "sv << status;
+
+    return nullptr;
+  }
+
+  return std::make_unique<dxgi_mode_t>();
+}
 }
\ No newline at end of file
@@ -243,6 +243,7 @@ std::optional<proc::proc_t> parse(const std::string& file_name) {
       auto output = app_node.get_optional<std::string>("output"s);
       auto name = parse_env_val(this_env, app_node.get<std::string>("name"s));
       auto cmd = app_node.get_optional<std::string>("cmd"s);
+      auto capture_target = app_node.get_optional<std::string>("capture-target"s);
 
       std::vector<proc::cmd_t> prep_cmds;
       prep_cmds.reserve(prep_nodes.size());
@@ -262,6 +263,10 @@ std::optional<proc::proc_t> parse(const std::string& file_name) {
         ctx.output = parse_env_val(this_env, *output);
       }
 
+      if(capture_target) {
+        ctx.capture_target = parse_env_val(this_env, *capture_target);
+      }
+
       if(cmd) {
         ctx.cmd = parse_env_val(this_env, *cmd);
       }
@@ -37,6 +37,7 @@ struct cmd_t {
  *    empty    -- The output of the commands are appended to the output of sunshine
  *    "null"   -- The output of the commands are discarded
  *    filename -- The output of the commands are appended to filename
+ * capture_target -- What is captured while the app runs, empty for the global capture_target
  */
 struct ctx_t {
   std::vector<cmd_t> prep_cmds;
@@ -44,6 +45,7 @@ struct ctx_t {
   std::string name;
   std::string cmd;
   std::string output;
+  std::string capture_target;
 };
 
 class proc_t {
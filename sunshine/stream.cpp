@@ -12,6 +12,7 @@
 #endif
 
 
+#include <cmath>
 #include <queue>
 #include <future>
 #include <boost/asio.hpp>
@@ -31,10 +32,18 @@ extern "C" {
 #include "stream.h"
 #include "audio.h"
 #include "video.h"
+#include "abr.h"
+#include "fec.h"
+#include "frame_filter.h"
+#include "pacer.h"
+#include "packetizer.h"
+#include "trace.h"
 #include "thread_safe.h"
+#include "thread_pool.h"
 #include "crypto.h"
 #include "input.h"
 #include "main.h"
+#include "platform/common.h"
 
 #define IDX_START_A 0
 #define IDX_REQUEST_IDR_FRAME 0
@@ -73,15 +82,6 @@ constexpr auto AUDIO_STREAM_PORT = 48000;
 
 #pragma pack(push, 1)
 
-struct video_packet_raw_t {
-  uint8_t *payload() {
-    return (uint8_t *)(this + 1);
-  }
-
-  RTP_PACKET rtp;
-  NV_VIDEO_PACKET packet;
-};
-
 struct audio_packet_raw_t {
   uint8_t *payload() {
     return (uint8_t *)(this + 1);
@@ -311,96 +311,99 @@ private:
   host_t _host;
 };
 
-namespace fec {
-using rs_t = util::safe_ptr<reed_solomon, reed_solomon_release>;
-
-struct fec_t {
-  size_t data_shards;
-  size_t nr_shards;
-  size_t percentage;
-
-  size_t blocksize;
-  util::buffer_t<char> shards;
-
-  std::string_view operator[](size_t el) const {
-    return { &shards[el*blocksize], blocksize };
-  }
+/*
+ * Spreads the shards of a frame over stream.pacing percent of the frame interval instead of sending them in a single burst
+ *
+ * A token bucket of bytes decides when a burst of shards may leave. It fills at the rate needed to send
+ * a frame of the current bitrate within the pacing window, or a frame the size of the current one if that's larger.
+ * Either the thread sleeps until then, or with SO_TXTIME, the kernel holds the shards back until then.
+ */
+class pacer_t {
+public:
+  pacer_t(std::chrono::nanoseconds frame_span, platf::send_engine_t &send_engine) :
+    _window { frame_span * config::stream.pacing / 100 },
+    _send_engine { send_engine } {
 
-  size_t size() const {
-    return nr_shards;
+    _txtime = config::stream.pacing_txtime && _window.count() > 0 && !send_engine.enable_txtime();
+    if(_txtime) {
+      BOOST_LOG(info) << "Pacing video through SO_TXTIME"sv;
+    }
   }
-};
-
-fec_t encode(const std::string_view &payload, size_t blocksize, size_t fecpercentage) {
-  auto payload_size = payload.size();
-
-  auto pad = payload_size % blocksize != 0;
-
-  auto data_shards   = payload_size / blocksize + (pad ? 1 : 0);
-  auto parity_shards = (data_shards * fecpercentage + 99) / 100;
-  auto nr_shards = data_shards + parity_shards;
 
-  if(nr_shards > DATA_SHARDS_MAX) {
-    BOOST_LOG(error)
-      << "Number of fragments for reed solomon exceeds DATA_SHARDS_MAX"sv << std::endl
-      << nr_shards << " > "sv << DATA_SHARDS_MAX;
+  /**
+   * bitrate -- The current bitrate in kbps, 0 if unknown
+   * frame_bytes -- Estimated size of the frame the shards belong to
+   * returns send_e::error if not all shards could be sent
+   */
+  platf::send_e send(const std::string_view *shards, std::size_t count, int bitrate, std::size_t frame_bytes) {
+    if(_window.count() == 0) {
+      return _send_engine.send(shards, count, {});
+    }
 
-    return { 0 };
-  }
+    auto result = platf::send_e::ok;
 
-  util::buffer_t<char> shards { nr_shards * blocksize };
-  util::buffer_t<uint8_t*> shards_p { nr_shards };
+    auto rate = pacing_rate(bitrate, config::stream.pacing, frame_bytes, _window);
 
-  // copy payload + padding
-  auto next = std::copy(std::begin(payload), std::end(payload), std::begin(shards));
-  std::fill(next, std::end(shards), 0); // padding with zero
+    for(std::size_t x = 0; x < count; x += PACING_BURST) {
+      auto batch = std::min<std::size_t>(count - x, PACING_BURST);
 
-  for(auto x = 0; x < nr_shards; ++x) {
-    shards_p[x] = (uint8_t*)&shards[x * blocksize];
-  }
+      // Sending the previous bursts took time too, that's not time the bursts were held back
+      auto now = std::chrono::steady_clock::now();
 
-  // packets = parity_shards + data_shards
-  rs_t rs { reed_solomon_new(data_shards, parity_shards) };
+      auto send_time = _bucket.take(now, batch * shards->size(), rate, PACING_BURST * shards->size());
+      if(send_time > now) {
+        // The fq qdisc only queues a limited number of packets per flow, so don't run ahead too far
+        std::this_thread::sleep_until(_txtime ? send_time - TXTIME_LOOKAHEAD : send_time);
+      }
 
-  reed_solomon_encode(rs.get(), shards_p.begin(), nr_shards, blocksize);
+      if(_send_engine.send(shards + x, batch, _txtime ? send_time : std::chrono::steady_clock::time_point {}) != platf::send_e::ok) {
+        result = platf::send_e::error;
+      }
 
-  return {
-    data_shards,
-    nr_shards,
-    fecpercentage,
-    blocksize,
-    std::move(shards)
-  };
-}
-}
+      ++_stats.bursts;
+    }
 
-template<class F>
-std::vector<uint8_t> insert(uint64_t insert_size, uint64_t slice_size, const std::string_view &data, F &&f) {
-  auto pad = data.size() % slice_size != 0;
-  auto elements = data.size() / slice_size + (pad ? 1 : 0);
+    _stats.packets += count;
+    _stats.bytes += count * shards->size();
 
-  std::vector<uint8_t> result;
-  result.resize(elements * insert_size + data.size());
+    return result;
+  }
 
-  auto next = std::begin(data);
-  for(auto x = 0; x < elements - 1; ++x) {
-    void *p = &result[x*(insert_size + slice_size)];
+  /**
+   * The time shards were held back so far, it's spent pacing, not waiting for the network
+   */
+  std::chrono::nanoseconds delay() const {
+    return _bucket.delay;
+  }
 
-    f(p, x, elements);
+  void log_stats() {
+    if(_window.count() == 0 || !_stats.bursts) {
+      return;
+    }
 
-    std::copy(next, next + slice_size, (char*)p + insert_size);
-    next += slice_size;
+    BOOST_LOG(info) << "Pacing: "sv << _stats.packets << " packets in "sv << _stats.bursts << " bursts, "sv
+                    << _bucket.delayed << " bursts delayed by "sv
+                    << std::chrono::duration_cast<std::chrono::microseconds>(_bucket.delay).count() / std::max<std::int64_t>(_bucket.delayed, 1)
+                    << "us on average"sv;
   }
 
-  auto x = elements - 1;
-  void *p = &result[x*(insert_size + slice_size)];
+private:
+  // With SO_TXTIME, shards are handed to the kernel this long before they're sent
+  static constexpr auto TXTIME_LOOKAHEAD = 2ms;
 
-  f(p, x, elements);
+  std::chrono::nanoseconds _window;
 
-  std::copy(next, std::end(data), (char*)p + insert_size);
+  platf::send_engine_t &_send_engine;
+  bool _txtime;
 
-  return result;
-}
+  token_bucket_t _bucket;
+
+  struct {
+    std::int64_t packets;
+    std::int64_t bytes;
+    std::int64_t bursts;
+  } _stats {};
+};
 
 void print_msg(PRTSP_MESSAGE msg) {
   std::string_view type = msg->type == TYPE_RESPONSE ? "RESPONSE"sv : "REQUEST"sv;
@@ -444,19 +447,6 @@ void print_msg(PRTSP_MESSAGE msg) {
   BOOST_LOG(debug) << "---Begin MessageBuffer---"sv << std::endl << messageBuffer << std::endl << "---End MessageBuffer---"sv << std::endl;
 }
 
-std::vector<uint8_t> replace(const std::string_view &original, const std::string_view &old, const std::string_view &_new) {
-  std::vector<uint8_t> replaced;
-
-  auto begin = std::begin(original);
-  auto next = std::search(begin, std::end(original), std::begin(old), std::end(old));
-
-  std::copy(begin, next, std::back_inserter(replaced));
-  std::copy(std::begin(_new), std::end(_new), std::back_inserter(replaced));
-  std::copy(next + old.size(), std::end(original), std::back_inserter(replaced));
-
-  return replaced;
-}
-
 void rtsp_server_t::map(const std::string_view& cmd, std::function<void(host_t&, peer_t, msg_t&&)> cb) {
   _map_cmd_cb.emplace(cmd, std::move(cb));
 }
@@ -476,7 +466,7 @@ void control_server_t::send(const std::string_view & payload) {
   enet_host_flush(_host.get());
 }
 
-void controlThread(video::idr_event_t idr_events) {
+void controlThread(video::idr_event_t idr_events, std::shared_ptr<abr::controller_t> abr) {
   control_server_t server { CONTROL_PORT };
 
   server.map(packetTypes[IDX_START_A], [](const std::string_view &payload) {
@@ -491,7 +481,7 @@ void controlThread(video::idr_event_t idr_events) {
     BOOST_LOG(debug) << "type [IDX_START_B]"sv;
   });
 
-  server.map(packetTypes[IDX_LOSS_STATS], [](const std::string_view &payload) {
+  server.map(packetTypes[IDX_LOSS_STATS], [abr](const std::string_view &payload) {
     session.pingTimeout = std::chrono::steady_clock::now() + config::stream.ping_timeout;
 
     int32_t *stats = (int32_t*)payload.data();
@@ -507,6 +497,8 @@ void controlThread(video::idr_event_t idr_events) {
       << "time in milli since last report [" << t.count() << ']' << std::endl
       << "last good frame [" << lastGoodFrame << ']' << std::endl
       << "---end stats---";
+
+    abr->loss_report(count);
   });
 
   server.map(packetTypes[IDX_INVALIDATE_REF_FRAMES], [idr_events](const std::string_view &payload) {
@@ -662,11 +654,17 @@ void audioThread() {
     return;
   }
 
+  sock.connect(*peer);
+  auto send_engine = platf::send_engine(sock.native_handle(), config::stream.send_engine);
+
   auto &packets = session.audio_packets;
   std::thread captureThread{audio::capture, packets, config.audio};
 
   uint16_t frame{1};
 
+  // A client that's gone is noticed by the ping timeout, failed sends are only counted
+  std::int64_t send_errors {};
+
   while (auto packet = packets->pop()) {
     audio_packet_t audio_packet { (audio_packet_raw_t*)malloc(sizeof(audio_packet_raw_t) + packet->size()) };
 
@@ -678,15 +676,26 @@ void audioThread() {
 
     std::copy(std::begin(*packet), std::end(*packet), audio_packet->payload());
 
-    sock.send_to(asio::buffer((char*)audio_packet.get(), sizeof(audio_packet_raw_t) + packet->size()), *peer);
+    std::string_view buffer { (char*)audio_packet.get(), sizeof(audio_packet_raw_t) + packet->size() };
+    if(send_engine->send(&buffer, 1, {}) != platf::send_e::ok) {
+      ++send_errors;
+    }
     BOOST_LOG(verbose) << "Audio ["sv << frame - 1 << "] ::  send..."sv;
   }
 
   stop(session);
+
+  if(auto dropped = packets->dropped()) {
+    BOOST_LOG(info) << "Audio queue: dropped "sv << dropped << " packets"sv;
+  }
+
+  if(send_errors) {
+    BOOST_LOG(info) << "Audio: "sv << send_errors << " packets couldn't be sent"sv;
+  }
   captureThread.join();
 }
 
-void videoThread(video::idr_event_t idr_events) {
+void videoThread(video::idr_event_t idr_events, video::bitrate_event_t bitrate_events, std::shared_ptr<abr::controller_t> abr) {
   while(session_state == state_e::STARTING) {
     std::this_thread::sleep_for(1ms);
   }
@@ -703,107 +712,197 @@ void videoThread(video::idr_event_t idr_events) {
     return;
   }
 
+  sock.connect(*peer);
+  auto send_engine = platf::send_engine(sock.native_handle(), config::stream.send_engine);
+
+  // The shards of a block are sent in a single batch
+  std::array<std::string_view, DATA_SHARDS_MAX> buffers;
+
   auto &packets = session.video_packets;
-  std::thread captureThread{video::capture_display, packets, idr_events, config.monitor};
+  bool first_frame = true;
+  auto capture_begin = std::chrono::steady_clock::now();
+  std::thread captureThread{video::capture_display, packets, idr_events, bitrate_events, config.monitor};
+
+  auto frame_span = std::chrono::floor<std::chrono::nanoseconds>(1s) / config.monitor.framerate;
+
+  BOOST_LOG(debug) << "FEC kernel: "sv << fec::kernel();
+
+  packetizer_t packetizer { config.packetsize, config::stream.fec_percentage, config.monitor.videoFormat };
 
+  // Encodes the parity of the other FEC blocks of a frame too large for a single block
+  util::ThreadPool fec_pool { video::MAX_FEC_BLOCKS - 1 };
+  pacer_t pacer { frame_span, *send_engine };
+
+  // Time spent sending the blocks of the current frame, without the time the pacer held them back
+  std::chrono::nanoseconds send_time {};
+
+  // The variance of the frame sizes shows how well the rate control smooths the bitrate
+  std::int64_t frame_bytes {};
+  std::int64_t frames {};
+  double frame_bytes_sum {};
+  double frame_bytes_sq_sum {};
+  std::int64_t frame_bytes_max {};
+
+  frame_filter_t filter { config::stream.max_frame_latency };
+
+  std::size_t queue_dropped {};
+  std::size_t queue_max {};
+
+  // A client that's gone is noticed by the ping timeout, failed sends are only counted
+  std::int64_t send_errors {};
   while (auto packet = packets->pop()) {
-    std::string_view payload{(char *) packet->data, (size_t) packet->size};
-    std::vector<uint8_t> payload_new;
-
-    auto nv_packet_header = "\0017charss"sv;
-    std::copy(std::begin(nv_packet_header), std::end(nv_packet_header), std::back_inserter(payload_new));
-    std::copy(std::begin(payload), std::end(payload), std::back_inserter(payload_new));
-
-    payload = {(char *) payload_new.data(), payload_new.size()};
-
-    // make sure moonlight recognizes the nalu code for IDR frames
-    if (packet->flags & AV_PKT_FLAG_KEY) {
-      // TODO: Not all encoders encode their IDR frames with the 4 byte NALU prefix
-      if(config.monitor.videoFormat == 0) {
-        auto h264_i_frame_old = "\000\000\001e"sv;
-        auto h264_i_frame = "\000\000\000\001e"sv;
-        assert(std::search(std::begin(payload), std::end(payload), std::begin(h264_i_frame), std::end(h264_i_frame)) ==
-               std::end(payload));
-        payload_new = replace(payload, h264_i_frame_old, h264_i_frame);
-      }
-      else {
-        auto hevc_i_frame_old = "\000\000\001("sv;
-        auto hevc_i_frame = "\000\000\000\001("sv;
-        assert(std::search(std::begin(payload), std::end(payload), std::begin(hevc_i_frame), std::end(hevc_i_frame)) ==
-               std::end(payload));
-        payload_new = replace(payload, hevc_i_frame_old, hevc_i_frame);
-      }
+    auto send_begin = std::chrono::steady_clock::now();
+    auto pacing_begin = pacer.delay();
 
-      payload = {(char *) payload_new.data(), payload_new.size()};
+    if(first_frame) {
+      BOOST_LOG(info) << "Time to first frame: "sv << std::chrono::duration_cast<std::chrono::milliseconds>(send_begin - capture_begin).count() << "ms"sv;
+      first_frame = false;
     }
 
-    // insert packet headers
-    auto blocksize = config.packetsize + MAX_RTP_HEADER_SIZE;
-    auto payload_blocksize = blocksize - sizeof(video_packet_raw_t);
+    auto av_packet = packet->av_packet.get();
+    auto pts = av_packet->pts;
 
-    auto fecPercentage = config::stream.fec_percentage;
+    // A frame may arrive in multiple blocks, each block is protected by its own FEC shards
+    auto first_block = packet->block_index == 0;
+    auto last_block = packet->block_index == packet->block_count - 1;
 
-    payload_new = insert(sizeof(video_packet_raw_t), payload_blocksize,
-                                              payload, [&](void *p, int fecIndex, int end) {
-        video_packet_raw_t *video_packet = (video_packet_raw_t *)p;
+    queue_max = std::max(queue_max, packets->size() + 1);
 
-        video_packet->packet.flags = FLAG_CONTAINS_PIC_DATA;
-        video_packet->packet.frameIndex = packet->pts;
-        video_packet->packet.streamPacketIndex = ((uint32_t)lowseq + fecIndex) << 8;
-        video_packet->packet.fecInfo = (
-          fecIndex << 12 |
-          end << 22 |
-          fecPercentage << 4
-          );
+    // Packets dropped by the queue came after the previous packet and before this one
+    auto dropped = packets->dropped();
+    auto lost = dropped != queue_dropped;
+    queue_dropped = dropped;
 
-        if(fecIndex == 0) {
-          video_packet->packet.flags |= FLAG_SOF;
-        }
+    frame_filter_t::block_t block {
+      pts, packet->block_index,
+      (bool)(av_packet->flags & AV_PKT_FLAG_KEY), packet->recovery, packet->reference,
+      packet->captured
+    };
 
-        if(fecIndex == end - 1) {
-          video_packet->packet.flags |= FLAG_EOF;
-        }
+    std::optional<frame_filter_t::recover_t> recover;
+    auto drop = filter.drop(block, lost, send_begin, recover);
+    if(recover) {
+      BOOST_LOG(debug) << "Dropped frames after frame ["sv << filter.last_sent() << "], requesting recovery at frame ["sv << pts << ']';
 
-        video_packet->rtp.sequenceNumber = util::endian::big<uint16_t>(lowseq + fecIndex);
-      });
+      idr_events->raise(*recover);
+    }
+
+    if(drop) {
+      continue;
+    }
+
+    if(first_block) {
+      frame_bytes = 0;
+
+      TRACE_BEGIN(pts, packetize);
+    }
+
+    auto blocks = packetizer.packetize(*packet, lowseq);
+    if(last_block) {
+      TRACE_END(pts, packetize);
+    }
 
-    payload = {(char *) payload_new.data(), payload_new.size()};
+    if(!blocks) {
+      BOOST_LOG(warning) << "Frame ["sv << pts << "] is too large to send, requesting recovery"sv;
 
-    auto shards = fec::encode(payload, blocksize, fecPercentage);
-    if(shards.data_shards == 0) {
-      BOOST_LOG(info) << "skipping frame..."sv << std::endl;
+      idr_events->raise(filter.failed(pts));
       continue;
     }
 
-    for (auto x = shards.data_shards; x < shards.size(); ++x) {
-      video_packet_raw_t *inspect = (video_packet_raw_t *)shards[x].data();
+    if(first_block) {
+      TRACE_BEGIN(pts, fec);
+    }
 
-      inspect->packet.frameIndex = packet->pts;
-      inspect->packet.fecInfo = (
-        x << 12 |
-        shards.data_shards << 22 |
-        fecPercentage << 4
-      );
+    // The other blocks are encoded on the workers while the first one is encoded and sent
+    std::array<std::future<void>, video::MAX_FEC_BLOCKS> parity;
+    for(int block = 1; block < blocks; ++block) {
+      parity[block] = fec_pool.push([&packetizer, block]() {
+        packetizer.parity(block);
+      });
+    }
 
-      inspect->rtp.sequenceNumber = util::endian::big<uint16_t>(lowseq + x);
+    std::size_t shards_bytes = 0;
+    for(int block = 0; block < blocks; ++block) {
+      shards_bytes += packetizer[block].size() * packetizer[block].blocksize;
     }
 
-    for (auto x = 0; x < shards.size(); ++x) {
-      sock.send_to(asio::buffer(shards[x]), *peer);
+    for(int block = 0; block < blocks; ++block) {
+      if(block == 0) {
+        packetizer.parity(block);
+      }
+      else {
+        parity[block].wait();
+      }
+
+      if(last_block && block == blocks - 1) {
+        TRACE_END(pts, fec);
+      }
+
+      if(first_block && block == 0) {
+        TRACE_BEGIN(pts, send);
+      }
+
+      auto &shards = packetizer[block];
+      for (auto x = 0; x < shards.size(); ++x) {
+        buffers[x] = shards[x];
+      }
+      if(pacer.send(buffers.data(), shards.size(), abr->bitrate(), shards_bytes * packet->block_count) != platf::send_e::ok) {
+        ++send_errors;
+      }
+
+      if(av_packet->flags & AV_PKT_FLAG_KEY) {
+        BOOST_LOG(verbose) << "Key Frame ["sv << pts << "] block ["sv << packet->block_index << '/' << packet->block_count << "] FEC block ["sv << block << '/' << blocks << "] :: send ["sv << shards.size() << "] shards..."sv;
+      }
+      else {
+        BOOST_LOG(verbose) << "Frame ["sv << pts << "] block ["sv << packet->block_index << '/' << packet->block_count << "] FEC block ["sv << block << '/' << blocks << "] :: send ["sv << shards.size() << "] shards..."sv << std::endl;
+      }
+
+      lowseq += shards.size();
     }
 
-    if(packet->flags & AV_PKT_FLAG_KEY) {
-      BOOST_LOG(verbose) << "Key Frame ["sv << packet->pts << "] :: send ["sv << shards.size() << "] shards..."sv;
+    if(last_block) {
+      TRACE_END(pts, send);
     }
-    else {
-      BOOST_LOG(verbose) << "Frame ["sv << packet->pts << "] :: send ["sv << shards.size() << "] shards..."sv << std::endl;
+
+    send_time += std::chrono::steady_clock::now() - send_begin - (pacer.delay() - pacing_begin);
+    frame_bytes += av_packet->size;
+    if(!last_block) {
+      continue;
     }
 
-    lowseq += shards.size();
+    filter.sent(pts);
+
+    ++frames;
+    frame_bytes_sum += frame_bytes;
+    frame_bytes_sq_sum += (double)frame_bytes * frame_bytes;
+    frame_bytes_max = std::max(frame_bytes_max, frame_bytes);
+
+    // Frames still waiting in the queue will be delayed at least by the time it took to send this one,
+    // with SO_TXTIME the pacer returns before the scheduled time so that may be less than nothing
+    abr->queue_delay((int)packets->size() / packet->block_count * frame_span + std::max(send_time, std::chrono::nanoseconds {}));
+    send_time = {};
   }
 
   stop(session);
   captureThread.join();
+
+  if(frames) {
+    auto mean = frame_bytes_sum / frames;
+    auto stddev = std::sqrt(std::max(0.0, frame_bytes_sq_sum / frames - mean * mean));
+
+    BOOST_LOG(info) << "Frame size over "sv << frames << " frames: mean "sv << (std::int64_t)mean
+                    << " bytes, stddev "sv << (std::int64_t)stddev << " bytes, max "sv << frame_bytes_max << " bytes"sv;
+  }
+
+  BOOST_LOG(info) << "Video queue: max depth "sv << queue_max << " packets, dropped "sv << queue_dropped << " packets, "sv
+                  << filter.dropped_frames << " frames not sent, "sv << filter.late_frames << " of them past their deadline"sv;
+  pacer.log_stats();
+
+  if(send_errors) {
+    BOOST_LOG(info) << "Video: "sv << send_errors << " FEC blocks couldn't be sent completely"sv;
+  }
+
+  TRACE_LOG_STATS();
 }
 
 void respond(host_t &host, peer_t peer, msg_t &resp) {
@@ -1044,14 +1143,26 @@ void cmd_announce(host_t &host, peer_t peer, msg_t &&req) {
 
   session.pingTimeout = std::chrono::steady_clock::now() + config::stream.ping_timeout;
 
-  session.video_packets = std::make_shared<video::packet_queue_t::element_type>();
-  session.audio_packets = std::make_shared<audio::packet_queue_t::element_type>();
+  // Without anything to drop, a full queue blocks
+  audio::packet_queue_t::element_type::droppable_t audio_droppable;
+  if(config::stream.queue_policy != "block"sv) {
+    // Audio packets don't depend on each other
+    audio_droppable = [](const audio::packet_t &) { return true; };
+  }
+
+  session.video_packets = std::make_shared<video::packet_queue_t::element_type>(
+    std::max(0, config::stream.video_queue_size), video::droppable(config::stream.queue_policy));
+  session.audio_packets = std::make_shared<audio::packet_queue_t::element_type>(
+    std::max(0, config::stream.audio_queue_size), std::move(audio_droppable));
 
   video::idr_event_t idr_events {new video::idr_event_t::element_type };
+  video::bitrate_event_t bitrate_events {new video::bitrate_event_t::element_type };
+
+  auto abr = std::make_shared<abr::controller_t>(session.config.monitor.bitrate, bitrate_events);
 
   session.audioThread   = std::thread {audioThread};
-  session.videoThread   = std::thread {videoThread, idr_events};
-  session.controlThread = std::thread {controlThread, idr_events};
+  session.videoThread   = std::thread {videoThread, idr_events, bitrate_events, abr};
+  session.controlThread = std::thread {controlThread, idr_events, abr};
 
   session_state.store(state_e::RUNNING);
   respond(host, peer, &option, 200, "OK", req->sequenceNumber, {});
@@ -1073,6 +1184,7 @@ void rtpThread(std::shared_ptr<safe::event_t<bool>> shutdown_event) {
   input = std::make_shared<input::input_t>();
   auto fg = util::fail_guard([&]() {
     input.reset();
+    video::release_warm_pipeline();
   });
 
   rtsp_server_t server(RTSP_SETUP_PORT);
@@ -5,8 +5,10 @@
 #ifndef SUNSHINE_THREAD_SAFE_H
 #define SUNSHINE_THREAD_SAFE_H
 
+#include <algorithm>
 #include <vector>
 #include <mutex>
+#include <functional>
 #include <condition_variable>
 
 #include "utility.h"
@@ -100,14 +102,43 @@ class queue_t {
   using status_t = util::optional_t<T>;
 
 public:
+  using droppable_t = std::function<bool(const T&)>;
+
+  queue_t() = default;
+
+  /**
+   * Once the queue holds max_elements, raise makes room:
+   * without droppable, it waits until an element is popped,
+   * otherwise it drops the oldest element for which droppable returns true, or the oldest element if there is none
+   */
+  queue_t(std::size_t max_elements, droppable_t droppable) : _max_elements { max_elements }, _droppable { std::move(droppable) } {}
+
   template<class ...Args>
   void raise(Args &&... args) {
-    std::lock_guard lg{_lock};
+    std::unique_lock ul{_lock};
 
     if(!_continue) {
       return;
     }
 
+    if(_max_elements && _queue.size() >= _max_elements) {
+      if(_droppable) {
+        auto it = std::find_if(std::begin(_queue), std::end(_queue), _droppable);
+
+        _queue.erase(it == std::end(_queue) ? std::begin(_queue) : it);
+        ++_dropped;
+      }
+      else {
+        _cv.wait(ul, [this]() {
+          return !_continue || _queue.size() < _max_elements;
+        });
+
+        if(!_continue) {
+          return;
+        }
+      }
+    }
+
     _queue.emplace_back(std::forward<Args>(args)...);
 
     _cv.notify_all();
@@ -137,6 +168,11 @@ public:
     auto val = std::move(_queue.front());
     _queue.erase(std::begin(_queue));
 
+    // Wake up a raise waiting for room
+    if(_max_elements) {
+      _cv.notify_all();
+    }
+
     return val;
   }
 
@@ -144,6 +180,21 @@ public:
     return _queue;
   }
 
+  std::size_t size() {
+    std::lock_guard lg { _lock };
+
+    return _queue.size();
+  }
+
+  /**
+   * Number of elements dropped to make room for new elements
+   */
+  std::size_t dropped() {
+    std::lock_guard lg { _lock };
+
+    return _dropped;
+  }
+
   void stop() {
     std::lock_guard lg{_lock};
 
@@ -160,6 +211,10 @@ private:
 
   bool _continue{true};
 
+  std::size_t _max_elements {};
+  droppable_t _droppable;
+  std::size_t _dropped {};
+
   std::mutex _lock;
   std::condition_variable _cv;
   std::vector<T> _queue;
@@ -0,0 +1,294 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include "trace.h"
+
+#ifdef SUNSHINE_TRACE
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "main.h"
+
+namespace trace {
+using namespace std::literals;
+using clock = std::chrono::steady_clock;
+
+// Number of completed frames kept for the Chrome trace
+constexpr auto MAX_COMPLETED = 4096;
+
+// Records of frames that never complete, e.g. frames replaced before the encoder got to them
+// are dropped once there are this many records
+constexpr auto MAX_PENDING = 256;
+
+constexpr auto DUMP_FILE = "sunshine_trace.json";
+
+constexpr std::array<std::string_view, (int)stage_e::_max> stage_names {
+  "snapshot"sv,
+  "convert"sv,
+  "encode"sv,
+  "packetize"sv,
+  "fec"sv,
+  "send"sv
+};
+
+struct record_t {
+  std::int64_t pts;
+  std::array<clock::time_point, (int)stage_e::_max> begin;
+  std::array<clock::time_point, (int)stage_e::_max> end;
+};
+
+/*
+ * Logarithmic histogram, 4 buckets per power of 2 microseconds
+ */
+class histogram_t {
+public:
+  static constexpr auto BUCKETS_PER_OCTAVE = 4;
+  static constexpr auto BUCKETS = 24 * BUCKETS_PER_OCTAVE;
+
+  void add(std::chrono::nanoseconds duration) {
+    auto us = std::max(1.0, duration.count() / 1000.0);
+    auto bucket = std::min(BUCKETS - 1, (int)(std::log2(us) * BUCKETS_PER_OCTAVE));
+
+    ++_buckets[bucket];
+    ++_count;
+  }
+
+  /**
+   * Upper bound in microseconds of the bucket holding the percentile
+   */
+  std::int64_t percentile(int percent) const {
+    auto target = (_count * percent + 99) / 100;
+
+    std::int64_t count = 0;
+    for(int x = 0; x < BUCKETS; ++x) {
+      count += _buckets[x];
+
+      if(count >= target) {
+        return (std::int64_t)std::exp2((x + 1) / (double)BUCKETS_PER_OCTAVE);
+      }
+    }
+
+    return 0;
+  }
+
+  std::int64_t count() const {
+    return _count;
+  }
+
+private:
+  std::array<std::int64_t, BUCKETS> _buckets {};
+  std::int64_t _count {};
+};
+
+std::mutex lock;
+
+std::unordered_map<const void*, record_t> pending;
+std::unordered_map<std::int64_t, record_t> frames;
+
+std::vector<record_t> completed;
+std::size_t completed_pos {};
+
+std::array<histogram_t, (int)stage_e::_max> histograms;
+histogram_t total;
+
+std::atomic_bool dump_requested;
+
+template<class M, class K>
+record_t &find(M &map, const K &key) {
+  if(map.size() >= MAX_PENDING && map.find(key) == std::end(map)) {
+    map.clear();
+  }
+
+  return map[key];
+}
+
+void dump();
+
+/**
+ * Frames repeated while the screen doesn't change skip the earlier stages
+ */
+clock::time_point first_begin(const record_t &record) {
+  for(auto &begin : record.begin) {
+    if(begin != clock::time_point {}) {
+      return begin;
+    }
+  }
+
+  return {};
+}
+
+void begin(const void *key, stage_e stage) {
+  auto now = clock::now();
+
+  std::lock_guard lg { lock };
+  find(pending, key).begin[(int)stage] = now;
+}
+
+void begin(std::int64_t pts, stage_e stage) {
+  auto now = clock::now();
+
+  std::lock_guard lg { lock };
+  find(frames, pts).begin[(int)stage] = now;
+}
+
+void end(const void *key, stage_e stage) {
+  auto now = clock::now();
+
+  std::lock_guard lg { lock };
+  find(pending, key).end[(int)stage] = now;
+}
+
+void complete(record_t &&record) {
+  total.add(record.end[(int)stage_e::send] - first_begin(record));
+
+  for(int x = 0; x < (int)stage_e::_max; ++x) {
+    if(record.begin[x] != clock::time_point {} && record.end[x] != clock::time_point {}) {
+      histograms[x].add(record.end[x] - record.begin[x]);
+    }
+  }
+
+  if(completed.size() < MAX_COMPLETED) {
+    completed.emplace_back(std::move(record));
+  }
+  else {
+    completed[completed_pos] = std::move(record);
+    completed_pos = (completed_pos + 1) % MAX_COMPLETED;
+  }
+}
+
+void end(std::int64_t pts, stage_e stage) {
+  auto now = clock::now();
+
+  std::lock_guard lg { lock };
+
+  // The encoder may still end its stage after the last block of the frame has been sent
+  auto it = frames.find(pts);
+  if(it == std::end(frames)) {
+    return;
+  }
+
+  auto &record = it->second;
+  record.end[(int)stage] = now;
+
+  if(stage != stage_e::send) {
+    return;
+  }
+
+  record.pts = pts;
+  complete(std::move(record));
+  frames.erase(it);
+
+  if(dump_requested.exchange(false)) {
+    task_pool.push(dump);
+  }
+}
+
+void rekey(const void *from, const void *to) {
+  std::lock_guard lg { lock };
+
+  auto it = pending.find(from);
+  if(it == std::end(pending)) {
+    return;
+  }
+
+  auto record = std::move(it->second);
+  pending.erase(it);
+
+  find(pending, to) = std::move(record);
+}
+
+void rekey(const void *from, std::int64_t pts) {
+  std::lock_guard lg { lock };
+
+  auto it = pending.find(from);
+  if(it == std::end(pending)) {
+    return;
+  }
+
+  auto record = std::move(it->second);
+  pending.erase(it);
+
+  find(frames, pts) = std::move(record);
+}
+
+void log_stats() {
+  std::lock_guard lg { lock };
+
+  if(!total.count()) {
+    return;
+  }
+
+  BOOST_LOG(info) << "Frame latency over "sv << total.count() << " frames [p50/p95/p99 in us]"sv;
+  for(int x = 0; x < (int)stage_e::_max; ++x) {
+    auto &histogram = histograms[x];
+
+    BOOST_LOG(info) << "  "sv << stage_names[x] << ": "sv
+      << histogram.percentile(50) << '/' << histogram.percentile(95) << '/' << histogram.percentile(99);
+  }
+
+  BOOST_LOG(info) << "  total: "sv << total.percentile(50) << '/' << total.percentile(95) << '/' << total.percentile(99);
+}
+
+void request_dump() {
+  dump_requested = true;
+}
+
+void dump() {
+  std::vector<record_t> records;
+  {
+    std::lock_guard lg { lock };
+
+    records.insert(std::end(records), std::begin(completed) + completed_pos, std::end(completed));
+    records.insert(std::end(records), std::begin(completed), std::begin(completed) + completed_pos);
+  }
+
+  log_stats();
+
+  if(records.empty()) {
+    return;
+  }
+
+  auto epoch = first_begin(records.front());
+  auto us = [&](clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(t - epoch).count();
+  };
+
+  std::ofstream out { DUMP_FILE };
+  out << "{\"traceEvents\":["sv;
+
+  bool first = true;
+  for(auto &record : records) {
+    for(int x = 0; x < (int)stage_e::_max; ++x) {
+      if(record.begin[x] == clock::time_point {} || record.end[x] == clock::time_point {}) {
+        continue;
+      }
+
+      if(!first) {
+        out << ',';
+      }
+      first = false;
+
+      out << "{\"name\":\""sv << stage_names[x]
+          << "\",\"cat\":\"video\",\"ph\":\"X\",\"pid\":1,\"tid\":"sv << x
+          << ",\"ts\":"sv << us(record.begin[x])
+          << ",\"dur\":"sv << us(record.end[x]) - us(record.begin[x])
+          << ",\"args\":{\"pts\":"sv << record.pts << "}}"sv;
+    }
+  }
+
+  out << "]}"sv;
+
+  BOOST_LOG(info) << "Wrote trace of "sv << records.size() << " frames to "sv << DUMP_FILE;
+}
+}
+
+#endif
@@ -0,0 +1,70 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#ifndef SUNSHINE_TRACE_H
+#define SUNSHINE_TRACE_H
+
+/*
+ * Per frame latency tracing, enabled with -DSUNSHINE_ENABLE_TRACE=ON
+ *
+ * Every stage of a frame is timestamped in a record that follows the frame through the pipeline:
+ * Until the encoder assigns the pts, the record is keyed by the image or AVFrame holding the frame,
+ * from then on it's keyed by the pts.
+ *
+ * Without SUNSHINE_TRACE, the macros expand to nothing.
+ */
+#ifdef SUNSHINE_TRACE
+
+#include <cstdint>
+
+#define TRACE_BEGIN(key, stage) ::trace::begin((key), ::trace::stage_e::stage)
+#define TRACE_END(key, stage) ::trace::end((key), ::trace::stage_e::stage)
+#define TRACE_REKEY(from, to) ::trace::rekey((from), (to))
+#define TRACE_LOG_STATS() ::trace::log_stats()
+
+namespace trace {
+enum class stage_e : int {
+  snapshot,
+  convert,
+  encode,
+  packetize,
+  fec,
+  send,
+  _max
+};
+
+void begin(const void *key, stage_e stage);
+void begin(std::int64_t pts, stage_e stage);
+void end(const void *key, stage_e stage);
+
+/**
+ * The record is complete once the send stage has ended,
+ * ending a stage of a frame without record is ignored
+ */
+void end(std::int64_t pts, stage_e stage);
+
+void rekey(const void *from, const void *to);
+void rekey(const void *from, std::int64_t pts);
+
+/**
+ * Log p50/p95/p99 of every stage
+ */
+void log_stats();
+
+/**
+ * Write the latest frames as Chrome trace-event JSON, safe to call from a signal handler
+ */
+void request_dump();
+}
+
+#else
+
+#define TRACE_BEGIN(key, stage)
+#define TRACE_END(key, stage)
+#define TRACE_REKEY(from, to)
+#define TRACE_LOG_STATS()
+
+#endif
+
+#endif //SUNSHINE_TRACE_H
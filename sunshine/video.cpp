@@ -2,7 +2,13 @@
 // Created by loki on 6/6/19.
 //
 
+#include <cmath>
+#include <cstring>
 #include <thread>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <sstream>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -11,6 +17,11 @@ extern "C" {
 
 #include "platform/common.h"
 #include "config.h"
+#include "convert.h"
+#include "encoder.h"
+#include "encoder_input.h"
+#include "process.h"
+#include "trace.h"
 #include "video.h"
 #include "main.h"
 
@@ -32,62 +43,347 @@ void free_packet(AVPacket *packet) {
 using ctx_t       = util::safe_ptr<AVCodecContext, free_ctx>;
 using frame_t     = util::safe_ptr<AVFrame, free_frame>;
 using sws_t       = util::safe_ptr<SwsContext, sws_freeContext>;
-using img_event_t = std::shared_ptr<safe::event_t<std::unique_ptr<platf::img_t>>>;
 
-auto open_codec(ctx_t &ctx, AVCodec *codec, AVDictionary **options) {
-  avcodec_open2(ctx.get(), codec, options);
+/*
+ * An image and when it was captured, a repeated image counts as captured when it's repeated
+ */
+struct snapshot_t {
+  std::shared_ptr<platf::img_t> img;
+  std::chrono::steady_clock::time_point captured;
+};
 
-  return util::fail_guard([&]() {
-    avcodec_close(ctx.get());
-  });
+using img_event_t   = std::shared_ptr<safe::event_t<snapshot_t>>;
+
+// One image being captured, one waiting in img_event_t, one being converted and the latest image
+// kept for repeating it while the screen doesn't change, with one spare to absorb jitter between the capture and convert threads
+constexpr auto IMG_POOL_SIZE = 5;
+
+// While the screen doesn't change, the latest image is repeated at least this often
+constexpr auto IDLE_KEEPALIVE = 100ms;
+
+// Time the pipeline of a session stays open after the session ended
+constexpr auto WARM_PIPELINE_TIMEOUT = 30s;
+
+// One frame being converted, one waiting in encoder_input_t and one being encoded, which the encoder keeps
+// until the next frame arrives, to encode it again when an IDR frame is requested
+constexpr auto FRAME_RING_SIZE = 3;
+
+// Pixels around the cursor that are encoded with the QP of the cursor
+constexpr auto ROI_CURSOR_MARGIN = 64;
+
+// Beyond this number of damaged rectangles, a single region of interest covers all of them
+constexpr auto MAX_ROI_DAMAGE = 32;
+
+using input_t = encoder_input_t<frame_t>;
+
+AVPixelFormat pix_fmt(const config_t &config) {
+  return config.dynamicRange == 0 ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_YUV420P10;
+}
+
+int sws_colorspace(const config_t &config) {
+  switch (config.encoderCscMode >> 1) {
+    case 0:
+    default:
+      // Rec. 601
+      return SWS_CS_SMPTE170M;
+    case 1:
+      // Rec. 709
+      return SWS_CS_ITU709;
+    case 2:
+      // Rec. 2020
+      return SWS_CS_BT2020;
+  }
 }
 
-void encode(int64_t frame, ctx_t &ctx, sws_t &sws, frame_t &yuv_frame, platf::img_t &img, packet_queue_t &packets) {
-  av_frame_make_writable(yuv_frame.get());
+/**
+ * Attach the regions of interest derived from the hints of the display to the frame:
+ * The area around the cursor and the recently changed areas get a lower QP, the static background a higher QP.
+ * Where regions overlap, the first one takes precedence
+ */
+void add_roi(AVFrame *frame, const platf::img_t &img, int qp_range) {
+  auto qp = config::video.roi_qp;
+  if(!qp || (img.damage.empty() && !img.cursor.width)) {
+    return;
+  }
+
+  std::vector<AVRegionOfInterest> regions;
+  auto add_region = [&](platf::rect_t rect, int qp_offset) {
+    // The image is scaled to the resolution of the frame
+    auto left   = (int)((std::int64_t)std::clamp(rect.x, 0, img.width) * frame->width / img.width);
+    auto right  = (int)((std::int64_t)std::clamp(rect.x + rect.width, 0, img.width) * frame->width / img.width);
+    auto top    = (int)((std::int64_t)std::clamp(rect.y, 0, img.height) * frame->height / img.height);
+    auto bottom = (int)((std::int64_t)std::clamp(rect.y + rect.height, 0, img.height) * frame->height / img.height);
+
+    if(left >= right || top >= bottom) {
+      return;
+    }
 
-  const int linesizes[2] {
-    (int)(img.width * sizeof(int)), 0
+    regions.emplace_back(AVRegionOfInterest {
+      sizeof(AVRegionOfInterest),
+      top, bottom, left, right,
+      av_make_q(qp_offset, qp_range)
+    });
   };
 
-  auto data = img.data;
-  int ret = sws_scale(sws.get(), (uint8_t*const*)&data, linesizes, 0, img.height, yuv_frame->data, yuv_frame->linesize);
+  if(img.cursor.width) {
+    add_region({
+      img.cursor.x - ROI_CURSOR_MARGIN,
+      img.cursor.y - ROI_CURSOR_MARGIN,
+      img.cursor.width + ROI_CURSOR_MARGIN * 2,
+      img.cursor.height + ROI_CURSOR_MARGIN * 2
+    }, -qp);
+  }
+
+  if(img.damage.size() > MAX_ROI_DAMAGE) {
+    // Scattered damage is treated as one region covering all of it
+    auto left = img.width, top = img.height, right = 0, bottom = 0;
+    for(auto &rect : img.damage) {
+      left   = std::min(left, rect.x);
+      top    = std::min(top, rect.y);
+      right  = std::max(right, rect.x + rect.width);
+      bottom = std::max(bottom, rect.y + rect.height);
+    }
 
-  if(ret <= 0) {
-    exit(1);
+    add_region({ left, top, right - left, bottom - top }, -qp);
+  }
+  else {
+    for(auto &rect : img.damage) {
+      add_region(rect, -qp);
+    }
   }
 
-  yuv_frame->pts = frame;
+  add_region({ 0, 0, img.width, img.height }, qp / 2);
 
-  /* send the frame to the encoder */
-  ret = avcodec_send_frame(ctx.get(), yuv_frame.get());
-  if (ret < 0) {
-    BOOST_LOG(fatal) << "Could not send a frame for encoding"sv;
-    log_flush();
-    std::abort();
+  auto side_data = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, regions.size() * sizeof(AVRegionOfInterest));
+  if(!side_data) {
+    return;
   }
 
-  while (ret >= 0) {
-    packet_t packet { av_packet_alloc() };
+  std::memcpy(side_data->data, regions.data(), side_data->size);
+}
 
-    ret = avcodec_receive_packet(ctx.get(), packet.get());
-    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-      return;
+void convertThread(img_event_t images, std::shared_ptr<input_t> input, config_t config) {
+  auto fg = util::fail_guard([&]() {
+    input->stop();
+  });
+
+  auto threads = config::video.convert_threads;
+  if(threads <= 0) {
+    threads = std::clamp((int)std::thread::hardware_concurrency() / 4, 1, 8);
+  }
+
+  // The convert thread itself converts the first band
+  util::ThreadPool workers { threads - 1 };
+  std::vector<std::future<void>> bands;
+  bands.reserve(threads - 1);
+
+  std::vector<frame_t> ring(FRAME_RING_SIZE);
+  for(auto &frame : ring) {
+    frame.reset(av_frame_alloc());
+
+    frame->format = pix_fmt(config);
+    frame->width  = config.width;
+    frame->height = config.height;
+
+    av_frame_get_buffer(frame.get(), 0);
+  }
+
+  convert::yuv420_t yuv { config.encoderCscMode, config.dynamicRange == 0 ? 8 : 10 };
+  BOOST_LOG(debug) << "Color conversion kernel ["sv << yuv.kernel() << "] with "sv << threads << " bands"sv;
+
+  auto qp_range = roi_qp_range(config);
+
+  auto img_width  = 0;
+  auto img_height = 0;
+
+  // Initiate scaling context with correct height and width
+  // swscale is only needed when the image has to be scaled
+  sws_t sws;
+  while(auto snapshot = images->pop()) {
+    auto &img = snapshot->img;
+
+    auto new_width  = img->width;
+    auto new_height = img->height;
+
+    if(img_width != new_width || img_height != new_height) {
+      img_width  = new_width;
+      img_height = new_height;
+
+      if(img_width == config.width && img_height == config.height) {
+        sws.reset();
+      }
+      else {
+        sws.reset(
+          sws_getContext(
+            img_width, img_height, AV_PIX_FMT_BGR0,
+            config.width, config.height, pix_fmt(config),
+            SWS_LANCZOS | SWS_ACCURATE_RND,
+            nullptr, nullptr, nullptr));
+
+        sws_setColorspaceDetails(sws.get(), sws_getCoefficients(SWS_CS_DEFAULT), 0,
+                                 sws_getCoefficients(sws_colorspace(config)), config.encoderCscMode & 0x1,
+                                 0, 1 << 16, 1 << 16);
+      }
     }
-    else if (ret < 0) {
-      BOOST_LOG(fatal) << "Could not encode video packet"sv;
+
+    // A frame is free once the encoder has dropped its reference
+    auto frame = std::find_if(std::begin(ring), std::end(ring), [](const auto &frame) {
+      return av_frame_is_writable(frame.get());
+    });
+
+    if(frame == std::end(ring)) {
+      frame = std::begin(ring);
+      av_frame_make_writable(frame->get());
+    }
+
+    auto yuv_frame = frame->get();
+
+    TRACE_BEGIN(img.get(), convert);
+
+    const int linesizes[2] {
+      (int)(img->width * sizeof(int)), 0
+    };
+
+    if(sws) {
+      auto data = img->data;
+      int ret = sws_scale(sws.get(), (uint8_t*const*)&data, linesizes, 0, img->height, yuv_frame->data, yuv_frame->linesize);
+
+      if(ret <= 0) {
+        exit(1);
+      }
+    }
+    else {
+      // Bands start at an even row, so no chroma row is shared between bands
+      auto rows = ((img->height + threads - 1) / threads + 1) & ~1;
+
+      auto convert_band = [&](int band) {
+        yuv(img->data, linesizes[0], img->width, img->height, yuv_frame->data, yuv_frame->linesize, band * rows, (band + 1) * rows);
+      };
+
+      for(int band = 1; band < threads; ++band) {
+        bands.emplace_back(workers.push(convert_band, band));
+      }
+
+      convert_band(0);
+
+      for(auto &band : bands) {
+        band.wait();
+      }
+      bands.clear();
+    }
+
+    TRACE_END(img.get(), convert);
+
+    frame_t clone { av_frame_clone(yuv_frame) };
+    TRACE_REKEY(img.get(), clone.get());
+
+    add_roi(clone.get(), *img, qp_range);
+
+    input->raise(std::move(clone), snapshot->captured);
+  }
+}
+
+int roi_qp_range(const config_t &config) {
+  if(config.videoFormat == 1) {
+    return ROI_QP_RANGE_HEVC;
+  }
+
+  return ROI_QP_RANGE_H264 + 6 * (config.dynamicRange ? 2 : 0);
+}
+
+colorspace_t colorspace(const config_t &config) {
+  colorspace_t colorspace;
+
+  colorspace.full_range = config.encoderCscMode & 0x1;
+
+  switch (config.encoderCscMode >> 1) {
+    case 0:
+    default:
+      // Rec. 601
+      colorspace.primaries = AVCOL_PRI_SMPTE170M;
+      colorspace.trc = AVCOL_TRC_SMPTE170M;
+      colorspace.matrix = AVCOL_SPC_SMPTE170M;
+      break;
+
+    case 1:
+      // Rec. 709
+      colorspace.primaries = AVCOL_PRI_BT709;
+      colorspace.trc = AVCOL_TRC_BT709;
+      colorspace.matrix = AVCOL_SPC_BT709;
+      break;
+
+    case 2:
+      // Rec. 2020
+      colorspace.primaries = AVCOL_PRI_BT2020;
+      colorspace.trc = AVCOL_TRC_BT2020_10;
+      colorspace.matrix = AVCOL_SPC_BT2020_NCL;
+      break;
+  }
+
+  return colorspace;
+}
+
+class avcodec_encoder_t : public encoder_t {
+public:
+  avcodec_encoder_t(ctx_t &&ctx) : ctx { std::move(ctx) } {}
+
+  ~avcodec_encoder_t() override {
+    avcodec_close(ctx.get());
+  }
+
+  void encode(int64_t frame, AVFrame *yuv_frame, std::chrono::steady_clock::time_point captured, bool idr, bool recovery, packet_queue_t &packets) override {
+    yuv_frame->pts = frame;
+    yuv_frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+    /* send the frame to the encoder */
+    auto ret = avcodec_send_frame(ctx.get(), yuv_frame);
+    if (ret < 0) {
+      BOOST_LOG(fatal) << "Could not send a frame for encoding"sv;
       log_flush();
       std::abort();
     }
 
-    packets->raise(std::move(packet));
+    while (ret >= 0) {
+      // libavcodec only returns whole frames
+      auto packet = std::make_unique<packet_raw_t>(av_packet_alloc());
+
+      ret = avcodec_receive_packet(ctx.get(), packet->av_packet.get());
+      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        return;
+      }
+      else if (ret < 0) {
+        BOOST_LOG(fatal) << "Could not encode video packet"sv;
+        log_flush();
+        std::abort();
+      }
+
+      packet->captured = captured;
+      packet->reference = !(packet->av_packet->flags & AV_PKT_FLAG_DISPOSABLE);
+      packet->recovery = recovery;
+
+      packets->raise(std::move(packet));
+    }
   }
-}
 
-void encodeThread(
-  img_event_t images,
-  packet_queue_t packets,
-  idr_event_t idr_events,
-  config_t config) {
+  int set_bitrate(int bitrate) override {
+    // Only libavcodec's libx264 wrapper applies changes to the rate control of an open encoder
+    if(!ctx->bit_rate || ctx->codec_id != AV_CODEC_ID_H264) {
+      return -1;
+    }
+
+    bitrate *= 1000;
+    ctx->rc_max_rate = bitrate;
+    ctx->rc_buffer_size = bitrate / 100;
+    ctx->bit_rate = bitrate;
+    ctx->rc_min_rate = bitrate;
+
+    return 0;
+  }
+
+  ctx_t ctx;
+};
+
+std::unique_ptr<encoder_t> avcodec_encoder(const config_t &config) {
   int framerate = config.framerate;
 
   AVCodec *codec;
@@ -101,8 +397,6 @@ void encodeThread(
 
   ctx_t ctx{avcodec_alloc_context3(codec)};
 
-  frame_t yuv_frame{av_frame_alloc()};
-
   ctx->width = config.width;
   ctx->height = config.height;
   ctx->time_base = AVRational{1, framerate};
@@ -118,42 +412,13 @@ void encodeThread(
     ctx->profile = FF_PROFILE_HEVC_MAIN_10;
   }
 
-  if(config.dynamicRange == 0) {
-    ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-  }
-  else {
-    ctx->pix_fmt = AV_PIX_FMT_YUV420P10;
-  }
+  ctx->pix_fmt = pix_fmt(config);
 
-  ctx->color_range = (config.encoderCscMode & 0x1) ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
-
-  int swsColorSpace;
-  switch (config.encoderCscMode >> 1) {
-    case 0:
-    default:
-      // Rec. 601
-      ctx->color_primaries = AVCOL_PRI_SMPTE170M;
-      ctx->color_trc = AVCOL_TRC_SMPTE170M;
-      ctx->colorspace = AVCOL_SPC_SMPTE170M;
-      swsColorSpace = SWS_CS_SMPTE170M;
-      break;
-
-    case 1:
-      // Rec. 709
-      ctx->color_primaries = AVCOL_PRI_BT709;
-      ctx->color_trc = AVCOL_TRC_BT709;
-      ctx->colorspace = AVCOL_SPC_BT709;
-      swsColorSpace = SWS_CS_ITU709;
-      break;
-
-    case 2:
-      // Rec. 2020
-      ctx->color_primaries = AVCOL_PRI_BT2020;
-      ctx->color_trc = AVCOL_TRC_BT2020_10;
-      ctx->colorspace = AVCOL_SPC_BT2020_NCL;
-      swsColorSpace = SWS_CS_BT2020;
-      break;
-  }
+  auto color = colorspace(config);
+  ctx->color_range = color.full_range ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+  ctx->color_primaries = (AVColorPrimaries)color.primaries;
+  ctx->color_trc = (AVColorTransferCharacteristic)color.trc;
+  ctx->colorspace = (AVColorSpace)color.matrix;
 
   // B-frames delay decoder output, so never use them
   ctx->max_b_frames = 0;
@@ -177,11 +442,11 @@ void encodeThread(
   av_dict_set(&options, "tune", config::video.tune.c_str(), 0);
 
   if(config.bitrate > 500) {
-    config.bitrate *= 1000;
-    ctx->rc_max_rate = config.bitrate;
-    ctx->rc_buffer_size = config.bitrate / 100;
-    ctx->bit_rate = config.bitrate;
-    ctx->rc_min_rate = config.bitrate;
+    auto bitrate = config.bitrate * 1000;
+    ctx->rc_max_rate = bitrate;
+    ctx->rc_buffer_size = bitrate / 100;
+    ctx->bit_rate = bitrate;
+    ctx->rc_min_rate = bitrate;
   }
   else if(config::video.crf != 0) {
     av_dict_set_int(&options, "crf", config::video.crf, 0);
@@ -195,111 +460,584 @@ void encodeThread(
     // kicked to the 2nd packet in the frame, breaking Moonlight's parsing logic.
     // It also looks like gop_size isn't passed on to x265, so we have to set
     // 'keyint=-1' in the parameters ourselves.
-    av_dict_set(&options, "x265-params", "info=0:keyint=-1", 0);
+    std::stringstream x265_params;
+    x265_params << "info=0:keyint=-1"sv;
+
+    // libx265 ignores the slices and thread_count of the context.
+    // Frame threading adds a frame of latency per thread, so a single frame has to be spread over the cores
+    auto threads = config::video.hevc_threads;
+    if(threads <= 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    x265_params << ":frame-threads=1:wpp=1:pools="sv << threads << ":slices="sv << ctx->slices;
+    if(threads > 8) {
+      x265_params << ":pmode=1:pme=1"sv;
+    }
+
+    BOOST_LOG(debug) << "x265 parameters ["sv << x265_params.str() << ']';
+    av_dict_set(&options, "x265-params", x265_params.str().c_str(), 0);
   }
   
   ctx->flags |= (AV_CODEC_FLAG_CLOSED_GOP | AV_CODEC_FLAG_LOW_DELAY);
   ctx->flags2 |= AV_CODEC_FLAG2_FAST;
 
-  auto lg = open_codec(ctx, codec, &options);
+  auto status = avcodec_open2(ctx.get(), codec, &options);
+  av_dict_free(&options);
+
+  if(status < 0) {
+    BOOST_LOG(error) << "Could not open codec ["sv << codec->name << ']';
+
+    return nullptr;
+  }
+
+  return std::make_unique<avcodec_encoder_t>(std::move(ctx));
+}
+
+std::unique_ptr<encoder_t> make_encoder(const config_t &config) {
+  // libx264 is used directly, it can recover from lost frames without an IDR frame
+  if(config.videoFormat == 0 && config.dynamicRange == 0) {
+    return x264_encoder(config);
+  }
+
+  if(config::video.intra_refresh > 0) {
+    BOOST_LOG(warning) << "Intra refresh is only supported for 8 bit H.264, using IDR frames instead"sv;
+  }
+
+  return avcodec_encoder(config);
+}
 
-  yuv_frame->format = ctx->pix_fmt;
-  yuv_frame->width = ctx->width;
-  yuv_frame->height = ctx->height;
+/**
+ * Keeps the encode time of a frame within the frame budget by stepping through the speed levels of the encoder
+ * The decision is made once per window of frames, going faster as soon as the budget is exceeded,
+ * going slower only after several windows with plenty of time to spare
+ */
+class governor_t {
+public:
+  static constexpr auto WINDOW = 30;
 
-  av_frame_get_buffer(yuv_frame.get(), 0);
+  // Go faster when more than 10% of the frames are over budget, or the average is above 90% of the budget
+  static constexpr auto FASTER_OVER_BUDGET = WINDOW / 10;
+  static constexpr auto FASTER_AVERAGE = 0.9;
+
+  // Go slower after this many windows in a row with an average below 50% of the budget and no frame over budget
+  static constexpr auto SLOWER_WINDOWS = 4;
+  static constexpr auto SLOWER_AVERAGE = 0.5;
+
+  governor_t(encoder_t &encoder, std::chrono::nanoseconds budget) : _encoder { encoder }, _budget { budget } {}
+
+  void add(std::chrono::nanoseconds elapsed) {
+    _elapsed += elapsed;
+    if(elapsed > _budget) {
+      ++_over_budget;
+    }
+
+    if(++_frames < WINDOW) {
+      return;
+    }
+
+    auto average = _elapsed / _frames;
+    auto fg = util::fail_guard([this]() {
+      _frames = 0;
+      _over_budget = 0;
+      _elapsed = {};
+    });
+
+    if(_over_budget > FASTER_OVER_BUDGET || average > _budget * FASTER_AVERAGE) {
+      _idle_windows = 0;
+
+      if(_encoder.set_speed(_level + 1)) {
+        if(!_at_fastest) {
+          BOOST_LOG(warning) << "Encoder can't go any faster: average "sv << us(average) << "us, "sv
+                             << _over_budget << '/' << _frames << " frames over the budget of "sv << us(_budget) << "us"sv;
+        }
+        _at_fastest = true;
+
+        return;
+      }
+
+      ++_level;
+      BOOST_LOG(info) << "Encoder speed level "sv << _level << ": average "sv << us(average) << "us, "sv
+                      << _over_budget << '/' << _frames << " frames over the budget of "sv << us(_budget) << "us"sv;
+
+      return;
+    }
+
+    if(!_level || _over_budget || average > _budget * SLOWER_AVERAGE || ++_idle_windows < SLOWER_WINDOWS) {
+      return;
+    }
+
+    _idle_windows = 0;
+    if(_encoder.set_speed(_level - 1)) {
+      return;
+    }
+
+    --_level;
+    _at_fastest = false;
+    BOOST_LOG(info) << "Encoder speed level "sv << _level << ": average "sv << us(average) << "us, within the budget of "sv
+                    << us(_budget) << "us"sv;
+  }
+
+private:
+  static std::int64_t us(std::chrono::nanoseconds duration) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  }
+
+  encoder_t &_encoder;
+  std::chrono::nanoseconds _budget;
+
+  int _level {};
+  bool _at_fastest {};
+  int _idle_windows {};
+
+  int _frames {};
+  int _over_budget {};
+  std::chrono::nanoseconds _elapsed {};
+};
+
+/**
+ * Requests for IDR frames are passed on to the encoder as soon as they arrive
+ */
+void idrThread(idr_event_t idr_events, std::shared_ptr<input_t> input) {
+  while(auto event = idr_events->pop()) {
+    input->raise_idr(*event);
+  }
+}
+
+void encodeThread(
+  std::shared_ptr<input_t> input,
+  packet_queue_t packets,
+  bitrate_event_t bitrate_events,
+  encoder_t &encoder,
+  config_t config) {
 
   int64_t frame = 1;
   int64_t key_frame = 1;
 
-  auto img_width  = 0;
-  auto img_height = 0;
+  // Encode time compared to the frame budget, shows whether the encoder keeps up with the framerate
+  auto budget = std::chrono::floor<std::chrono::nanoseconds>(1s) / config.framerate;
+  std::int64_t encoded {};
+  std::int64_t over_budget {};
+  std::chrono::nanoseconds encode_time {};
+  std::chrono::nanoseconds encode_time_max {};
 
-  // Initiate scaling context with correct height and width
-  sws_t sws;
-  while (auto img = images->pop()) {
-    auto new_width  = img->width;
-    auto new_height = img->height;
+  // A warm encoder may have been sped up during the previous session
+  encoder.set_speed(0);
+  governor_t governor { encoder, budget };
 
-    if(img_width != new_width || img_height != new_height) {
-      img_width  = new_width;
-      img_height = new_height;
+  auto fg = util::fail_guard([&]() {
+    if(!encoded) {
+      return;
+    }
 
-      sws.reset(
-        sws_getContext(
-          img_width, img_height, AV_PIX_FMT_BGR0,
-          ctx->width, ctx->height, ctx->pix_fmt,
-          SWS_LANCZOS | SWS_ACCURATE_RND,
-          nullptr, nullptr, nullptr));
+    auto average = encode_time / encoded;
+    BOOST_LOG(info) << "Encoded "sv << encoded << " frames: average "sv
+                    << std::chrono::duration_cast<std::chrono::microseconds>(average).count() << "us, max "sv
+                    << std::chrono::duration_cast<std::chrono::microseconds>(encode_time_max).count() << "us, "sv
+                    << over_budget << " over the budget of "sv
+                    << std::chrono::duration_cast<std::chrono::microseconds>(budget).count() << "us, throughput "sv
+                    << (1s / std::chrono::duration<double>(average)) << " fps"sv;
+  });
+
+  encode_schedule_t<frame_t> schedule;
+  while(schedule.wait(*input, std::chrono::steady_clock::now)) {
+    auto &yuv_frame = schedule.frame;
+    auto &captured = schedule.captured;
+    auto &request = schedule.request;
+    auto now = schedule.time;
+
+    if(bitrate_events->peek()) {
+      auto bitrate = *bitrate_events->pop();
 
-      sws_setColorspaceDetails(sws.get(), sws_getCoefficients(SWS_CS_DEFAULT), 0,
-                               sws_getCoefficients(swsColorSpace), config.encoderCscMode & 0x1,
-                               0, 1 << 16, 1 << 16);
+      if(encoder.set_bitrate(bitrate)) {
+        BOOST_LOG(warning) << "Encoder can't change its bitrate to "sv << bitrate << " kbps"sv;
+      }
     }
 
-    if(idr_events->peek()) {
-      yuv_frame->pict_type = AV_PICTURE_TYPE_I;
+    bool idr = false;
+
+    if(request) {
+      TUPLE_2D_REF(first, end, *request);
 
-      auto event = idr_events->pop();
-      TUPLE_2D_REF(_, end, *event);
+      if(encoder.invalidate_ref_frames(first, end)) {
+        idr = true;
 
-      frame = end;
-      key_frame = end + config.framerate;
+        // Requests raised by the sender refer to frames already encoded, the pts never goes back
+        frame = std::max(frame, end);
+        key_frame = frame + config.framerate;
+      }
+
+      schedule.recovered(frame);
     }
     else if(frame == key_frame) {
-      yuv_frame->pict_type = AV_PICTURE_TYPE_I;
+      idr = true;
+    }
+
+    if(!schedule.repeat) {
+      TRACE_REKEY(yuv_frame.get(), frame);
+    }
+    else {
+      // The frame answering the request is as recent as the request
+      captured = now;
+    }
+
+    TRACE_BEGIN(frame, encode);
+    auto encode_begin = std::chrono::steady_clock::now();
+    encoder.encode(frame, yuv_frame.get(), captured, idr, (bool)request, packets);
+    auto elapsed = std::chrono::steady_clock::now() - encode_begin;
+    TRACE_END(frame, encode);
+
+    ++encoded;
+    encode_time += elapsed;
+    encode_time_max = std::max<std::chrono::nanoseconds>(encode_time_max, elapsed);
+    if(elapsed > budget) {
+      ++over_budget;
+    }
+
+    if(config::video.encode_governor) {
+      governor.add(elapsed);
+    }
+
+    ++frame;
+  }
+}
+
+/**
+ * Paces the snapshots on an absolute timeline: deadline N == start + N * time_span
+ * Time spent capturing doesn't accumulate, and when a frame is late, the missed deadlines
+ * are skipped instead of capturing several frames in a burst
+ */
+class pacer_t {
+public:
+  using clock = std::chrono::steady_clock;
+
+  pacer_t(std::chrono::nanoseconds time_span, std::chrono::nanoseconds spin) :
+    _time_span { time_span }, _spin { spin }, _next { clock::now() } {}
+
+  /**
+   * Wait for the next deadline
+   */
+  void wait() {
+    auto now = clock::now();
+
+    auto missed = (now - _next) / _time_span;
+    if(missed > 0) {
+      _next += missed * _time_span;
+      _skipped += missed;
+    }
+
+    std::this_thread::sleep_until(_next - _spin);
+    while((now = clock::now()) < _next) {
+      std::this_thread::yield();
+    }
+
+    auto jitter = std::chrono::duration_cast<std::chrono::nanoseconds>(now - _next).count();
+
+    ++_frames;
+    _jitter_sum += jitter;
+    _jitter_sq_sum += (double)jitter * jitter;
+    _jitter_max = std::max(_jitter_max, jitter);
+
+    _next += _time_span;
+  }
+
+  /**
+   * Restart the timeline, the time in between isn't counted as skipped frames
+   */
+  void reset() {
+    _next = clock::now();
+  }
+
+  void log_stats() const {
+    if(!_frames) {
+      return;
+    }
+
+    auto mean = _jitter_sum / (double)_frames;
+    auto stddev = std::sqrt(std::max(0.0, _jitter_sq_sum / _frames - mean * mean));
+
+    BOOST_LOG(info) << "Frame pacing: "sv << _frames << " frames, "sv << _skipped << " skipped, jitter mean "sv
+      << mean / 1000 << "us, stddev "sv << stddev / 1000 << "us, max "sv << _jitter_max / 1000 << "us"sv;
+  }
+
+private:
+  std::chrono::nanoseconds _time_span;
+  std::chrono::nanoseconds _spin;
+
+  clock::time_point _next;
+
+  std::int64_t _frames {};
+  std::int64_t _skipped {};
+
+  std::int64_t _jitter_sum {};
+  double _jitter_sq_sum {};
+  std::int64_t _jitter_max {};
+};
+
+/*
+ * Fixed pool of images
+ * An image returns to the free list when the last reference to it is dropped, on whichever thread that happens
+ */
+class img_pool_t : public std::enable_shared_from_this<img_pool_t> {
+public:
+  int alloc(platf::display_t &disp, int count) {
+    std::lock_guard lg { _lock };
+
+    for(int x = 0; x < count; ++x) {
+      auto img = disp.alloc_img();
+      if(!img) {
+        return -1;
+      }
+
+      _free.emplace_back(img.get());
+      _imgs.emplace_back(std::move(img));
     }
 
-    encode(frame++, ctx, sws, yuv_frame, *img, packets);
-    
-    yuv_frame->pict_type = AV_PICTURE_TYPE_NONE;
+    return 0;
+  }
+
+  /**
+   * Take a free image
+   * returns nullptr if every image is still in use
+   */
+  std::shared_ptr<platf::img_t> pop() {
+    std::lock_guard lg { _lock };
+
+    if(_free.empty()) {
+      return nullptr;
+    }
+
+    auto img = _free.back();
+    _free.pop_back();
+
+    return std::shared_ptr<platf::img_t>(img, [pool = shared_from_this()](platf::img_t *img) {
+      std::lock_guard lg { pool->_lock };
+
+      pool->_free.emplace_back(img);
+    });
+  }
+
+private:
+  std::mutex _lock;
+
+  std::vector<std::unique_ptr<platf::img_t>> _imgs;
+  std::vector<platf::img_t*> _free;
+};
+
+/*
+ * The display, its images and the encoder of a session
+ * They stay open for a while after the session ended, so a client that reconnects
+ * with the same parameters doesn't have to wait for them to be opened again
+ */
+struct pipeline_t {
+  config_t config;
+  std::string capture_target;
+
+  std::shared_ptr<platf::display_t> disp;
+  std::shared_ptr<img_pool_t> imgs;
+
+  std::unique_ptr<encoder_t> encoder;
+
+  int alloc_imgs() {
+    // Images still held by the converter keep the previous pool alive until they are released
+    imgs = std::make_shared<img_pool_t>();
+
+    return imgs->alloc(*disp, IMG_POOL_SIZE);
   }
+};
+
+std::mutex warm_pipeline_lock;
+std::unique_ptr<pipeline_t> warm_pipeline;
+std::uint64_t warm_pipeline_id {};
+
+/**
+ * The capture target of the running app, or the global one if the app doesn't have its own
+ */
+std::string capture_target() {
+  auto app_id = proc::proc.running();
+  if(app_id >= 0) {
+    auto &app = proc::proc.get_apps()[app_id];
+
+    if(!app.capture_target.empty()) {
+      return app.capture_target;
+    }
+  }
+
+  return config::video.capture_target;
 }
 
-void capture_display(packet_queue_t packets, idr_event_t idr_events, config_t config) {
+/**
+ * Take the warm pipeline if it's able to serve config
+ */
+std::unique_ptr<pipeline_t> take_warm_pipeline(const config_t &config, const std::string &target) {
+  std::lock_guard lg { warm_pipeline_lock };
+
+  if(!warm_pipeline) {
+    return nullptr;
+  }
+
+  if(warm_pipeline->capture_target != target) {
+    BOOST_LOG(debug) << "Warm pipeline captures a different target"sv;
+    return nullptr;
+  }
+
+  auto &prev = warm_pipeline->config;
+  auto bitrate_mode = [](int bitrate) { return bitrate > 500; };
+
+  if(
+    prev.width != config.width || prev.height != config.height || prev.framerate != config.framerate ||
+    prev.slicesPerFrame != config.slicesPerFrame || prev.numRefFrames != config.numRefFrames ||
+    prev.encoderCscMode != config.encoderCscMode || prev.videoFormat != config.videoFormat ||
+    prev.dynamicRange != config.dynamicRange || bitrate_mode(prev.bitrate) != bitrate_mode(config.bitrate)) {
+
+    BOOST_LOG(debug) << "Warm pipeline doesn't match the requested stream"sv;
+    return nullptr;
+  }
+
+  // The adaptive bitrate may have changed the bitrate during the previous session
+  if(bitrate_mode(config.bitrate) && warm_pipeline->encoder->set_bitrate(config.bitrate) && prev.bitrate != config.bitrate) {
+    BOOST_LOG(debug) << "Warm pipeline can't change its bitrate"sv;
+    return nullptr;
+  }
+
+  BOOST_LOG(info) << "Reusing warm pipeline"sv;
+  return std::move(warm_pipeline);
+}
+
+/**
+ * Keep pipeline warm for WARM_PIPELINE_TIMEOUT
+ */
+void park_pipeline(std::unique_ptr<pipeline_t> &&pipeline) {
+  std::lock_guard lg { warm_pipeline_lock };
+
+  warm_pipeline = std::move(pipeline);
+  auto id = ++warm_pipeline_id;
+
+  task_pool.pushDelayed([id]() {
+    std::lock_guard lg { warm_pipeline_lock };
+
+    // Another session may have taken and parked a pipeline in the meantime
+    if(warm_pipeline_id == id && warm_pipeline) {
+      BOOST_LOG(debug) << "Closing warm pipeline"sv;
+      warm_pipeline.reset();
+    }
+  }, WARM_PIPELINE_TIMEOUT);
+}
+
+void release_warm_pipeline() {
+  std::lock_guard lg { warm_pipeline_lock };
+
+  warm_pipeline.reset();
+}
+
+std::unique_ptr<pipeline_t> make_pipeline(const config_t &config, const std::string &target) {
+  auto pipeline = std::make_unique<pipeline_t>();
+
+  pipeline->config = config;
+  pipeline->capture_target = target;
+
+  pipeline->disp = platf::display(target);
+  if(!pipeline->disp || pipeline->alloc_imgs()) {
+    return nullptr;
+  }
+
+  pipeline->encoder = make_encoder(config);
+  if(!pipeline->encoder) {
+    return nullptr;
+  }
+
+  return pipeline;
+}
+
+void capture_display(packet_queue_t packets, idr_event_t idr_events, bitrate_event_t bitrate_events, config_t config) {
   display_cursor = true;
 
   int framerate = config.framerate;
 
-  auto disp = platf::display();
-  if(!disp) {
+  auto target = capture_target();
+
+  // Restored once the session has ended, the display of a warm pipeline follows the change
+  std::unique_ptr<platf::display_mode_t> display_mode;
+  if(config::video.client_mode) {
+    display_mode = platf::display_mode(target, config.width, config.height, config.framerate);
+  }
+
+  auto pipeline = take_warm_pipeline(config, target);
+  if(!pipeline) {
+    pipeline = make_pipeline(config, target);
+  }
+
+  if(!pipeline) {
     packets->stop();
     return;
   }
 
+  pipeline->config = config;
+
+  auto &disp = pipeline->disp;
+
   img_event_t images {new img_event_t::element_type };
-  std::thread encoderThread { &encodeThread, images, packets, idr_events, config };
+  auto input = std::make_shared<input_t>();
+
+  std::thread converterThread { &convertThread, images, input, config };
+  std::thread encoderThread { &encodeThread, input, packets, bitrate_events, std::ref(*pipeline->encoder), config };
+  std::thread idrForwardThread { &idrThread, idr_events, input };
 
   auto time_span = std::chrono::floor<std::chrono::nanoseconds>(1s) / framerate;
+  pacer_t pacer { time_span, std::chrono::microseconds { config::video.pacing_spin } };
+
+  std::shared_ptr<platf::img_t> last_img;
+  auto last_raised = std::chrono::steady_clock::now();
   while(packets->running()) {
-    auto next_snapshot = std::chrono::steady_clock::now() + time_span;
+    pacer.wait();
+    auto captured = std::chrono::steady_clock::now();
+
+    auto img = pipeline->imgs->pop();
+    if(!img) {
+      // The converter is lagging behind, every image is still in use
+      continue;
+    }
 
-    auto img = disp->alloc_img();
+    TRACE_BEGIN(img.get(), snapshot);
     auto status = disp->snapshot(img.get(), display_cursor);
+    TRACE_END(img.get(), snapshot);
 
     switch(status) {
       case platf::capture_e::reinit: {
+        img.reset();
+        last_img.reset();
+
         // We try this twice, in case we still get an error on reinitialization
         for(int x = 0; x < 2; ++x) {
           disp.reset();
-          disp = platf::display();
+          disp = platf::display(target);
 
-          if (disp) {
+          if (disp && !pipeline->alloc_imgs()) {
             break;
           }
 
+          disp.reset();
           std::this_thread::sleep_for(200ms);
         }
 
         if (!disp) {
           packets->stop();
         }
+
+        pacer.reset();
         continue;
       }
-      case platf::capture_e::timeout:
-        std::this_thread::sleep_until(next_snapshot);
+      case platf::capture_e::timeout: {
+        // The screen didn't change, the latest image is repeated to keep the stream alive
+        auto now = std::chrono::steady_clock::now();
+        if(last_img && now - last_raised >= IDLE_KEEPALIVE) {
+          images->raise(snapshot_t { last_img, now });
+          last_raised = now;
+        }
         continue;
+      }
       case platf::capture_e::error:
+        disp.reset();
         packets->stop();
         continue;
       // Prevent warning during compilation
@@ -307,11 +1045,24 @@ void capture_display(packet_queue_t packets, idr_event_t idr_events, config_t co
         break;
     }
 
-    images->raise(std::move(img));
-    std::this_thread::sleep_until(next_snapshot);
+    last_img = std::move(img);
+    last_raised = std::chrono::steady_clock::now();
+
+    images->raise(snapshot_t { last_img, captured });
   }
 
+  pacer.log_stats();
+
+  last_img.reset();
+
   images->stop();
+  idr_events->stop();
+  converterThread.join();
   encoderThread.join();
+  idrForwardThread.join();
+
+  if(disp) {
+    park_pipeline(std::move(pipeline));
+  }
 }
 }
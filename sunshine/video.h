@@ -5,15 +5,65 @@
 #ifndef SUNSHINE_VIDEO_H
 #define SUNSHINE_VIDEO_H
 
+#include <chrono>
+#include <string_view>
+
 #include "thread_safe.h"
 
 struct AVPacket;
 namespace video {
 void free_packet(AVPacket *packet);
 
-using packet_t       = util::safe_ptr<AVPacket, free_packet>;
+using av_packet_t    = util::safe_ptr<AVPacket, free_packet>;
+
+// Moonlight accepts a frame split in at most 4 FEC blocks
+constexpr auto MAX_FEC_BLOCKS = 4;
+
+/*
+ * Encoded video: either a whole frame, or block_index out of the block_count blocks of a frame.
+ * Every block gets its own FEC shards, which allows sending the first slices of a frame
+ * while the encoder is still working on the rest of it.
+ * A whole frame too large for a single FEC block is split in several blocks when it's sent.
+ */
+struct packet_raw_t {
+  explicit packet_raw_t(AVPacket *av_packet) : av_packet { av_packet } {}
+
+  av_packet_t av_packet;
+
+  int block_index {};
+  int block_count { 1 };
+
+  // When the frame was captured, frames are dropped instead of being sent too late
+  std::chrono::steady_clock::time_point captured;
+
+  // False if no other frame references this frame, such frames are dropped first when the queue is full
+  bool reference { true };
+
+  // True if this frame answers a request for an IDR frame, it doesn't reference any of the lost frames
+  bool recovery {};
+};
+
+using packet_t       = std::unique_ptr<packet_raw_t>;
 using packet_queue_t = std::shared_ptr<safe::queue_t<packet_t>>;
 using idr_event_t    = std::shared_ptr<safe::event_t<std::pair<int64_t, int64_t>>>;
+using bitrate_event_t = std::shared_ptr<safe::event_t<int>>;
+
+/**
+ * The packets a full queue drops first under queue_policy, nullptr if the encoder has to wait for room instead
+ * Packets of frames other frames refer to are only dropped by drop_non_reference when there is nothing else to drop,
+ * libx264 makes every P-frame a reference frame, so it drops the oldest packet just like drop_oldest
+ */
+inline packet_queue_t::element_type::droppable_t droppable(const std::string_view &queue_policy) {
+  if(queue_policy == "drop_non_reference") {
+    return [](const packet_t &packet) { return !packet->reference; };
+  }
+
+  if(queue_policy == "drop_oldest") {
+    return [](const packet_t &) { return true; };
+  }
+
+  return nullptr;
+}
 
 struct config_t {
   int width;
@@ -27,7 +77,10 @@ struct config_t {
   int dynamicRange;
 };
 
-void capture_display(packet_queue_t packets, idr_event_t idr_events, config_t config);
+void capture_display(packet_queue_t packets, idr_event_t idr_events, bitrate_event_t bitrate_events, config_t config);
+
+// Close the pipeline kept open after the previous session
+void release_warm_pipeline();
 }
 
 #endif //SUNSHINE_VIDEO_H
@@ -0,0 +1,110 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+#include "sunshine/convert.h"
+
+using namespace std::literals;
+
+constexpr auto FRAMES = 60;
+
+constexpr std::pair<int, int> SIZES[] { { 1920, 1080 }, { 3840, 2160 } };
+
+constexpr std::string_view KERNELS[] { "c"sv, "sse4.1"sv, "avx2"sv, "avx512"sv };
+
+struct yuv_t {
+  yuv_t(int width, int height, int bit_depth) {
+    auto bytes = bit_depth == 8 ? 1 : 2;
+
+    linesize[0] = width * bytes;
+    linesize[1] = linesize[2] = (width + 1) / 2 * bytes;
+
+    for(int x = 0; x < 3; ++x) {
+      planes[x].resize(linesize[x] * (x ? (height + 1) / 2 : height));
+      data[x] = planes[x].data();
+    }
+  }
+
+  std::vector<std::uint8_t> planes[3];
+  std::uint8_t *data[3];
+  int linesize[3];
+};
+
+/**
+ * Print the time per frame of convert and the throughput
+ */
+template<class F>
+void bench(std::string_view name, int width, int height, F &&convert) {
+  // Warm up the caches and the branch predictors
+  convert();
+
+  auto begin = std::chrono::steady_clock::now();
+  for(int x = 0; x < FRAMES; ++x) {
+    convert();
+  }
+  auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin) / FRAMES;
+
+  std::cout << "  "sv << std::left << std::setw(8) << name << std::right << std::fixed << std::setprecision(2)
+            << std::setw(8) << elapsed.count() << " ms/frame "sv
+            << std::setw(8) << width * height / elapsed.count() / 1000.0 << " Mpixel/s"sv << std::endl;
+}
+
+int main() {
+  std::mt19937 rng { 20201017 };
+
+  for(auto [width, height] : SIZES) {
+    std::vector<std::uint8_t> img(width * height * 4);
+    for(auto &byte : img) {
+      byte = (std::uint8_t)rng();
+    }
+
+    for(auto bit_depth : { 8, 10 }) {
+      std::cout << width << 'x' << height << ' ' << bit_depth << " bit, Rec. 709 limited range:"sv << std::endl;
+
+      yuv_t out { width, height, bit_depth };
+
+      convert::yuv420_t yuv { 2, bit_depth };
+      for(auto kernel : KERNELS) {
+        if(yuv.use_kernel(kernel)) {
+          continue;
+        }
+
+        bench(kernel, width, height, [&]() {
+          yuv(img.data(), width * 4, width, height, out.data, out.linesize, 0, height);
+        });
+      }
+
+      // The conversion encodeThread used before the SIMD converter
+      auto sws = sws_getContext(
+        width, height, AV_PIX_FMT_BGR0,
+        width, height, bit_depth == 8 ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_YUV420P10,
+        SWS_LANCZOS | SWS_ACCURATE_RND, nullptr, nullptr, nullptr);
+
+      sws_setColorspaceDetails(sws, sws_getCoefficients(SWS_CS_DEFAULT), 0,
+                               sws_getCoefficients(SWS_CS_ITU709), 0,
+                               0, 1 << 16, 1 << 16);
+
+      const std::uint8_t *src[] { img.data() };
+      int src_linesize[] { width * 4 };
+      bench("swscale"sv, width, height, [&]() {
+        sws_scale(sws, src, src_linesize, 0, height, out.data, out.linesize);
+      });
+
+      sws_freeContext(sws);
+    }
+  }
+
+  return 0;
+}
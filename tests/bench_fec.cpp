@@ -0,0 +1,110 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include <rs.h>
+}
+
+#include "sunshine/fec.h"
+
+using namespace std::literals;
+using rs_t = util::safe_ptr<reed_solomon, reed_solomon_release>;
+
+// Data shards of small, medium and large frames, and of the largest block
+constexpr int DATA_SHARDS[] { 16, 64, 128, 212 };
+
+// packetsize + MAX_RTP_HEADER_SIZE for the packet sizes Moonlight uses
+constexpr int BLOCK_SIZES[] { 1024 + 16, 1292 + 16, 1392 + 16 };
+
+constexpr auto PERCENTAGE = 20;
+
+constexpr std::string_view KERNELS[] { "c"sv, "ssse3"sv, "avx2"sv };
+
+/**
+ * Microseconds per call of encode, repeated until at least 100ms have passed
+ */
+template<class F>
+double bench(F &&encode) {
+  // Warm up the caches and the codec cache
+  encode();
+
+  int iterations = 0;
+  auto begin = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::micro> elapsed;
+  do {
+    encode();
+    ++iterations;
+
+    elapsed = std::chrono::steady_clock::now() - begin;
+  } while(elapsed < 100ms);
+
+  return elapsed.count() / iterations;
+}
+
+void print(std::string_view name, double us, int data_bytes) {
+  std::cout << "  "sv << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(1)
+            << std::setw(9) << us << " us "sv
+            << std::setw(8) << data_bytes / us << " MB/s"sv << std::endl;
+}
+
+int main() {
+  reed_solomon_init();
+
+  std::mt19937 rng { 20201017 };
+
+  for(auto blocksize : BLOCK_SIZES) {
+    for(auto data_shards : DATA_SHARDS) {
+      auto parity_shards = (data_shards * PERCENTAGE + 99) / 100;
+      auto nr_shards = data_shards + parity_shards;
+      auto data_bytes = data_shards * blocksize;
+
+      std::cout << data_shards << '+' << parity_shards << " shards of "sv << blocksize << " bytes:"sv << std::endl;
+
+      fec::fec_t fec {};
+      fec.data_shards = data_shards;
+      fec.nr_shards = nr_shards;
+      fec.blocksize = blocksize;
+      fec.shards = util::buffer_t<char> { (std::size_t)nr_shards * blocksize };
+
+      for(int x = 0; x < data_bytes; ++x) {
+        fec.shards[x] = (char)rng();
+      }
+
+      std::vector<unsigned char*> shards(nr_shards);
+      for(int x = 0; x < nr_shards; ++x) {
+        shards[x] = (unsigned char*)&fec.shards[x * blocksize];
+      }
+
+      // What every block cost before the codecs were cached
+      print("reed_solomon_new"sv, bench([&]() {
+        rs_t rs { reed_solomon_new(data_shards, parity_shards) };
+        reed_solomon_encode(rs.get(), shards.data(), nr_shards, blocksize);
+      }), data_bytes);
+
+      rs_t rs { reed_solomon_new(data_shards, parity_shards) };
+      print("reed_solomon_encode"sv, bench([&]() {
+        reed_solomon_encode(rs.get(), shards.data(), nr_shards, blocksize);
+      }), data_bytes);
+
+      for(auto kernel : KERNELS) {
+        if(fec::use_kernel(kernel)) {
+          continue;
+        }
+
+        print(kernel, bench([&]() {
+          fec::encode(fec);
+        }), data_bytes);
+      }
+    }
+  }
+
+  return 0;
+}
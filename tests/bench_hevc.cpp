@@ -0,0 +1,201 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "sunshine/utility.h"
+
+using namespace std::literals;
+
+namespace video {
+void free_ctx(AVCodecContext *ctx) {
+  avcodec_free_context(&ctx);
+}
+
+void free_frame(AVFrame *frame) {
+  av_frame_free(&frame);
+}
+
+void free_packet(AVPacket *packet) {
+  av_packet_free(&packet);
+}
+
+using ctx_t    = util::safe_ptr<AVCodecContext, free_ctx>;
+using frame_t  = util::safe_ptr<AVFrame, free_frame>;
+using packet_t = util::safe_ptr<AVPacket, free_packet>;
+}
+
+constexpr auto WIDTH = 1920;
+constexpr auto HEIGHT = 1080;
+constexpr auto FRAMERATE = 60;
+constexpr auto BITRATE = 20000;
+
+// The defaults of min_threads and preset
+constexpr auto SLICES = 2;
+constexpr auto PRESET = "superfast";
+
+constexpr auto FRAMES = 120;
+
+/**
+ * Open libx265 the way avcodec_encoder() does for an HEVC stream with threads in its pool
+ * returns nullptr if libx265 isn't available
+ */
+video::ctx_t open_encoder(int threads) {
+  auto codec = avcodec_find_encoder_by_name("libx265");
+  if(!codec) {
+    return nullptr;
+  }
+
+  video::ctx_t ctx { avcodec_alloc_context3(codec) };
+  ctx->width = WIDTH;
+  ctx->height = HEIGHT;
+  ctx->time_base = AVRational { 1, FRAMERATE };
+  ctx->framerate = AVRational { FRAMERATE, 1 };
+  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  ctx->max_b_frames = 0;
+  ctx->gop_size = std::numeric_limits<int>::max();
+  ctx->keyint_min = ctx->gop_size;
+  ctx->refs = 1;
+  ctx->slices = SLICES;
+  ctx->thread_type = FF_THREAD_SLICE;
+  ctx->thread_count = ctx->slices;
+
+  auto bitrate = BITRATE * 1000;
+  ctx->rc_max_rate = bitrate;
+  ctx->rc_buffer_size = bitrate / 100;
+  ctx->bit_rate = bitrate;
+  ctx->rc_min_rate = bitrate;
+
+  ctx->flags |= (AV_CODEC_FLAG_CLOSED_GOP | AV_CODEC_FLAG_LOW_DELAY);
+  ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+
+  std::stringstream x265_params;
+  x265_params << "info=0:keyint=-1:log-level=error"sv;
+  x265_params << ":frame-threads=1:wpp=1:pools="sv << threads << ":slices="sv << ctx->slices;
+  if(threads > 8) {
+    x265_params << ":pmode=1:pme=1"sv;
+  }
+
+  AVDictionary *options {nullptr};
+  av_dict_set(&options, "preset", PRESET, 0);
+  av_dict_set(&options, "tune", "zerolatency", 0);
+  av_dict_set(&options, "x265-params", x265_params.str().c_str(), 0);
+
+  auto status = avcodec_open2(ctx.get(), codec, &options);
+  av_dict_free(&options);
+
+  if(status < 0) {
+    return nullptr;
+  }
+
+  return ctx;
+}
+
+/**
+ * A scrolling pattern with some texture, so every frame has motion to search for
+ */
+void fill(AVFrame *frame, int index) {
+  for(int y = 0; y < frame->height; ++y) {
+    auto row = frame->data[0] + y * frame->linesize[0];
+    for(int x = 0; x < frame->width; ++x) {
+      auto u = x + index * 4;
+      auto v = y + index * 2;
+      row[x] = (std::uint8_t)(((u ^ v) & 0x3F) + ((u * 7 + v * 13) % 97) + 32);
+    }
+  }
+
+  for(int plane = 1; plane < 3; ++plane) {
+    for(int y = 0; y < frame->height / 2; ++y) {
+      auto row = frame->data[plane] + y * frame->linesize[plane];
+      for(int x = 0; x < frame->width / 2; ++x) {
+        row[x] = (std::uint8_t)(128 + ((x + y + index * plane) & 0x1F) - 16);
+      }
+    }
+  }
+}
+
+int main() {
+  video::frame_t frame { av_frame_alloc() };
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width = WIDTH;
+  frame->height = HEIGHT;
+  av_frame_get_buffer(frame.get(), 0);
+
+  video::packet_t packet { av_packet_alloc() };
+
+  auto cores = (int)std::max(1u, std::thread::hardware_concurrency());
+
+  std::vector<int> pool_sizes;
+  for(int threads = 1; threads < cores; threads *= 2) {
+    pool_sizes.emplace_back(threads);
+  }
+  pool_sizes.emplace_back(cores);
+
+  auto budget = std::chrono::duration<double, std::milli>(1s) / FRAMERATE;
+  std::cout << WIDTH << 'x' << HEIGHT << " at "sv << BITRATE << " kbps, "sv << SLICES << " slices, preset "sv << PRESET
+            << ", frame budget "sv << std::fixed << std::setprecision(1) << budget.count() << " ms"sv << std::endl;
+
+  double single_thread {};
+  for(auto threads : pool_sizes) {
+    auto ctx = open_encoder(threads);
+    if(!ctx) {
+      std::cerr << "Couldn't open libx265"sv << std::endl;
+      return 1;
+    }
+
+    std::chrono::duration<double, std::milli> total {};
+    std::chrono::duration<double, std::milli> max {};
+    int over_budget = 0;
+    for(int x = 0; x < FRAMES; ++x) {
+      fill(frame.get(), x);
+      frame->pts = x;
+
+      auto begin = std::chrono::steady_clock::now();
+      if(avcodec_send_frame(ctx.get(), frame.get()) < 0) {
+        std::cerr << "Couldn't encode frame ["sv << x << ']' << std::endl;
+        return 1;
+      }
+
+      while(avcodec_receive_packet(ctx.get(), packet.get()) == 0) {
+        av_packet_unref(packet.get());
+      }
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+
+      // The first frame is an IDR frame and pays for the setup of the pool
+      if(x == 0) {
+        continue;
+      }
+
+      total += elapsed;
+      max = std::max(max, elapsed);
+      over_budget += elapsed > budget;
+    }
+
+    auto average = total.count() / (FRAMES - 1);
+    if(threads == 1) {
+      single_thread = average;
+    }
+
+    std::cout << "  pools="sv << std::left << std::setw(3) << threads << std::right
+              << std::setw(7) << average << " ms average "sv
+              << std::setw(7) << max.count() << " ms max "sv
+              << std::setw(7) << 1000 / average << " fps "sv
+              << std::setw(5) << std::setprecision(2) << single_thread / average << "x "sv
+              << std::setprecision(1) << over_budget << " frames over budget"sv << std::endl;
+  }
+
+  return 0;
+}
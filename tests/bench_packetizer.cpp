@@ -0,0 +1,174 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "sunshine/packetizer.h"
+
+using namespace std::literals;
+
+namespace video {
+// The deleter of video.cpp, the packets are allocated by libavcodec here as well
+void free_packet(AVPacket *packet) {
+  av_packet_free(&packet);
+}
+}
+
+// The packet size Moonlight requests by default
+constexpr auto PACKETSIZE = 1024;
+constexpr auto PERCENTAGE = 20;
+
+constexpr auto BLOCKSIZE = PACKETSIZE + MAX_RTP_HEADER_SIZE;
+constexpr auto PAYLOAD_BLOCKSIZE = BLOCKSIZE - sizeof(stream::video_packet_raw_t);
+
+struct frame_t {
+  std::string_view name;
+  int size;
+  bool key;
+};
+
+// Frames that fit in a single FEC block, the path before the packetizer couldn't send larger ones
+constexpr frame_t FRAMES[] {
+  { "P-frame 8KB"sv, 8 * 1024, false },
+  { "P-frame 32KB"sv, 32 * 1024, false },
+  { "P-frame 128KB"sv, 128 * 1024, false },
+  { "IDR frame 200KB"sv, 200 * 1024, true }
+};
+
+/*
+ * The copies videoThread made before the packetizer, parity excluded:
+ * prepend the NV header, widen the IDR start code, interleave the shard headers and copy into the FEC shards
+ * returns the number of bytes copied
+ */
+std::size_t packetize_old(const AVPacket &packet, std::vector<std::uint8_t> &shards) {
+  std::size_t copied = 0;
+
+  std::string_view payload { (char*)packet.data, (std::size_t)packet.size };
+  std::vector<std::uint8_t> payload_new;
+
+  auto nv_packet_header = "\0017charss"sv;
+  std::copy(std::begin(nv_packet_header), std::end(nv_packet_header), std::back_inserter(payload_new));
+  std::copy(std::begin(payload), std::end(payload), std::back_inserter(payload_new));
+  copied += payload_new.size();
+
+  payload = { (char*)payload_new.data(), payload_new.size() };
+
+  if(packet.flags & AV_PKT_FLAG_KEY) {
+    auto i_frame_old = "\000\000\001e"sv;
+    auto i_frame = "\000\000\000\001e"sv;
+
+    std::vector<std::uint8_t> replaced;
+    auto next = std::search(std::begin(payload), std::end(payload), std::begin(i_frame_old), std::end(i_frame_old));
+    std::copy(std::begin(payload), next, std::back_inserter(replaced));
+    std::copy(std::begin(i_frame), std::end(i_frame), std::back_inserter(replaced));
+    std::copy(next + i_frame_old.size(), std::end(payload), std::back_inserter(replaced));
+    copied += replaced.size();
+
+    payload_new = std::move(replaced);
+    payload = { (char*)payload_new.data(), payload_new.size() };
+  }
+
+  auto elements = payload.size() / PAYLOAD_BLOCKSIZE + (payload.size() % PAYLOAD_BLOCKSIZE != 0);
+
+  std::vector<std::uint8_t> inserted(elements * sizeof(stream::video_packet_raw_t) + payload.size());
+  for(std::size_t x = 0; x < elements; ++x) {
+    auto p = &inserted[x * BLOCKSIZE];
+
+    stream::video_packet_raw_t header {};
+    header.packet.flags = FLAG_CONTAINS_PIC_DATA;
+    header.packet.fecInfo = x << 12 | elements << 22 | PERCENTAGE << 4;
+    std::memcpy(p, &header, sizeof(header));
+
+    auto begin = x * PAYLOAD_BLOCKSIZE;
+    auto bytes = std::min(PAYLOAD_BLOCKSIZE, payload.size() - begin);
+    std::copy_n(std::begin(payload) + begin, bytes, p + sizeof(header));
+  }
+  copied += inserted.size();
+
+  auto data_shards = inserted.size() / BLOCKSIZE + (inserted.size() % BLOCKSIZE != 0);
+  auto nr_shards = data_shards + (data_shards * PERCENTAGE + 99) / 100;
+
+  shards.resize(nr_shards * BLOCKSIZE);
+  auto next = std::copy(std::begin(inserted), std::end(inserted), std::begin(shards));
+  std::fill(next, std::begin(shards) + data_shards * BLOCKSIZE, 0);
+  copied += data_shards * BLOCKSIZE;
+
+  return copied;
+}
+
+/**
+ * Microseconds per call of packetize, repeated until at least 100ms have passed
+ */
+template<class F>
+double bench(F &&packetize) {
+  packetize();
+
+  int iterations = 0;
+  auto begin = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::micro> elapsed;
+  do {
+    packetize();
+    ++iterations;
+
+    elapsed = std::chrono::steady_clock::now() - begin;
+  } while(elapsed < 100ms);
+
+  return elapsed.count() / iterations;
+}
+
+int main() {
+  std::mt19937 rng { 20201017 };
+
+  stream::packetizer_t packetizer { PACKETSIZE, PERCENTAGE, 0 };
+  std::vector<std::uint8_t> shards;
+
+  std::cout << std::fixed << std::setprecision(1);
+  for(auto &frame : FRAMES) {
+    auto av_packet = av_packet_alloc();
+    av_new_packet(av_packet, frame.size);
+
+    // Without start codes in the bitstream, only the one of the IDR slice is found
+    std::generate_n(av_packet->data, frame.size, [&rng]() { return (std::uint8_t)(rng() % 254 + 2); });
+    if(frame.key) {
+      std::memcpy(av_packet->data + 64, "\000\000\001e", 4);
+      av_packet->flags |= AV_PKT_FLAG_KEY;
+    }
+
+    video::packet_raw_t packet { av_packet };
+
+    auto copied_old = packetize_old(*av_packet, shards);
+    auto us_old = bench([&]() {
+      packetize_old(*av_packet, shards);
+    });
+
+    // The packetizer writes every byte of the data shards exactly once: header, payload and padding
+    std::size_t copied_new = 0;
+    auto blocks = packetizer.packetize(packet, 0);
+    for(int block = 0; block < blocks; ++block) {
+      copied_new += packetizer[block].data_shards * packetizer[block].blocksize;
+    }
+
+    auto us_new = bench([&]() {
+      packetizer.packetize(packet, 0);
+    });
+
+    std::cout << frame.name << ':' << std::endl
+              << "  before "sv << std::setw(8) << copied_old << " bytes copied "sv << std::setw(7) << us_old << " us"sv << std::endl
+              << "  after  "sv << std::setw(8) << copied_new << " bytes copied "sv << std::setw(7) << us_new << " us"sv << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,131 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "sunshine/platform/common.h"
+
+using namespace std::literals;
+
+// packetsize + MAX_RTP_HEADER_SIZE for the packet size Moonlight requests by default
+constexpr auto BLOCKSIZE = 1024 + 16;
+
+// The shards of a small frame, of a large one and of the largest FEC block
+constexpr int SHARDS[] { 12, 77, 255 };
+
+constexpr std::string_view BACKENDS[] { "gso"sv, "sendmmsg"sv, "sendto"sv };
+
+constexpr auto DURATION = 1s;
+
+std::chrono::duration<double> thread_time() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+  return std::chrono::seconds { ts.tv_sec } + std::chrono::nanoseconds { ts.tv_nsec };
+}
+
+/**
+ * Bind a UDP socket to a free port on the loopback interface
+ * returns -1 on failure
+ */
+int bind_loopback(sockaddr_in &addr) {
+  auto fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  socklen_t size = sizeof(addr);
+  if(fd < 0 || bind(fd, (sockaddr*)&addr, size) || getsockname(fd, (sockaddr*)&addr, &size)) {
+    return -1;
+  }
+
+  return fd;
+}
+
+int main() {
+  std::vector<char> shard(BLOCKSIZE, 'x');
+
+  for(auto shards : SHARDS) {
+    std::vector<std::string_view> buffers(shards, std::string_view { shard.data(), shard.size() });
+
+    std::cout << shards << " shards of "sv << BLOCKSIZE << " bytes per send:"sv << std::endl;
+
+    for(auto backend : BACKENDS) {
+      sockaddr_in addr;
+      auto receiver = bind_loopback(addr);
+      auto sender = socket(AF_INET, SOCK_DGRAM, 0);
+      if(receiver < 0 || sender < 0 || connect(sender, (sockaddr*)&addr, sizeof(addr))) {
+        std::cerr << "Couldn't open a socket on the loopback interface"sv << std::endl;
+        return 1;
+      }
+
+      // Wake the receiver up now and then, so it notices the end of the run
+      timeval timeout { 0, 100000 };
+      setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+      std::atomic<bool> running { true };
+      std::int64_t received = 0;
+      std::thread drain { [&]() {
+        std::vector<char> buf(65536);
+        while(running) {
+          if(recv(receiver, buf.data(), buf.size(), 0) > 0) {
+            ++received;
+          }
+        }
+      } };
+
+      auto send_engine = platf::send_engine(sender, backend);
+
+      std::int64_t sent = 0;
+      std::int64_t failed = 0;
+      auto cpu_begin = thread_time();
+      auto begin = std::chrono::steady_clock::now();
+      std::chrono::duration<double> elapsed;
+      do {
+        if(send_engine->send(buffers.data(), buffers.size(), {}) == platf::send_e::ok) {
+          sent += shards;
+        }
+        else {
+          ++failed;
+        }
+
+        elapsed = std::chrono::steady_clock::now() - begin;
+      } while(elapsed < DURATION);
+      auto cpu = thread_time() - cpu_begin;
+
+      // Let the receiver catch up with the datagrams still in flight
+      std::this_thread::sleep_for(200ms);
+      running = false;
+      drain.join();
+
+      close(sender);
+      close(receiver);
+
+      auto gbit = (double)sent * BLOCKSIZE * 8 / 1e9;
+      std::cout << "  "sv << std::left << std::setw(10) << backend << std::right << std::fixed << std::setprecision(0)
+                << std::setw(9) << sent / elapsed.count() << " packets/s "sv
+                << std::setprecision(3) << std::setw(7) << cpu.count() / gbit << " CPU s/Gbit "sv
+                << std::setprecision(1) << std::setw(5) << received * 100.0 / std::max<std::int64_t>(sent, 1) << "% received"sv;
+
+      if(failed) {
+        std::cout << ", "sv << failed << " sends failed"sv;
+      }
+      std::cout << std::endl;
+    }
+  }
+
+  return 0;
+}
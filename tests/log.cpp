@@ -0,0 +1,17 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <boost/log/sources/severity_logger.hpp>
+
+// The loggers of main.cpp, without a sink boost.log writes every record to the console
+namespace bl = boost::log;
+
+bl::sources::severity_logger<int> verbose(0);
+bl::sources::severity_logger<int> debug(1);
+bl::sources::severity_logger<int> info(2);
+bl::sources::severity_logger<int> warning(3);
+bl::sources::severity_logger<int> error(4);
+bl::sources::severity_logger<int> fatal(5);
+
+void log_flush() {}
@@ -0,0 +1,213 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+#include "sunshine/convert.h"
+
+using namespace std::literals;
+
+// Odd sizes and widths around the block sizes of the kernels, so every tail is converted by the C path
+constexpr std::pair<int, int> SIZES[] {
+  { 1, 1 }, { 2, 2 }, { 3, 5 }, { 7, 3 }, { 15, 9 }, { 16, 16 }, { 17, 11 }, { 31, 7 }, { 33, 13 },
+  { 63, 5 }, { 65, 3 }, { 127, 9 }, { 129, 17 }, { 255, 7 }, { 257, 33 }, { 1921, 3 }
+};
+
+constexpr std::string_view KERNELS[] { "sse4.1"sv, "avx2"sv, "avx512"sv };
+
+/*
+ * A converted frame, every plane is padded so that overwriting the end of a row is detected
+ */
+struct yuv_t {
+  yuv_t(int width, int height, int bit_depth) {
+    auto bytes = bit_depth == 8 ? 1 : 2;
+
+    linesize[0] = (width + 16) * bytes;
+    linesize[1] = linesize[2] = ((width + 1) / 2 + 16) * bytes;
+
+    auto chroma_height = (height + 1) / 2;
+    planes[0].resize(linesize[0] * height, 0xCD);
+    planes[1].resize(linesize[1] * chroma_height, 0xCD);
+    planes[2].resize(linesize[2] * chroma_height, 0xCD);
+
+    for(int x = 0; x < 3; ++x) {
+      data[x] = planes[x].data();
+    }
+  }
+
+  // The sample at (x, y) of plane
+  int at(int plane, int x, int y, int bit_depth) const {
+    auto row = data[plane] + y * linesize[plane];
+
+    return bit_depth == 8 ? row[x] : ((const std::uint16_t*)row)[x];
+  }
+
+  std::vector<std::uint8_t> planes[3];
+  std::uint8_t *data[3];
+  int linesize[3];
+};
+
+std::vector<std::uint8_t> noise(int width, int height, std::mt19937 &rng) {
+  std::vector<std::uint8_t> img(width * height * 4);
+  std::generate(std::begin(img), std::end(img), [&rng]() { return (std::uint8_t)rng(); });
+
+  return img;
+}
+
+// Every colour changes by at most one code value per pixel, so the chroma siting of swscale doesn't matter
+std::vector<std::uint8_t> gradient(int width, int height) {
+  std::vector<std::uint8_t> img(width * height * 4);
+
+  auto triangle = [](int t) {
+    t %= 256;
+    return t < 128 ? t * 2 : (255 - t) * 2;
+  };
+
+  for(int y = 0; y < height; ++y) {
+    for(int x = 0; x < width; ++x) {
+      auto px = &img[(y * width + x) * 4];
+
+      px[0] = triangle(x / 2 + 16);
+      px[1] = triangle(y / 2 + 80);
+      px[2] = triangle((x + y) / 4 + 160);
+      px[3] = 0;
+    }
+  }
+
+  return img;
+}
+
+yuv_t convert_yuv(convert::yuv420_t &yuv, const std::vector<std::uint8_t> &img, int width, int height) {
+  yuv_t out { width, height, yuv.bit_depth };
+  yuv(img.data(), width * 4, width, height, out.data, out.linesize, 0, height);
+
+  return out;
+}
+
+int sws_colorspace(int csc_mode) {
+  switch(csc_mode >> 1) {
+    case 1:
+      return SWS_CS_ITU709;
+    case 2:
+      return SWS_CS_BT2020;
+    default:
+      return SWS_CS_SMPTE170M;
+  }
+}
+
+// Converts the way encodeThread did before the SIMD converter, except for the filter which doesn't matter without scaling
+yuv_t convert_sws(const std::vector<std::uint8_t> &img, int width, int height, int csc_mode, int bit_depth) {
+  yuv_t out { width, height, bit_depth };
+
+  auto sws = sws_getContext(
+    width, height, AV_PIX_FMT_BGR0,
+    width, height, bit_depth == 8 ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_YUV420P10,
+    SWS_BILINEAR | SWS_ACCURATE_RND, nullptr, nullptr, nullptr);
+
+  sws_setColorspaceDetails(sws, sws_getCoefficients(SWS_CS_DEFAULT), 0,
+                           sws_getCoefficients(sws_colorspace(csc_mode)), csc_mode & 0x1,
+                           0, 1 << 16, 1 << 16);
+
+  const std::uint8_t *src[] { img.data() };
+  int src_linesize[] { width * 4 };
+  sws_scale(sws, src, src_linesize, 0, height, out.data, out.linesize);
+  sws_freeContext(sws);
+
+  return out;
+}
+
+/**
+ * The largest difference between the samples of a and b
+ * returns -1 if the padding of a row was written to
+ */
+int max_diff(const yuv_t &a, const yuv_t &b, int width, int height, int bit_depth) {
+  int diff = 0;
+
+  for(int plane = 0; plane < 3; ++plane) {
+    auto w = plane ? (width + 1) / 2 : width;
+    auto h = plane ? (height + 1) / 2 : height;
+
+    for(int y = 0; y < h; ++y) {
+      for(int x = 0; x < w; ++x) {
+        diff = std::max(diff, std::abs(a.at(plane, x, y, bit_depth) - b.at(plane, x, y, bit_depth)));
+      }
+
+      auto row = a.data[plane] + y * a.linesize[plane];
+      auto bytes = bit_depth == 8 ? 1 : 2;
+      if(std::any_of(row + w * bytes, row + a.linesize[plane], [](auto byte) { return byte != 0xCD; })) {
+        return -1;
+      }
+    }
+  }
+
+  return diff;
+}
+
+int main() {
+  std::mt19937 rng { 20201017 };
+
+  int failed = 0;
+  auto check = [&failed](bool ok, std::string_view what, int csc_mode, int bit_depth, int width, int height, int diff) {
+    if(!ok) {
+      std::cerr << what << " csc_mode "sv << csc_mode << ", "sv << bit_depth << " bit, "sv << width << 'x' << height
+                << ": difference "sv << diff << std::endl;
+      ++failed;
+    }
+  };
+
+  for(auto bit_depth : { 8, 10 }) {
+    // swscale rounds differently, on a smooth image both should be within a few code values of each other
+    auto tolerance = bit_depth == 8 ? 3 : 12;
+
+    for(int csc_mode = 0; csc_mode < 6; ++csc_mode) {
+      convert::yuv420_t yuv { csc_mode, bit_depth };
+
+      for(auto [width, height] : SIZES) {
+        auto img = noise(width, height, rng);
+
+        yuv.use_kernel("c"sv);
+        auto expected = convert_yuv(yuv, img, width, height);
+
+        // Every kernel has to produce the same output as the C path
+        for(auto kernel : KERNELS) {
+          if(yuv.use_kernel(kernel)) {
+            continue;
+          }
+
+          auto diff = max_diff(convert_yuv(yuv, img, width, height), expected, width, height, bit_depth);
+          check(diff == 0, kernel, csc_mode, bit_depth, width, height, diff);
+        }
+
+        // Chroma subsampling needs at least 2x2 pixels to compare with swscale
+        if(width < 2 || height < 2) {
+          continue;
+        }
+
+        img = gradient(width, height);
+
+        yuv.use_kernel("c"sv);
+        auto diff = max_diff(convert_yuv(yuv, img, width, height), convert_sws(img, width, height, csc_mode, bit_depth), width, height, bit_depth);
+        check(diff >= 0 && diff <= tolerance, "swscale"sv, csc_mode, bit_depth, width, height, diff);
+      }
+    }
+  }
+
+  if(failed) {
+    std::cerr << failed << " conversions failed"sv << std::endl;
+    return 1;
+  }
+
+  std::cout << "All conversions match"sv << std::endl;
+  return 0;
+}
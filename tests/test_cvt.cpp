@@ -0,0 +1,85 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <cmath>
+#include <iostream>
+#include <string_view>
+
+#include "sunshine/platform/cvt.h"
+
+using namespace std::literals;
+
+int failed = 0;
+
+void expect(bool condition, std::string_view what) {
+  if(!condition) {
+    std::cerr << "Failed: "sv << what << std::endl;
+    ++failed;
+  }
+}
+
+bool operator==(const platf::mode_timings_t &a, const platf::mode_timings_t &b) {
+  return
+    a.width == b.width && a.hsync_start == b.hsync_start && a.hsync_end == b.hsync_end && a.htotal == b.htotal &&
+    a.height == b.height && a.vsync_start == b.vsync_start && a.vsync_end == b.vsync_end && a.vtotal == b.vtotal &&
+    a.dot_clock == b.dot_clock;
+}
+
+struct reference_t {
+  int refresh;
+  platf::mode_timings_t timings;
+};
+
+// The modelines printed by "cvt -r <width> <height> 60"
+constexpr reference_t REFERENCES[] {
+  { 60, { 1024, 1072, 1104, 1184, 768, 771, 775, 790, 56000000 } },
+  { 60, { 1280, 1328, 1360, 1440, 720, 723, 728, 741, 64000000 } },
+  { 60, { 1920, 1968, 2000, 2080, 1080, 1083, 1088, 1111, 138500000 } },
+  { 60, { 1920, 1968, 2000, 2080, 1200, 1203, 1209, 1235, 154000000 } },
+  { 60, { 2560, 2608, 2640, 2720, 1440, 1443, 1448, 1481, 241500000 } },
+};
+
+int main() {
+  expect(platf::cvt_v_sync(1024, 768) == 4, "the vertical sync of 4:3 is 4 lines"sv);
+  expect(platf::cvt_v_sync(1920, 1080) == 5, "the vertical sync of 16:9 is 5 lines"sv);
+  expect(platf::cvt_v_sync(1920, 1200) == 6, "the vertical sync of 16:10 is 6 lines"sv);
+  expect(platf::cvt_v_sync(1280, 1024) == 7, "the vertical sync of 5:4 is 7 lines"sv);
+  expect(platf::cvt_v_sync(2560, 1080) == 10, "the vertical sync of any other aspect ratio is 10 lines"sv);
+
+  for(auto &reference : REFERENCES) {
+    auto &timings = reference.timings;
+    auto mode = platf::cvt_mode(timings.width, timings.height, reference.refresh);
+
+    if(!(mode == timings)) {
+      std::cerr << timings.width << 'x' << timings.height << ": "sv << mode.dot_clock << ' '
+                << mode.hsync_start << ' ' << mode.hsync_end << ' ' << mode.htotal << ' '
+                << mode.vsync_start << ' ' << mode.vsync_end << ' ' << mode.vtotal << std::endl;
+    }
+    expect(mode == timings, "the timings match the modeline of cvt -r"sv);
+  }
+
+  // A created mode has to be found again by the refresh rate on the next session
+  for(auto refresh : { 30, 60, 90, 120, 144 }) {
+    for(auto &reference : REFERENCES) {
+      auto mode = platf::cvt_mode(reference.timings.width, reference.timings.height, refresh);
+      auto rate = platf::refresh_rate(mode.dot_clock, mode.htotal, mode.vtotal);
+
+      expect(std::abs(rate - refresh) <= 0.5, "the refresh rate of a mode is within 0.5Hz of the framerate"sv);
+    }
+
+    auto mode = platf::cvt_mode(3840, 2160, refresh);
+    auto rate = platf::refresh_rate(mode.dot_clock, mode.htotal, mode.vtotal);
+    expect(std::abs(rate - refresh) <= 0.5, "the dot clock of a 4K mode doesn't overflow"sv);
+  }
+
+  expect(platf::refresh_rate(138500000, 0, 0) == 0, "a mode without timings has no refresh rate"sv);
+
+  if(failed) {
+    std::cerr << failed << " checks failed"sv << std::endl;
+    return 1;
+  }
+
+  std::cout << "All checks passed"sv << std::endl;
+  return 0;
+}
@@ -0,0 +1,136 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+#include "sunshine/platform/damage.h"
+
+using namespace std::literals;
+
+using platf::damage_t;
+using rows_t = std::vector<damage_t::rows_t>;
+
+int failed = 0;
+
+void expect(bool condition, std::string_view what) {
+  if(!condition) {
+    std::cerr << "Failed: "sv << what << std::endl;
+    ++failed;
+  }
+}
+
+// 7 bands, the last one holds only 4 rows
+constexpr auto HEIGHT = 100;
+constexpr auto WIDTH = 200;
+
+constexpr platf::rect_t AREA { 10, 20, WIDTH, HEIGHT };
+
+std::vector<std::uint8_t> bands(std::initializer_list<int> damaged) {
+  std::vector<std::uint8_t> result(damage_t::band_count(HEIGHT));
+  for(auto band : damaged) {
+    result[band] = 1;
+  }
+
+  return result;
+}
+
+/**
+ * Push a generation damaging bands, without any rectangle
+ */
+bool push(damage_t &damage, std::initializer_list<int> damaged, bool cursor_changed = false) {
+  return damage.push(bands(damaged), {}, cursor_changed);
+}
+
+int main() {
+  expect(damage_t::band_count(HEIGHT) == 7, "a partial band at the bottom is a band too"sv);
+  expect(damage_t::band_count(96) == 6, "bands divide the height"sv);
+
+  {
+    auto damaged = bands({});
+    std::vector<platf::rect_t> rects;
+
+    expect(damage_t::add(AREA, { AREA.x + 5, AREA.y + 17, 10, 20 }, damaged, rects), "a rectangle within the area is damage"sv);
+    expect(damaged == bands({ 1, 2 }), "a rectangle damages every band it touches"sv);
+    expect(rects.size() == 1 && rects[0].x == 5 && rects[0].y == 17, "rectangles are relative to the area"sv);
+
+    expect(!damage_t::add(AREA, { AREA.x + WIDTH, AREA.y, 10, 10 }, damaged, rects), "a rectangle right of the area is ignored"sv);
+    expect(!damage_t::add(AREA, { AREA.x, AREA.y - 10, 10, 10 }, damaged, rects), "a rectangle above the area is ignored"sv);
+    expect(rects.size() == 1 && damaged == bands({ 1, 2 }), "ignored rectangles damage nothing"sv);
+
+    expect(damage_t::add(AREA, { 0, 0, 20, AREA.y + 10 }, damaged, rects), "a rectangle overlapping the area is damage"sv);
+    expect(damage_t::add(AREA, { AREA.x, AREA.y + HEIGHT - 1, 10, 50 }, damaged, rects), "a rectangle overlapping the area is damage"sv);
+    expect(damaged == bands({ 0, 1, 2, 6 }), "a rectangle overlapping the area damages only the bands within it"sv);
+  }
+
+  {
+    damage_t damage;
+
+    // The first snapshot is taken regardless
+    expect(push(damage, {}), "the first generation is pushed even without damage"sv);
+    expect(damage.dirty_rows(0, 0, 0, HEIGHT) == rows_t { { 0, HEIGHT } }, "an image without a frame is copied in its entirety"sv);
+    expect(!push(damage, {}), "a generation without damage or a change of the cursor is dropped"sv);
+    expect(damage.generation() == 1, "a dropped generation isn't counted"sv);
+
+    expect(push(damage, { 1 }), "a generation with damage is pushed"sv);
+    expect(push(damage, { 2 }), "a generation with damage is pushed"sv);
+    expect(push(damage, { 5 }), "a generation with damage is pushed"sv);
+
+    expect(damage.dirty_rows(1, 0, 0, HEIGHT) == rows_t { { 16, 48 }, { 80, 96 } }, "the damage of every newer generation is copied, adjacent bands merged"sv);
+    expect(damage.dirty_rows(3, 0, 0, HEIGHT) == rows_t { { 80, 96 } }, "only the damage of newer generations is copied"sv);
+    expect(damage.dirty_rows(4, 0, 0, HEIGHT).empty(), "an image of the latest generation copies nothing"sv);
+
+    // The rows under the cursor blended into the image are copied again to remove it
+    expect(damage.dirty_rows(4, 30, 40, HEIGHT) == rows_t { { 16, 48 } }, "the bands under the cursor are copied again"sv);
+    expect(damage.dirty_rows(3, 90, HEIGHT, HEIGHT) == rows_t { { 80, HEIGHT } }, "the cursor merges with the damage, the last band ends at the bottom"sv);
+
+    expect(push(damage, {}, true), "a generation with a change of the cursor is pushed"sv);
+    expect(damage.dirty_rows(4, 30, 40, HEIGHT) == rows_t { { 16, 48 } }, "a change of the cursor alone damages nothing"sv);
+  }
+
+  {
+    damage_t damage;
+    push(damage, {});
+
+    for(int x = 0; x < platf::DAMAGE_HISTORY + 1; ++x) {
+      push(damage, { 0 });
+    }
+
+    auto generation = damage.generation();
+    expect(damage.dirty_rows(generation - platf::DAMAGE_HISTORY, 0, 0, HEIGHT) == rows_t { { 0, 16 } }, "an image DAMAGE_HISTORY generations old copies the damage"sv);
+    expect(damage.dirty_rows(generation - platf::DAMAGE_HISTORY - 1, 0, 0, HEIGHT) == rows_t { { 0, HEIGHT } }, "an image older than DAMAGE_HISTORY is copied in its entirety"sv);
+
+    // The area changed, the images hold the frames of a different area
+    damage.area_changed();
+    expect(damage.dirty_rows(generation, 0, 0, HEIGHT) == rows_t { { 0, HEIGHT } }, "after the area changed, an image is copied in its entirety"sv);
+    expect(push(damage, {}), "the first generation after the area changed is pushed even without damage"sv);
+    expect(damage.dirty_rows(generation, 0, 0, HEIGHT) == rows_t { { 0, HEIGHT } }, "an image from before the area changed is copied in its entirety"sv);
+    expect(damage.dirty_rows(generation + 1, 0, 0, HEIGHT).empty(), "an image from after the area changed copies only damage"sv);
+
+    // resize_img resets the generation of the image
+    expect(damage.dirty_rows(0, 0, 0, HEIGHT) == rows_t { { 0, HEIGHT } }, "a resized image is copied in its entirety"sv);
+  }
+
+  {
+    damage_t damage;
+
+    platf::rect_t rect { 0, 0, 1, 1 };
+    damage.push(bands({ 0 }), { rect }, false);
+    expect(damage.recent().size() == 1, "the damage of the first generations is recent"sv);
+
+    for(int x = 0; x < platf::RECENT_DAMAGE + 1; ++x) {
+      damage.push(bands({ 0 }), { rect }, false);
+    }
+    expect(damage.recent().size() == platf::RECENT_DAMAGE, "only the damage of the latest RECENT_DAMAGE generations is recent"sv);
+  }
+
+  if(failed) {
+    std::cerr << failed << " checks failed"sv << std::endl;
+    return 1;
+  }
+
+  std::cout << "All checks passed"sv << std::endl;
+  return 0;
+}
@@ -0,0 +1,143 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string_view>
+
+#include "sunshine/encoder_input.h"
+
+using namespace std::literals;
+
+using frame_t = std::unique_ptr<int>;
+using input_t = video::encoder_input_t<frame_t>;
+using schedule_t = video::encode_schedule_t<frame_t>;
+
+int failed = 0;
+
+void expect(bool condition, std::string_view what) {
+  if(!condition) {
+    std::cerr << "Failed: "sv << what << std::endl;
+    ++failed;
+  }
+}
+
+// The clock of the schedule, advanced by hand
+std::chrono::steady_clock::time_point now;
+
+std::chrono::steady_clock::time_point clock_now() {
+  return now;
+}
+
+/**
+ * The frame the schedule returns for encoding, the input is stopped if wait() keeps waiting
+ * returns the value of the frame, -1 if there's nothing to encode
+ */
+int next(input_t &input, schedule_t &schedule) {
+  auto encode = std::async(std::launch::async, [&]() {
+    return schedule.wait(input, clock_now);
+  });
+
+  if(encode.wait_for(100ms) == std::future_status::timeout) {
+    input.stop();
+  }
+
+  if(!encode.get()) {
+    return -1;
+  }
+
+  return *schedule.frame;
+}
+
+int main() {
+  auto begin = std::chrono::steady_clock::time_point {} + 1h;
+  now = begin;
+
+  {
+    // Requests before the first frame are answered by the first frame, an IDR frame regardless
+    input_t input;
+    schedule_t schedule;
+
+    input.raise_idr({ 1, 1 });
+    expect(next(input, schedule) == -1, "a request without any frame encodes nothing"sv);
+  }
+
+  {
+    input_t input;
+    schedule_t schedule;
+
+    input.raise(std::make_unique<int>(1), begin);
+    expect(next(input, schedule) == 1, "a new frame is encoded"sv);
+    expect(!schedule.repeat, "a new frame isn't a repeat"sv);
+    expect(!schedule.request, "a new frame without a request answers no request"sv);
+    expect(schedule.captured == begin, "a new frame keeps its capture time"sv);
+
+    // A newer frame replaces one the encoder didn't get to
+    input.raise(std::make_unique<int>(2), begin + 1ms);
+    input.raise(std::make_unique<int>(3), begin + 2ms);
+    expect(next(input, schedule) == 3, "only the latest frame is encoded"sv);
+    expect(!schedule.repeat, "the latest frame isn't a repeat"sv);
+
+    // A request without a new frame encodes the latest frame again
+    now = begin + 10ms;
+    input.raise_idr({ 2, 3 });
+    expect(next(input, schedule) == 3, "a request encodes the latest frame again"sv);
+    expect(schedule.repeat, "the frame answering a request without a new frame is a repeat"sv);
+    expect(schedule.request && *schedule.request == video::idr_t { 2, 3 }, "the request is passed on"sv);
+    schedule.recovered(4);
+
+    // The client repeats its request until the recovery frame arrives
+    now = begin + 20ms;
+    input.raise_idr({ 2, 3 });
+    expect(next(input, schedule) == -1, "a repeated request covered by the recovery frame is coalesced"sv);
+  }
+
+  {
+    input_t input;
+    schedule_t schedule;
+
+    input.raise(std::make_unique<int>(1), begin);
+    next(input, schedule);
+
+    // Requests the encoder hasn't got to are merged
+    input.raise_idr({ 5, 6 });
+    input.raise_idr({ 3, 4 });
+    input.raise(std::make_unique<int>(2), begin + 1ms);
+    expect(next(input, schedule) == 2, "a new frame with a request encodes the new frame"sv);
+    expect(!schedule.repeat, "a new frame answering a request isn't a repeat"sv);
+    expect(schedule.request && *schedule.request == video::idr_t { 3, 6 }, "pending requests are merged"sv);
+    schedule.recovered(7);
+
+    // A request for frames after the recovery frame is answered
+    input.raise_idr({ 8, 9 });
+    expect(next(input, schedule) == 2, "a request for frames after the recovery frame is answered"sv);
+    expect(schedule.request && schedule.repeat, "the request is answered by a repeat"sv);
+    schedule.recovered(10);
+
+    // A repeated request is answered again once the recovery frame had time to arrive
+    now += video::IDR_COALESCE;
+    input.raise_idr({ 8, 9 });
+    expect(next(input, schedule) == 2, "a request is answered again after IDR_COALESCE"sv);
+    expect(schedule.request && schedule.repeat, "the repeated request is answered by a repeat"sv);
+    schedule.recovered(11);
+
+    // A new frame is encoded even if the request that came with it is coalesced
+    input.raise_idr({ 8, 9 });
+    input.raise(std::make_unique<int>(3), begin + 2ms);
+    expect(next(input, schedule) == 3, "a new frame is encoded along with a coalesced request"sv);
+    expect(!schedule.request, "the coalesced request is dropped"sv);
+
+    input.stop();
+    expect(next(input, schedule) == -1, "wait() returns false once stopped"sv);
+  }
+
+  if(failed) {
+    std::cerr << failed << " checks failed"sv << std::endl;
+    return 1;
+  }
+
+  std::cout << "All checks passed"sv << std::endl;
+  return 0;
+}
@@ -0,0 +1,88 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include <rs.h>
+}
+
+#include "sunshine/fec.h"
+
+using namespace std::literals;
+using rs_t = util::safe_ptr<reed_solomon, reed_solomon_release>;
+
+// Data and parity shards
+constexpr std::pair<int, int> SHAPES[] {
+  { 1, 1 }, { 2, 1 }, { 3, 2 }, { 4, 1 }, { 10, 2 }, { 16, 4 }, { 31, 7 }, { 64, 13 },
+  { 128, 26 }, { 200, 40 }, { 212, 43 }, { 250, 5 }, { 5, 250 }
+};
+
+// Lengths around the strips of the kernels, an odd length also leaves every shard but the first unaligned
+constexpr int BLOCK_SIZES[] { 1, 15, 16, 17, 31, 33, 63, 64, 65, 127, 129, 255, 1024, 1040, 1292, 1400, 1401 };
+
+constexpr std::string_view KERNELS[] { "c"sv, "ssse3"sv, "avx2"sv };
+
+int main() {
+  reed_solomon_init();
+
+  std::mt19937 rng { 20201017 };
+
+  int failed = 0;
+  int tested = 0;
+  for(auto kernel : KERNELS) {
+    if(fec::use_kernel(kernel)) {
+      std::cout << "Skipping kernel "sv << kernel << ", the CPU doesn't support it"sv << std::endl;
+      continue;
+    }
+
+    for(auto [data_shards, parity_shards] : SHAPES) {
+      for(auto blocksize : BLOCK_SIZES) {
+        auto nr_shards = data_shards + parity_shards;
+
+        fec::fec_t fec {};
+        fec.data_shards = data_shards;
+        fec.nr_shards = nr_shards;
+        fec.blocksize = blocksize;
+        fec.shards = util::buffer_t<char> { (std::size_t)nr_shards * blocksize };
+
+        for(int x = 0; x < data_shards * blocksize; ++x) {
+          fec.shards[x] = (char)rng();
+        }
+
+        // The parity of reed_solomon_encode() is the reference
+        std::vector<char> expected { std::begin(fec.shards), std::end(fec.shards) };
+
+        std::vector<unsigned char*> shards(nr_shards);
+        for(int x = 0; x < nr_shards; ++x) {
+          shards[x] = (unsigned char*)&expected[x * blocksize];
+        }
+
+        rs_t rs { reed_solomon_new(data_shards, parity_shards) };
+        reed_solomon_encode(rs.get(), shards.data(), nr_shards, blocksize);
+
+        fec::encode(fec);
+
+        ++tested;
+        if(std::memcmp(expected.data(), std::begin(fec.shards), expected.size())) {
+          std::cerr << "Kernel "sv << kernel << ": parity of "sv << data_shards << '+' << parity_shards
+                    << " shards of "sv << blocksize << " bytes differs from reed_solomon_encode()"sv << std::endl;
+          ++failed;
+        }
+      }
+    }
+  }
+
+  if(failed) {
+    std::cerr << failed << " of "sv << tested << " blocks failed"sv << std::endl;
+    return 1;
+  }
+
+  std::cout << "All "sv << tested << " blocks are identical to reed_solomon_encode()"sv << std::endl;
+  return 0;
+}
@@ -0,0 +1,148 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <iostream>
+#include <string_view>
+
+#include "sunshine/frame_filter.h"
+
+using namespace std::literals;
+
+using filter_t = stream::frame_filter_t;
+
+int failed = 0;
+
+void expect(bool condition, std::string_view what) {
+  if(!condition) {
+    std::cerr << "Failed: "sv << what << std::endl;
+    ++failed;
+  }
+}
+
+auto now = std::chrono::steady_clock::time_point {} + 1h;
+
+constexpr auto DEADLINE = 10ms;
+
+struct frame_t {
+  std::int64_t pts;
+
+  bool key;
+  bool recovery;
+  bool reference;
+
+  // How long ago the frame was captured
+  std::chrono::milliseconds age;
+};
+
+/**
+ * Pass every block of frame through the filter, the frame is sent if none of its blocks is dropped
+ * lost -- The queue dropped packets before the first block
+ * returns true if the frame was dropped
+ */
+bool drop(filter_t &filter, const frame_t &frame, std::optional<filter_t::recover_t> &recover, int blocks = 2, bool lost = false) {
+  recover.reset();
+
+  bool dropped {};
+  for(int x = 0; x < blocks; ++x) {
+    filter_t::block_t block { frame.pts, x, frame.key, frame.recovery, frame.reference, now - frame.age };
+
+    std::optional<filter_t::recover_t> block_recover;
+    dropped |= filter.drop(block, lost && x == 0, now, block_recover);
+    if(block_recover) {
+      expect(!recover, "recovery is requested only once per frame"sv);
+      recover = block_recover;
+    }
+  }
+
+  if(!dropped) {
+    filter.sent(frame.pts);
+  }
+
+  return dropped;
+}
+
+int main() {
+  std::optional<filter_t::recover_t> recover;
+
+  {
+    filter_t filter { DEADLINE };
+
+    expect(!drop(filter, { 1, true, false, true, 0ms }, recover), "a frame within its deadline is sent"sv);
+    expect(!drop(filter, { 2, false, false, true, 5ms }, recover), "a frame within its deadline is sent"sv);
+    expect(!recover, "sent frames request no recovery"sv);
+
+    // A late reference frame breaks every frame after it
+    expect(drop(filter, { 3, false, false, true, 20ms }, recover), "a frame past its deadline is dropped"sv);
+    expect(recover == filter_t::recover_t { 3, 3 }, "a dropped reference frame requests recovery from the frame after the last one sent"sv);
+
+    expect(drop(filter, { 4, false, false, true, 0ms }, recover), "frames referring to a dropped frame are dropped"sv);
+    expect(!recover, "recovery is requested once until the recovery frame arrives"sv);
+
+    // The recovery frame is sent regardless of its deadline
+    expect(!drop(filter, { 5, false, true, true, 20ms }, recover), "a late recovery frame is sent"sv);
+    expect(!drop(filter, { 6, true, false, true, 20ms }, recover), "a late key frame is sent"sv);
+    expect(!drop(filter, { 7, false, false, true, 0ms }, recover), "frames after the recovery frame are sent"sv);
+    expect(filter.last_sent() == 7, "last_sent() is the last frame sent"sv);
+
+    // Nothing refers to a non-reference frame
+    expect(drop(filter, { 8, false, false, false, 20ms }, recover), "a late non-reference frame is dropped"sv);
+    expect(!recover, "a dropped non-reference frame requests no recovery"sv);
+    expect(!drop(filter, { 9, false, false, true, 0ms }, recover), "the frame after a dropped non-reference frame is sent"sv);
+
+    expect(filter.late_frames == 2, "late_frames counts the frames past their deadline"sv);
+    expect(filter.dropped_frames == 3, "dropped_frames counts the frames dropped"sv);
+  }
+
+  {
+    filter_t filter { DEADLINE };
+
+    expect(!drop(filter, { 1, true, false, true, 0ms }, recover), "a frame within its deadline is sent"sv);
+
+    // The packets the queue dropped may have been a reference frame
+    drop(filter, { 4, false, false, true, 0ms }, recover, 2, true);
+    expect(recover == filter_t::recover_t { 2, 4 }, "packets lost in the queue request recovery from the frame after the last one sent"sv);
+    expect(drop(filter, { 5, false, false, true, 0ms }, recover), "frames after lost packets are dropped until the recovery frame"sv);
+    expect(!drop(filter, { 6, false, true, true, 0ms }, recover), "the recovery frame is sent"sv);
+
+    // A frame missing its first block can't be decoded
+    filter_t::block_t block { 7, 1, false, false, true, now };
+    expect(filter.drop(block, false, now, recover), "a frame missing its first blocks is dropped"sv);
+    expect(recover == filter_t::recover_t { 7, 7 }, "a reference frame missing its first blocks requests recovery"sv);
+    expect(drop(filter, { 8, false, false, true, 0ms }, recover), "frames after an incomplete frame are dropped"sv);
+    expect(!drop(filter, { 9, false, true, true, 0ms }, recover), "the recovery frame is sent"sv);
+  }
+
+  {
+    filter_t filter { DEADLINE };
+
+    expect(!drop(filter, { 1, true, false, true, 0ms }, recover), "a frame within its deadline is sent"sv);
+
+    // The rest of a frame that couldn't be sent is dropped
+    filter_t::block_t block { 2, 0, false, false, true, now };
+    expect(!filter.drop(block, false, now, recover), "a frame within its deadline is sent"sv);
+    expect(filter.failed(2) == filter_t::recover_t { 2, 2 }, "a frame that couldn't be sent requests recovery from itself"sv);
+
+    block.block_index = 1;
+    expect(filter.drop(block, false, now, recover), "the rest of a frame that couldn't be sent is dropped"sv);
+    expect(drop(filter, { 3, false, false, true, 0ms }, recover), "frames after a frame that couldn't be sent are dropped"sv);
+    expect(!drop(filter, { 4, false, true, true, 0ms }, recover), "the recovery frame is sent"sv);
+    expect(filter.dropped_frames == 2, "dropped_frames counts the frame that couldn't be sent"sv);
+  }
+
+  {
+    filter_t filter { 0ms };
+
+    expect(!drop(filter, { 1, true, false, true, 0ms }, recover), "a frame is sent"sv);
+    expect(!drop(filter, { 2, false, false, true, 1h }, recover), "without a deadline, no frame is late"sv);
+    expect(filter.late_frames == 0, "without a deadline, no frame is late"sv);
+  }
+
+  if(failed) {
+    std::cerr << failed << " checks failed"sv << std::endl;
+    return 1;
+  }
+
+  std::cout << "All checks passed"sv << std::endl;
+  return 0;
+}
@@ -0,0 +1,154 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+#include "sunshine/pacer.h"
+
+using namespace std::literals;
+
+using time_point = std::chrono::steady_clock::time_point;
+
+int failed = 0;
+
+void expect(bool condition, std::string_view what) {
+  if(!condition) {
+    std::cerr << "Failed: "sv << what << std::endl;
+    ++failed;
+  }
+}
+
+// The bucket converts through floating point seconds
+bool near(std::chrono::nanoseconds a, std::chrono::nanoseconds b) {
+  return a - b < 1us && b - a < 1us;
+}
+
+bool near(const std::vector<time_point> &a, const std::vector<time_point> &b) {
+  if(a.size() != b.size()) {
+    return false;
+  }
+
+  for(std::size_t x = 0; x < a.size(); ++x) {
+    if(!near(a[x] - b[x], 0ns)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+constexpr std::size_t SHARD_SIZE = 1000;
+
+// A full bucket holds a burst of PACING_BURST shards
+constexpr std::size_t DEPTH = stream::PACING_BURST * SHARD_SIZE;
+
+// 1 byte per microsecond, a full bucket refills in 8ms
+constexpr double RATE = 1000 * 1000;
+
+// The clock of the test, advanced by hand
+time_point now = time_point {} + 1h;
+
+/**
+ * Send count shards the way pacer_t::send does, the clock is read before each burst and sleeping advances it
+ * cost -- The time sending a burst takes
+ * returns the times the bursts left
+ */
+std::vector<time_point> pace(stream::token_bucket_t &bucket, std::size_t count, double rate, std::chrono::nanoseconds cost = 0ns) {
+  std::vector<time_point> send_times;
+
+  for(std::size_t x = 0; x < count; x += stream::PACING_BURST) {
+    auto batch = std::min<std::size_t>(count - x, stream::PACING_BURST);
+
+    auto send_time = bucket.take(now, batch * SHARD_SIZE, rate, DEPTH);
+    now = std::max(now, send_time);
+
+    send_times.emplace_back(send_time);
+    now += cost;
+  }
+
+  return send_times;
+}
+
+int main() {
+  {
+    auto window = 8ms;
+
+    expect(stream::pacing_rate(8000, 50, 1000, window) == 2000 * 1000, "a frame smaller than the bitrate allows is sent at the bitrate over the window"sv);
+    expect(stream::pacing_rate(8000, 50, 80000, window) == 10 * 1000 * 1000, "a frame larger than the bitrate allows is still sent within the window"sv);
+    expect(stream::pacing_rate(0, 50, 80000, window) == 10 * 1000 * 1000, "without a bitrate the frame is sent within the window"sv);
+  }
+
+  {
+    stream::token_bucket_t bucket;
+    auto begin = now;
+
+    // A full bucket lets a single burst through, the bursts after it wait for the bucket to refill
+    auto send_times = pace(bucket, 3 * stream::PACING_BURST, RATE);
+    expect(near(send_times, { begin, begin + 8ms, begin + 16ms }), "bursts leave at the fill rate once the bucket is empty"sv);
+    expect(bucket.delayed == 2, "delayed counts the bursts held back"sv);
+    expect(near(bucket.delay, 16ms), "delay is the time bursts were held back"sv);
+
+    // An idle bucket refills
+    now = begin + 100ms;
+    begin = now;
+    send_times = pace(bucket, 2 * stream::PACING_BURST + 4, RATE);
+    expect(near(send_times, { begin, begin + 8ms, begin + 12ms }), "a smaller burst waits only for the tokens it needs"sv);
+  }
+
+  {
+    stream::token_bucket_t bucket;
+    auto begin = now;
+
+    pace(bucket, stream::PACING_BURST, RATE);
+
+    // Half the bucket refilled
+    now = begin + 4ms;
+    auto send_times = pace(bucket, stream::PACING_BURST / 2, RATE);
+    expect(near(send_times, { begin + 4ms }), "a burst no larger than the tokens in the bucket leaves right away"sv);
+
+    send_times = pace(bucket, stream::PACING_BURST, RATE);
+    expect(near(send_times, { begin + 12ms }), "a burst waits until the bucket holds enough tokens for it"sv);
+  }
+
+  {
+    stream::token_bucket_t bucket;
+    auto begin = now;
+    std::chrono::nanoseconds window = 8ms;
+
+    // A frame of 10 bursts spread over the window
+    auto count = 10 * stream::PACING_BURST;
+    auto rate = stream::pacing_rate(0, 50, count * SHARD_SIZE, window);
+    auto send_times = pace(bucket, count, rate);
+
+    std::vector<time_point> expected;
+    for(int x = 0; x < 10; ++x) {
+      expected.emplace_back(begin + window * x / 10);
+    }
+    expect(near(send_times, expected), "the bursts of a frame are spread evenly over the window"sv);
+  }
+
+  {
+    stream::token_bucket_t bucket;
+    auto begin = now;
+    auto delay = bucket.delay;
+
+    // The queue delay of videoThread counts the time spent sending, not the time the pacer held the bursts back
+    auto send_times = pace(bucket, 3 * stream::PACING_BURST, RATE, 1ms);
+    auto send_time = now - begin - (bucket.delay - delay);
+
+    expect(near(send_times, { begin, begin + 8ms, begin + 16ms }), "the time spent sending is part of the pacing window"sv);
+    expect(near(now - begin, 17ms), "the frame took 17ms to send"sv);
+    expect(near(send_time, 3ms), "without the pacing delay, the time spent sending remains"sv);
+  }
+
+  if(failed) {
+    std::cerr << failed << " checks failed"sv << std::endl;
+    return 1;
+  }
+
+  std::cout << "All checks passed"sv << std::endl;
+  return 0;
+}
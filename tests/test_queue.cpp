@@ -0,0 +1,120 @@
+//
+// Created by loki on 10/17/20.
+//
+
+#include <iostream>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "sunshine/video.h"
+
+using namespace std::literals;
+
+namespace video {
+// The packets of this test carry no AVPacket
+void free_packet(AVPacket *packet) {
+}
+}
+
+int failed = 0;
+
+void expect(bool condition, std::string_view what) {
+  if(!condition) {
+    std::cerr << "Failed: "sv << what << std::endl;
+    ++failed;
+  }
+}
+
+video::packet_t make_packet(std::int64_t frame, bool reference) {
+  auto packet = std::make_unique<video::packet_raw_t>(nullptr);
+  packet->block_index = (int)frame;
+  packet->reference = reference;
+
+  return packet;
+}
+
+/**
+ * The frames left in the queue, in the order they're popped
+ */
+std::vector<std::int64_t> frames(safe::queue_t<video::packet_t> &queue) {
+  std::vector<std::int64_t> result;
+  while(queue.peek()) {
+    result.emplace_back(queue.pop()->block_index);
+  }
+
+  return result;
+}
+
+int main() {
+  {
+    safe::queue_t<video::packet_t> queue { 3, video::droppable("drop_oldest"sv) };
+    for(int frame = 0; frame < 5; ++frame) {
+      queue.raise(make_packet(frame, frame % 2));
+    }
+
+    expect(queue.dropped() == 2, "drop_oldest counts the dropped packets"sv);
+    expect(frames(queue) == std::vector<std::int64_t> { 2, 3, 4 }, "drop_oldest drops the oldest packets"sv);
+  }
+
+  {
+    // Frames 1 and 3 are references
+    safe::queue_t<video::packet_t> queue { 3, video::droppable("drop_non_reference"sv) };
+    for(int frame = 0; frame < 5; ++frame) {
+      queue.raise(make_packet(frame, frame % 2));
+    }
+
+    expect(queue.dropped() == 2, "drop_non_reference counts the dropped packets"sv);
+    expect(frames(queue) == std::vector<std::int64_t> { 1, 3, 4 }, "drop_non_reference drops the oldest non-reference packets first"sv);
+  }
+
+  {
+    // libx264 makes every P-frame a reference frame
+    safe::queue_t<video::packet_t> queue { 3, video::droppable("drop_non_reference"sv) };
+    for(int frame = 0; frame < 5; ++frame) {
+      queue.raise(make_packet(frame, true));
+    }
+
+    expect(queue.dropped() == 2, "drop_non_reference without non-reference packets counts the dropped packets"sv);
+    expect(frames(queue) == std::vector<std::int64_t> { 2, 3, 4 }, "drop_non_reference falls back to dropping the oldest packets"sv);
+  }
+
+  {
+    expect(!video::droppable("block"sv), "block drops nothing"sv);
+
+    safe::queue_t<video::packet_t> queue { 2, video::droppable("block"sv) };
+    queue.raise(make_packet(0, true));
+    queue.raise(make_packet(1, true));
+
+    // The third packet waits until there is room again
+    std::thread encoder { [&queue]() {
+      queue.raise(make_packet(2, true));
+    } };
+
+    std::this_thread::sleep_for(50ms);
+    expect(queue.size() == 2, "block waits for room"sv);
+    expect(queue.pop()->block_index == 0, "block pops the oldest packet first"sv);
+
+    encoder.join();
+    expect(queue.dropped() == 0, "block drops nothing"sv);
+    expect(frames(queue) == std::vector<std::int64_t> { 1, 2 }, "block keeps every packet"sv);
+  }
+
+  {
+    // An unbounded queue never drops anything
+    safe::queue_t<video::packet_t> queue { 0, video::droppable("drop_oldest"sv) };
+    for(int frame = 0; frame < 100; ++frame) {
+      queue.raise(make_packet(frame, false));
+    }
+
+    expect(queue.dropped() == 0 && queue.size() == 100, "an unbounded queue drops nothing"sv);
+  }
+
+  if(failed) {
+    std::cerr << failed << " checks failed"sv << std::endl;
+    return 1;
+  }
+
+  std::cout << "All checks passed"sv << std::endl;
+  return 0;
+}